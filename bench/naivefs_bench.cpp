@@ -0,0 +1,321 @@
+// microbenchmarks of the engine over MemDisk, no FUSE involved
+
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <memory>
+#include <new>
+#include <optional>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "nfs/config.hpp"
+#include "nfs/disk.hpp"
+#include "nfs/imap.hpp"
+#include "nfs/metrics.hpp"
+#include "nfs/nfs.hpp"
+#include "nfs/seg.hpp"
+#include "nfs/sim_disk.hpp"
+
+// new is backed by malloc below, which gcc cannot see through
+#pragma GCC diagnostic ignored "-Wmismatched-new-delete"
+
+static std::atomic<uint64_t> g_allocs{0};
+
+void *operator new(size_t size) {
+  g_allocs.fetch_add(1, std::memory_order_relaxed);
+  if (auto ptr = malloc(size))
+    return ptr;
+  throw std::bad_alloc();
+}
+
+void operator delete(void *ptr) noexcept { free(ptr); }
+void operator delete(void *ptr, size_t) noexcept { free(ptr); }
+
+namespace {
+
+constexpr uint32_t kFileBlocks = 4096; // 16 MiB files
+// no gc runs behind the benchmarks, the log written must fit the disk
+constexpr uint32_t kAppends = 2048;
+constexpr uint32_t kAppendSize = 128;
+// directories are read whole on every lookup, see Inode::for_each_entry_once
+constexpr uint32_t kDirEntries = 400;
+constexpr uint32_t kGCRounds = 8;
+constexpr uint32_t kGCInterval = 256;
+constexpr uint32_t kImapEntries = 1 << 20;
+constexpr uint32_t kCheckpoints = 50;
+
+struct Result {
+  std::string name;
+  uint64_t ops;
+  uint64_t bytes;
+  uint64_t ns;
+  uint64_t allocs;
+};
+
+std::vector<Result> results;
+
+// time body, which performs ops operations moving bytes bytes
+void measure(const std::string &name, const uint64_t ops, const uint64_t bytes,
+             const std::function<void()> &body) {
+  auto allocs = g_allocs.load();
+  auto start = Metrics::now_ns();
+  body();
+  auto ns = Metrics::now_ns() - start;
+  results.push_back({name, ops, bytes, ns, g_allocs.load() - allocs});
+}
+
+// device shaping applied to every disk, none by default
+std::optional<SimProfile> profile;
+const char *profile_name = "none";
+
+std::unique_ptr<Disk> make_disk() {
+  std::unique_ptr<Disk> disk =
+      std::make_unique<MemDisk>(nullptr, kDiskCapacityMB);
+  if (profile.has_value())
+    disk = std::make_unique<SimDisk>(std::move(disk), profile.value());
+  return disk;
+}
+
+std::unique_ptr<NaiveFS> make_fs() {
+  return std::make_unique<NaiveFS>(make_disk(), false);
+}
+
+void bench_file_io() {
+  auto fs = make_fs();
+  std::vector<char> buf(kBlockSize, 'x');
+  std::mt19937 rng(42);
+  auto fd = fs->open("/file", O_CREAT | O_RDWR);
+  measure("seq_write_4k", kFileBlocks, uint64_t(kFileBlocks) * kBlockSize,
+          [&] {
+            for (uint32_t i = 0; i < kFileBlocks; i++)
+              fs->write(fd, buf.data(), i * kBlockSize, kBlockSize);
+          });
+  auto rfd = fs->open("/file", O_RDONLY);
+  measure("seq_read_4k", kFileBlocks, uint64_t(kFileBlocks) * kBlockSize,
+          [&] {
+            for (uint32_t i = 0; i < kFileBlocks; i++)
+              fs->read(rfd, buf.data(), i * kBlockSize, kBlockSize);
+          });
+  measure("rand_write_4k", kFileBlocks, uint64_t(kFileBlocks) * kBlockSize,
+          [&] {
+            for (uint32_t i = 0; i < kFileBlocks; i++)
+              fs->write(fd, buf.data(), rng() % kFileBlocks * kBlockSize,
+                        kBlockSize);
+          });
+  measure("rand_read_4k", kFileBlocks, uint64_t(kFileBlocks) * kBlockSize,
+          [&] {
+            for (uint32_t i = 0; i < kFileBlocks; i++)
+              fs->read(rfd, buf.data(), rng() % kFileBlocks * kBlockSize,
+                       kBlockSize);
+          });
+  auto afd = fs->open("/append", O_CREAT | O_WRONLY | O_APPEND);
+  measure("small_append", kAppends, uint64_t(kAppends) * kAppendSize, [&] {
+    for (uint32_t i = 0; i < kAppends; i++)
+      fs->write(afd, buf.data(), 0, kAppendSize);
+  });
+  for (auto handle : {fd, rfd, afd})
+    fs->release(handle);
+}
+
+// the same sequential pass with compression on, over json-like lines
+void bench_compression() {
+  auto fs = make_fs();
+  fs->set_compress(true);
+  std::string text;
+  for (uint32_t i = 0; text.size() < kBlockSize * 2; i++)
+    text += "{\"id\": " + std::to_string(i * 7919) +
+            ", \"level\": \"info\", \"msg\": \"request served\"}\n";
+  std::vector<char> buf(kBlockSize);
+  auto fd = fs->open("/text", O_CREAT | O_RDWR);
+  measure("seq_write_4k_lz", kFileBlocks, uint64_t(kFileBlocks) * kBlockSize,
+          [&] {
+            for (uint32_t i = 0; i < kFileBlocks; i++)
+              fs->write(fd, text.data() + i % kBlockSize, i * kBlockSize,
+                        kBlockSize);
+          });
+  measure("seq_read_4k_lz", kFileBlocks, uint64_t(kFileBlocks) * kBlockSize,
+          [&] {
+            for (uint32_t i = 0; i < kFileBlocks; i++)
+              fs->read(fd, buf.data(), i * kBlockSize, kBlockSize);
+          });
+  fs->release(fd);
+}
+
+// a second copy of a file with dedup on, every block of it is a hit
+void bench_dedup() {
+  auto fs = make_fs();
+  fs->set_dedup(true);
+  std::vector<char> buf(kBlockSize);
+  auto fill = [&](const uint32_t i) {
+    for (uint32_t j = 0; j < kBlockSize; j += 4)
+      std::memcpy(buf.data() + j, &i, 4);
+  };
+  auto fd = fs->open("/layer", O_CREAT | O_RDWR);
+  for (uint32_t i = 0; i < kFileBlocks; i++) {
+    fill(i);
+    fs->write(fd, buf.data(), i * kBlockSize, kBlockSize);
+  }
+  auto copy = fs->open("/copy", O_CREAT | O_RDWR);
+  measure("dup_write_4k", kFileBlocks, uint64_t(kFileBlocks) * kBlockSize,
+          [&] {
+            for (uint32_t i = 0; i < kFileBlocks; i++) {
+              fill(i);
+              fs->write(copy, buf.data(), i * kBlockSize, kBlockSize);
+            }
+          });
+  measure("seq_read_4k_dedup", kFileBlocks, uint64_t(kFileBlocks) * kBlockSize,
+          [&] {
+            for (uint32_t i = 0; i < kFileBlocks; i++)
+              fs->read(copy, buf.data(), i * kBlockSize, kBlockSize);
+          });
+  fs->release(fd);
+  fs->release(copy);
+}
+
+void bench_directory() {
+  auto fs = make_fs();
+  fs->mkdir("/dir", 0);
+  std::vector<std::string> paths;
+  for (uint32_t i = 0; i < kDirEntries; i++)
+    paths.push_back("/dir/file" + std::to_string(i));
+  measure("create", kDirEntries, 0, [&] {
+    for (const auto &path : paths)
+      fs->release(fs->open(path.c_str(), O_CREAT));
+  });
+  measure("lookup", kDirEntries, 0, [&] {
+    for (const auto &path : paths)
+      fs->get_inode_idx(path);
+  });
+  measure("unlink", kDirEntries, 0, [&] {
+    for (const auto &path : paths)
+      fs->unlink(path.c_str());
+  });
+}
+
+void bench_gc_and_checkpoint() {
+  auto fs = make_fs();
+  std::vector<char> buf(kBlockSize, 'x');
+  std::mt19937 rng(42);
+  // overwrite a file many times its size, checkpointing and cleaning
+  // periodically the way the background threads do
+  constexpr uint32_t blocks = kDiskCapacityMB * 1024 * 1024 / kBlockSize / 8;
+  auto fd = fs->open("/file", O_CREAT | O_RDWR);
+  for (uint32_t i = 0; i < blocks; i++)
+    fs->write(fd, buf.data(), i * kBlockSize, kBlockSize);
+  auto copied = Metrics::get(Metrics::Counter::kGCBytesCopied);
+  uint64_t passes = 0, gc_ns = 0, gc_allocs = 0;
+  for (uint32_t i = 0; i < blocks * kGCRounds; i++) {
+    fs->write(fd, buf.data(), rng() % blocks * kBlockSize, kBlockSize);
+    if (i % kGCInterval != 0)
+      continue;
+    // gc ranks segments by the checkpoint they were written in
+    fs->fsync();
+    auto allocs = g_allocs.load();
+    auto start = Metrics::now_ns();
+    if (fs->gc()) {
+      passes += 1;
+      gc_ns += Metrics::now_ns() - start;
+      gc_allocs += g_allocs.load() - allocs;
+    }
+  }
+  results.push_back({"gc_pass", passes,
+                     Metrics::get(Metrics::Counter::kGCBytesCopied) - copied,
+                     gc_ns, gc_allocs});
+  uint64_t ns = 0, allocs = 0;
+  for (uint32_t i = 0; i < kCheckpoints; i++) {
+    fs->write(fd, buf.data(), rng() % blocks * kBlockSize, kBlockSize);
+    // every checkpoint seals the open segment
+    while (fs->gc())
+      ;
+    auto allocs_before = g_allocs.load();
+    auto start = Metrics::now_ns();
+    fs->fsync();
+    ns += Metrics::now_ns() - start;
+    allocs += g_allocs.load() - allocs_before;
+  }
+  results.push_back({"checkpoint", kCheckpoints, 0, ns, allocs});
+  fs->release(fd);
+}
+
+void bench_imap() {
+  auto cr = std::make_unique<char[]>(kCRImapSize);
+  Imap imap(cr.get());
+  measure("imap_update", kImapEntries, 0, [&] {
+    for (uint32_t i = 0; i < kImapEntries; i++)
+      imap.update(i, i + 1);
+  });
+  uint64_t sum = 0;
+  measure("imap_get", kImapEntries, 0, [&] {
+    for (uint32_t i = 0; i < kImapEntries; i++)
+      sum += imap.get(i);
+  });
+  if (sum == 0)
+    abort();
+}
+
+void bench_segments() {
+  auto disk = make_disk();
+  auto cr = std::make_unique<char[]>(kCRImapSize);
+  Imap imap(cr.get());
+  auto seg_status = Disk::align_alloc(kMaxSegments * 8);
+  std::memset(seg_status.get(), 0, kMaxSegments * 8);
+  SegmentsManager seg_mgr(disk.get(), &imap, std::move(seg_status));
+  auto block = Disk::align_alloc(kBlockSize);
+  std::memset(block.get(), 'x', kBlockSize);
+  std::vector<uint32_t> addrs(kFileBlocks, DiskInode::INVALID_ADDR);
+  constexpr uint32_t pushes = kFileBlocks * 4;
+  measure("segment_push_4k", pushes, uint64_t(pushes) * kBlockSize, [&] {
+    for (uint32_t i = 0; i < pushes; i++) {
+      auto &addr = addrs[i % kFileBlocks];
+      addr = seg_mgr.push(std::make_tuple(block.get(), 1u,
+                                          DiskInode::encode(0)),
+                          addr);
+    }
+  });
+}
+
+void print_json() {
+  printf("{\n  \"disk_capacity_mb\": %u,\n  \"profile\": \"%s\",\n"
+         "  \"benchmarks\": [\n",
+         kDiskCapacityMB, profile_name);
+  for (uint32_t i = 0; i < results.size(); i++) {
+    const auto &r = results[i];
+    auto seconds = r.ns / 1e9;
+    printf("    {\"name\": \"%s\", \"ops\": %llu, \"seconds\": %.6f, "
+           "\"ops_per_sec\": %.1f, \"bytes_per_sec\": %.1f, "
+           "\"allocs_per_op\": %.2f}%s\n",
+           r.name.c_str(), static_cast<unsigned long long>(r.ops), seconds,
+           seconds == 0 ? 0 : r.ops / seconds,
+           seconds == 0 ? 0 : r.bytes / seconds,
+           r.ops == 0 ? 0 : static_cast<double>(r.allocs) / r.ops,
+           i + 1 == results.size() ? "" : ",");
+  }
+  printf("  ]\n}\n");
+}
+
+} // namespace
+
+// naivefs_bench [none|ssd|hdd]
+int main(int argc, char **argv) {
+  if (argc > 1) {
+    profile = SimProfile::of(argv[1]);
+    if (!profile.has_value()) {
+      fprintf(stderr, "usage: %s [none|ssd|hdd]\n", argv[0]);
+      return 1;
+    }
+    profile_name = argv[1];
+  }
+  bench_file_io();
+  bench_compression();
+  bench_dedup();
+  bench_directory();
+  bench_gc_and_checkpoint();
+  bench_imap();
+  bench_segments();
+  print_json();
+  return 0;
+}
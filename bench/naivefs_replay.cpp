@@ -0,0 +1,234 @@
+// replay a trace recorded with -o optrace=<file> against NaiveFS, no FUSE
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "nfs/config.hpp"
+#include "nfs/disk.hpp"
+#include "nfs/metrics.hpp"
+#include "nfs/nfs.hpp"
+#include "nfs/optrace.hpp"
+#include "nfs/sim_disk.hpp"
+
+namespace {
+
+struct Args {
+  const char *trace = nullptr;
+  const char *backend = "mem";
+  const char *disk = kDiskPath;
+  const char *sim = nullptr;
+  // keep the recorded gaps between calls instead of issuing them back to back
+  bool original_speed = false;
+  bool stats = false;
+};
+
+void usage(const char *prog) {
+  fprintf(stderr,
+          "usage: %s [--backend file|mmap|mem] [--disk <path>] "
+          "[--sim none|ssd|hdd] [--original-speed] [--stats] <trace>\n",
+          prog);
+  exit(1);
+}
+
+Args parse(int argc, char **argv) {
+  Args args;
+  for (int i = 1; i < argc; i++) {
+    auto has_value = i + 1 < argc;
+    if (strcmp(argv[i], "--backend") == 0 && has_value)
+      args.backend = argv[++i];
+    else if (strcmp(argv[i], "--disk") == 0 && has_value)
+      args.disk = argv[++i];
+    else if (strcmp(argv[i], "--sim") == 0 && has_value)
+      args.sim = argv[++i];
+    else if (strcmp(argv[i], "--original-speed") == 0)
+      args.original_speed = true;
+    else if (strcmp(argv[i], "--stats") == 0)
+      args.stats = true;
+    else if (argv[i][0] != '-' && args.trace == nullptr)
+      args.trace = argv[i];
+    else
+      usage(argv[0]);
+  }
+  if (args.trace == nullptr || !Disk::backend_of(args.backend).has_value() ||
+      (args.sim != nullptr && !SimProfile::of(args.sim).has_value()))
+    usage(argv[0]);
+  return args;
+}
+
+class Replayer {
+  NaiveFS &fs_;
+  // recorded handle -> handle of the replay
+  std::unordered_map<uint64_t, uint64_t> fds_;
+  std::vector<char> buf_;
+
+  uint32_t inode_of(const OpTrace::Entry &entry) {
+    if (entry.rec.fh != 0)
+      return fs_.get_inode_idx(fd_of(entry.rec.fh));
+    return fs_.get_inode_idx(entry.path);
+  }
+
+  uint64_t fd_of(const uint64_t fh) {
+    auto it = fds_.find(fh);
+    if (it == fds_.end())
+      throw NoFd();
+    return it->second;
+  }
+
+public:
+  explicit Replayer(NaiveFS &fs) : fs_(fs) {}
+
+  void apply(const OpTrace::Entry &entry) {
+    using Op = OpTrace::Op;
+    const auto &rec = entry.rec;
+    switch (entry.op()) {
+    case Op::kGetattr:
+      fs_.get_diskinode(inode_of(entry));
+      break;
+    case Op::kMkdir:
+      fs_.mkdir(entry.path.c_str(), rec.flags);
+      break;
+    case Op::kUnlink:
+    case Op::kRmdir:
+      fs_.unlink(entry.path.c_str());
+      break;
+    case Op::kRename:
+      fs_.rename(entry.path.c_str(), entry.path2.c_str(), rec.flags);
+      break;
+    case Op::kTruncate:
+      fs_.truncate(inode_of(entry), rec.offset);
+      break;
+    case Op::kOpen:
+    case Op::kCreate:
+      fds_[rec.fh] = fs_.open(entry.path.c_str(), rec.flags);
+      break;
+    case Op::kRead:
+      buf_.resize(std::max<size_t>(buf_.size(), rec.size));
+      fs_.read(fd_of(rec.fh), buf_.data(), rec.offset, rec.size);
+      break;
+    case Op::kWrite:
+      // the data is not recorded, only where it went
+      buf_.resize(std::max<size_t>(buf_.size(), rec.size));
+      fs_.write(fd_of(rec.fh), buf_.data(), rec.offset, rec.size);
+      break;
+    case Op::kFlush:
+      fs_.flush(fd_of(rec.fh));
+      break;
+    case Op::kRelease:
+      fs_.release(fd_of(rec.fh));
+      fds_.erase(rec.fh);
+      break;
+    case Op::kFsync:
+      if (rec.fh != 0)
+        fs_.fsync(fd_of(rec.fh));
+      else
+        fs_.fsync();
+      break;
+    case Op::kReaddir:
+      // flags is set for readdirplus
+      fs_.readdir(entry.path.c_str(), rec.offset,
+                  [this, &rec](const std::string_view, const uint32_t idx,
+                               const uint32_t) {
+                    if (rec.flags != 0)
+                      fs_.get_diskinode(idx);
+                    return true;
+                  });
+      break;
+    case Op::kFallocate:
+      fs_.fallocate(fd_of(rec.fh), rec.flags, rec.offset, rec.size);
+      break;
+    case Op::kLseek:
+      fs_.lseek(fd_of(rec.fh), rec.offset, rec.flags);
+      break;
+    case Op::kCopyFileRange:
+      fs_.copy_file_range(fd_of(rec.fh2), rec.offset2, fd_of(rec.fh),
+                          rec.offset, rec.size);
+      break;
+    case Op::kSnapshot:
+      if (rec.flags != 0)
+        fs_.delete_snapshot(entry.path);
+      else
+        fs_.create_snapshot(entry.path);
+      break;
+    default:
+      break;
+    }
+  }
+};
+
+} // namespace
+
+int main(int argc, char **argv) {
+  auto args = parse(argc, argv);
+  auto file = fopen(args.trace, "rb");
+  if (file == nullptr) {
+    perror(args.trace);
+    return 1;
+  }
+  OpTrace::Reader reader(file);
+  if (!reader.valid()) {
+    fprintf(stderr, "%s is not an op trace\n", args.trace);
+    return 1;
+  }
+  auto disk = Disk::make(Disk::backend_of(args.backend).value(), args.disk,
+                         kDiskCapacityMB);
+  if (args.sim != nullptr)
+    disk = std::make_unique<SimDisk>(std::move(disk),
+                                     SimProfile::of(args.sim).value());
+  NaiveFS fs(std::move(disk));
+  Replayer replayer(fs);
+
+  constexpr uint32_t kNumOps = static_cast<uint32_t>(OpTrace::Op::kNumTimers);
+  uint64_t ops[kNumOps] = {}, errors[kNumOps] = {};
+  uint64_t recorded_ns[kNumOps] = {}, replayed_ns[kNumOps] = {};
+  uint64_t last_ns = 0;
+  OpTrace::Entry entry;
+  auto start = Metrics::now_ns();
+  while (reader.next(entry)) {
+    auto op = entry.rec.op;
+    if (op >= kNumOps)
+      continue;
+    if (args.original_speed) {
+      auto due = start + entry.rec.ns;
+      auto now = Metrics::now_ns();
+      if (due > now)
+        std::this_thread::sleep_for(std::chrono::nanoseconds(due - now));
+    }
+    auto begin = Metrics::now_ns();
+    try {
+      replayer.apply(entry);
+    } catch (...) {
+      errors[op] += 1;
+    }
+    replayed_ns[op] += Metrics::now_ns() - begin;
+    recorded_ns[op] += entry.rec.dur_ns;
+    ops[op] += 1;
+    last_ns = std::max<uint64_t>(last_ns, entry.rec.ns + entry.rec.dur_ns);
+  }
+  auto elapsed_ns = Metrics::now_ns() - start;
+
+  printf("{\n  \"trace\": \"%s\",\n  \"recorded_seconds\": %.6f,\n"
+         "  \"replayed_seconds\": %.6f,\n  \"ops\": [\n",
+         args.trace, last_ns / 1e9, elapsed_ns / 1e9);
+  bool first = true;
+  for (uint32_t i = 0; i < kNumOps; i++) {
+    if (ops[i] == 0)
+      continue;
+    printf("%s    {\"name\": \"%s\", \"count\": %llu, \"errors\": %llu, "
+           "\"recorded_avg_us\": %.2f, \"replayed_avg_us\": %.2f}",
+           first ? "" : ",\n", Metrics::timer_name(i),
+           static_cast<unsigned long long>(ops[i]),
+           static_cast<unsigned long long>(errors[i]),
+           recorded_ns[i] / 1e3 / ops[i], replayed_ns[i] / 1e3 / ops[i]);
+    first = false;
+  }
+  printf("\n  ]\n}\n");
+  if (args.stats)
+    fprintf(stderr, "%s", fs.stats().c_str());
+  return 0;
+}
@@ -0,0 +1,186 @@
+# mdtest-like metadata benchmark, prints one JSON object
+#
+#   JOBS=4 DIRS=8 FILES=256 FILE_SIZE=4096 sh scripts/bench_meta.sh > meta.json
+#
+# every job works in its own directory tree, phases run the jobs concurrently
+# and a phase ends when its slowest job does. set NFS_OPTS to pass extra
+# options to the mount, e.g. NFS_OPTS=-s for a single threaded run.
+
+JOBS=${JOBS:-4}
+DIRS=${DIRS:-8}
+FILES=${FILES:-256}
+FILE_SIZE=${FILE_SIZE:-4096}
+TREE_DIRS=${TREE_DIRS:-64}
+TREE_FILES=${TREE_FILES:-32}
+
+sh scripts/clear.sh
+mkdir build
+cd build
+cmake -DCMAKE_BUILD_TYPE=Release .. 1>&2 || exit
+make -j4 1>&2 || exit
+mkdir disk
+./nfs $NFS_OPTS disk || exit
+sleep 1
+cd ..
+
+MNT=build/disk
+WORK=/tmp/naivefs_bench_meta
+rm -rf $WORK
+mkdir -p $WORK
+head -c $FILE_SIZE /dev/urandom > $WORK/payload
+
+now() {
+    date +%s%N
+}
+
+# names of the files of job $1, one per line
+files_of() {
+    d=0
+    while [ $d -lt $DIRS ]; do
+        seq -f "$MNT/job$1/dir$d/f%06g" 0 $((FILES - 1))
+        d=$((d + 1))
+    done
+}
+
+# run "$@" once per job with the job index appended, wait for all of them
+run_jobs() {
+    j=0
+    while [ $j -lt $JOBS ]; do
+        "$@" $j &
+        j=$((j + 1))
+    done
+    wait
+}
+
+phase_mkdir() {
+    d=0
+    while [ $d -lt $DIRS ]; do
+        mkdir -p $MNT/job$1/dir$d
+        d=$((d + 1))
+    done
+}
+
+phase_create() {
+    files_of $1 | xargs -n 512 touch
+}
+
+phase_write() {
+    files_of $1 |
+        xargs -n 512 sh -c 'tee "$@" < '$WORK/payload' > /dev/null' tee
+}
+
+phase_stat() {
+    files_of $1 | xargs -n 512 stat > /dev/null
+}
+
+phase_read() {
+    files_of $1 | xargs -n 512 cat > /dev/null
+}
+
+phase_readdir() {
+    d=0
+    while [ $d -lt $DIRS ]; do
+        ls -f $MNT/job$1/dir$d > /dev/null
+        d=$((d + 1))
+    done
+}
+
+phase_walk() {
+    find $MNT/job$1 -type f | wc -l > /dev/null
+}
+
+# one mv per file, the process start dominates unless the fs is slow
+phase_rename() {
+    files_of $1 | while read f; do
+        mv $f $f.r
+    done
+}
+
+phase_unlink() {
+    files_of $1 | sed 's/$/.r/' | xargs -n 512 rm
+}
+
+phase_rmdir() {
+    d=0
+    while [ $d -lt $DIRS ]; do
+        rmdir $MNT/job$1/dir$d
+        d=$((d + 1))
+    done
+    rmdir $MNT/job$1
+}
+
+# a source tree of small files, extracted like an untar of a project
+make_tree() {
+    d=0
+    while [ $d -lt $TREE_DIRS ]; do
+        mkdir -p $WORK/tree/src/mod$((d % 8))/sub$d
+        f=0
+        while [ $f -lt $TREE_FILES ]; do
+            head -c $(((d * 131 + f * 977) % 16384 + 64)) $WORK/payload \
+                > $WORK/tree/src/mod$((d % 8))/sub$d/file$f.c
+            f=$((f + 1))
+        done
+        d=$((d + 1))
+    done
+    tar -cf $WORK/tree.tar -C $WORK tree
+}
+
+phase_untar() {
+    mkdir $MNT/untar$1
+    tar -xf $WORK/tree.tar -C $MNT/untar$1
+}
+
+phase_untar_rm() {
+    rm -rf $MNT/untar$1
+}
+
+FIRST=1
+echo "{"
+echo "  \"jobs\": $JOBS, \"dirs\": $DIRS, \"files\": $FILES,"
+echo "  \"file_size\": $FILE_SIZE,"
+echo "  \"phases\": ["
+
+# phase <name> <ops> <function>
+phase() {
+    start=$(now)
+    run_jobs $3
+    end=$(now)
+    ns=$((end - start))
+    if [ $FIRST -eq 0 ]; then
+        echo ","
+    fi
+    FIRST=0
+    awk -v name=$1 -v ops=$2 -v ns=$ns 'BEGIN {
+        printf "    {\"name\": \"%s\", \"ops\": %d, \"seconds\": %.6f, ", \
+            name, ops, ns / 1e9
+        printf "\"ops_per_sec\": %.1f}", ops / (ns / 1e9)
+    }'
+}
+
+N=$((JOBS * DIRS * FILES))
+DIR_OPS=$((JOBS * DIRS))
+TREE_OPS=$((JOBS * TREE_DIRS * (TREE_FILES + 1)))
+
+phase mkdir $DIR_OPS phase_mkdir
+phase create $N phase_create
+phase write $N phase_write
+phase stat $N phase_stat
+phase read $N phase_read
+phase readdir $DIR_OPS phase_readdir
+phase walk $N phase_walk
+phase rename $N phase_rename
+phase unlink $N phase_unlink
+phase rmdir $DIR_OPS phase_rmdir
+make_tree
+phase untar $TREE_OPS phase_untar
+phase untar_rm $TREE_OPS phase_untar_rm
+
+echo ""
+echo "  ],"
+printf '  "stats": "'
+tr '\n' ';' < $MNT/.naivefs/stats
+echo '"'
+echo "}"
+
+fusermount -u $MNT
+rm -rf $WORK
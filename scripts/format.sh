@@ -1 +1 @@
-find src/ -name *.cpp -or -name *.hpp | xargs clang-format --verbose -i
+find src/ bench/ tests/ -name *.cpp -or -name *.hpp | xargs clang-format --verbose -i
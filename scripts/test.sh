@@ -8,4 +8,9 @@ sh scripts/clear.sh
 
 sh scripts/test_persistence.sh > /tmp/out.log || exit
 diff scripts/test_persistence.out /tmp/out.log || exit
-echo ">>> test_persistence PASSED"
\ No newline at end of file
+echo ">>> test_persistence PASSED"
+sh scripts/clear.sh
+
+sh scripts/test_cache.sh > /tmp/out.log || exit
+diff scripts/test_cache.out /tmp/out.log || exit
+echo ">>> test_cache PASSED"
@@ -0,0 +1,41 @@
+mkdir build
+cd build
+cmake .. 1> /dev/null || exit
+make 1> /dev/null || exit
+
+# the kernel caches entries, attributes and pages, every change made through
+# the mount must still show right away
+mkdir disk
+./nfs -d -o cache_timeout=60 disk > test_cache.log 2>&1 &
+NFS_PID=$!
+>&2 echo "nfs running in ${NFS_PID}"
+sleep 1
+
+cd disk
+echo hello > foo
+cat foo
+ls -x
+echo world >> foo
+cat foo
+truncate -s 3 foo
+cat foo
+echo
+mv foo bar
+ls -x
+cat foo 2> /dev/null || echo "no foo"
+mkdir .naivefs/snapshots/snap
+ls -x .naivefs/snapshots
+rm bar
+ls -x
+cat bar 2> /dev/null || echo "no bar"
+rmdir .naivefs/snapshots/snap
+ls -x .naivefs/snapshots
+echo "snapshots listed"
+cd ..
+
+if ps -p $NFS_PID > /dev/null; then
+   kill -9 $NFS_PID
+else
+   echo "nfs exited"
+   exit 1
+fi
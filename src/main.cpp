@@ -1,11 +1,45 @@
+#include <cstddef>
+#include <cstdio>
+#include <cstdlib>
 #include <iostream>
 
 #include <fuse3/fuse.h>
+#include <fuse3/fuse_opt.h>
 
+#include "nfs/disk.hpp"
+#include "nfs/sim_disk.hpp"
 #include "vfs.hpp"
 
+// -o backend=file|mmap|mem,disk=<path>,sim=none|ssd|hdd,sim_torn=<rate>,
+//    optrace=<file>,compress,dedup,snapshot=<name>,cache_timeout=<seconds>
+static const fuse_opt nfs_opts[] = {
+    {"backend=%s", offsetof(vfs::Options, backend), 0},
+    {"disk=%s", offsetof(vfs::Options, disk), 0},
+    {"sim=%s", offsetof(vfs::Options, sim), 0},
+    {"sim_torn=%lf", offsetof(vfs::Options, sim_torn), 0},
+    {"optrace=%s", offsetof(vfs::Options, optrace), 0},
+    {"compress", offsetof(vfs::Options, compress), 1},
+    {"dedup", offsetof(vfs::Options, dedup), 1},
+    {"snapshot=%s", offsetof(vfs::Options, snapshot), 0},
+    {"cache_timeout=%lf", offsetof(vfs::Options, cache_timeout), 0},
+    FUSE_OPT_END,
+};
+
 fuse_args fuse_init(int argc, char **argv) {
   fuse_args args = FUSE_ARGS_INIT(argc, argv);
+  if (fuse_opt_parse(&args, &vfs::options, nfs_opts, nullptr) == -1)
+    exit(1);
+  if (!Disk::backend_of(vfs::options.backend).has_value()) {
+    fprintf(stderr, "unknown backend %s, expected file, mmap or mem\n",
+            vfs::options.backend);
+    exit(1);
+  }
+  if (vfs::options.sim != nullptr &&
+      !SimProfile::of(vfs::options.sim).has_value()) {
+    fprintf(stderr, "unknown sim profile %s, expected none, ssd or hdd\n",
+            vfs::options.sim);
+    exit(1);
+  }
   return args;
 }
 
@@ -20,11 +54,18 @@ fuse_operations bind_ops() {
       .open = vfs::open,
       .read = vfs::read,
       .write = vfs::write,
+      .flush = vfs::flush,
+      .release = vfs::release,
       .fsync = vfs::fsync,
       .readdir = vfs::readdir,
+      .init = vfs::init,
+      .destroy = vfs::destroy,
       .access = vfs::access,
       .create = vfs::create,
       .utimens = vfs::utimens,
+      .fallocate = vfs::fallocate,
+      .copy_file_range = vfs::copy_file_range,
+      .lseek = vfs::lseek,
   };
   return nfs_op;
 }
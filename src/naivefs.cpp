@@ -0,0 +1,336 @@
+#include "naivefs.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <new>
+#include <string>
+
+#include "nfs/config.hpp"
+#include "nfs/disk.hpp"
+#include "nfs/metrics.hpp"
+#include "nfs/nfs.hpp"
+#include "nfs/optrace.hpp"
+#include "nfs/sim_disk.hpp"
+#include "nfs/span.hpp"
+#include "nfs/trace.hpp"
+#include "nfs/utils.hpp"
+
+namespace naivefs {
+
+// time an entry point and record it as the root span of the request
+#define NFS_OP(timer)                                                          \
+  NFS_TIMER(timer);                                                            \
+  NFS_SPAN(Metrics::timer_name(static_cast<uint32_t>(Metrics::Timer::timer)))
+
+namespace {
+
+using Op = OpTrace::Op;
+
+// run f, turning what the engine throws into a negative errno
+template <typename F> int guard(F &&f) {
+  try {
+    f();
+  } catch (const NoEntry &e) {
+    return -ENOENT;
+  } catch (const NoImapEntry &e) {
+    return -ENOENT;
+  } catch (const DuplicateEntry &e) {
+    return -EEXIST;
+  } catch (const NotEmpty &e) {
+    return -ENOTEMPTY;
+  } catch (const NoData &e) {
+    return -ENXIO;
+  } catch (const NotSupported &e) {
+    return -EOPNOTSUPP;
+  } catch (const InvalidArgument &e) {
+    return -EINVAL;
+  } catch (const FileTooBig &e) {
+    return -EFBIG;
+  } catch (const ReadOnly &e) {
+    return -EROFS;
+  } catch (const NoFd &e) {
+    return -EBADF;
+  } catch (const DiskSyncFailed &e) {
+    return -EIO;
+  } catch (const CorruptBlock &e) {
+    return -EIO;
+  } catch (const std::bad_alloc &e) {
+    return -ENOMEM;
+  }
+  return 0;
+}
+
+void fill_stat(const DiskInode &disk_inode, const uint32_t inode_idx,
+               Stat &st) {
+  st.ino = inode_idx;
+  st.mode = disk_inode.mode;
+  st.nlink = disk_inode.link_cnt;
+  st.uid = disk_inode.uid;
+  st.gid = disk_inode.gid;
+  st.size = disk_inode.size;
+  st.blocks = disk_inode.st_blocks();
+  st.atime = disk_inode.access_time;
+  st.mtime = disk_inode.modify_time;
+  st.ctime = disk_inode.change_time;
+}
+
+} // namespace
+
+struct Volume::Impl {
+  std::unique_ptr<NaiveFS> fs;
+  bool recording = false;
+};
+
+Volume::Volume(std::unique_ptr<Impl> impl) : impl_(std::move(impl)) {}
+
+std::unique_ptr<Volume> Volume::open(const std::string &path,
+                                     const VolumeOptions &options) {
+  auto backend = Disk::backend_of(options.backend);
+  if (!backend.has_value())
+    return nullptr;
+  auto impl = std::make_unique<Impl>();
+  try {
+    auto disk = Disk::make(backend.value(), path.c_str(), kDiskCapacityMB);
+    if (!options.sim.empty()) {
+      auto profile = SimProfile::of(options.sim);
+      if (!profile.has_value())
+        return nullptr;
+      profile->torn_rate = options.sim_torn;
+      disk = std::make_unique<SimDisk>(std::move(disk), profile.value());
+    }
+    impl->fs = std::make_unique<NaiveFS>(
+        std::move(disk), options.background && options.snapshot.empty(),
+        options.snapshot);
+    impl->fs->set_compress(options.compress);
+    impl->fs->set_dedup(options.dedup);
+  } catch (const DiskOpenFailed &e) {
+    NFS_TRACE(kError, kDisk, "cannot open {}", path.c_str());
+    return nullptr;
+  } catch (const NoEntry &e) {
+    NFS_TRACE(kError, kFS, "no snapshot {}", options.snapshot.c_str());
+    return nullptr;
+  }
+  if (!options.optrace.empty()) {
+    if (!OpTrace::start(options.optrace.c_str()))
+      return nullptr;
+    impl->recording = true;
+  }
+  return std::unique_ptr<Volume>(new Volume(std::move(impl)));
+}
+
+Volume::~Volume() {
+  impl_->fs.reset();
+  if (impl_->recording)
+    OpTrace::stop();
+}
+
+int Volume::stat(const char *path, Stat &st) {
+  NFS_OP(kGetattr);
+  OpTrace::Scope trace(Op::kGetattr, path);
+  return guard([&] {
+    auto inode_idx = impl_->fs->get_inode_idx(path);
+    fill_stat(*impl_->fs->get_diskinode(inode_idx), inode_idx, st);
+  });
+}
+
+int Volume::fstat(const uint64_t fh, Stat &st) {
+  NFS_OP(kGetattr);
+  OpTrace::Scope trace(Op::kGetattr, nullptr, fh);
+  return guard([&] {
+    auto inode_idx = impl_->fs->get_inode_idx(fh);
+    fill_stat(*impl_->fs->get_diskinode(inode_idx), inode_idx, st);
+  });
+}
+
+int Volume::mkdir(const char *path, const uint32_t mode) {
+  NFS_OP(kMkdir);
+  OpTrace::Scope trace(Op::kMkdir, path, 0, 0, 0, mode);
+  return guard([&] { impl_->fs->mkdir(path, mode); });
+}
+
+int Volume::rmdir(const char *path) {
+  NFS_OP(kRmdir);
+  OpTrace::Scope trace(Op::kRmdir, path);
+  return guard([&] { impl_->fs->unlink(path); });
+}
+
+int Volume::unlink(const char *path) {
+  NFS_OP(kUnlink);
+  OpTrace::Scope trace(Op::kUnlink, path);
+  return guard([&] { impl_->fs->unlink(path); });
+}
+
+int Volume::rename(const char *old_path, const char *new_path,
+                   const uint32_t flags) {
+  NFS_OP(kRename);
+  OpTrace::Scope trace(Op::kRename, old_path, 0, 0, 0, flags, new_path);
+  return guard([&] { impl_->fs->rename(old_path, new_path, flags); });
+}
+
+int Volume::readdir(const char *path, std::vector<std::string> &names) {
+  NFS_OP(kReaddir);
+  OpTrace::Scope trace(Op::kReaddir, path);
+  return guard([&] { names = impl_->fs->readdir(path); });
+}
+
+int Volume::readdir(
+    const char *path, const uint64_t offset,
+    const std::function<bool(const char *, const Stat *, uint64_t)> &fill,
+    const bool plus) {
+  NFS_OP(kReaddir);
+  OpTrace::Scope trace(Op::kReaddir, path, 0, offset, 0, plus);
+  return guard([&] {
+    if (offset > UINT32_MAX)
+      return;
+    std::string name;
+    Stat st;
+    impl_->fs->readdir(
+        path, offset,
+        [&](const std::string_view this_name, const uint32_t inode_idx,
+            const uint32_t next_offset) {
+          name.assign(this_name);
+          if (plus)
+            fill_stat(*impl_->fs->get_diskinode(inode_idx), inode_idx, st);
+          return fill(name.c_str(), plus ? &st : nullptr, next_offset);
+        });
+  });
+}
+
+int Volume::utimens(const char *path, const double atime, const double mtime) {
+  NFS_OP(kUtimens);
+  OpTrace::Scope trace(Op::kUtimens, path);
+  return guard([&] {
+    auto inode_idx = impl_->fs->get_inode_idx(path);
+    auto disk_inode = impl_->fs->get_diskinode(inode_idx);
+    disk_inode->access_time = atime;
+    disk_inode->modify_time = mtime;
+    impl_->fs->modify(std::move(disk_inode), inode_idx);
+  });
+}
+
+int Volume::open(const char *path, const int flags, uint64_t &fh) {
+  NFS_OP(kOpen);
+  OpTrace::Scope trace(Op::kOpen, path, 0, 0, 0, flags);
+  auto ret = guard([&] { fh = impl_->fs->open(path, flags); });
+  if (ret == 0)
+    trace.set_fh(fh);
+  return ret;
+}
+
+int64_t Volume::read(const uint64_t fh, char *buf, const uint32_t size,
+                     const uint64_t offset) {
+  NFS_OP(kRead);
+  OpTrace::Scope trace(Op::kRead, nullptr, fh, offset, size);
+  uint32_t done = 0;
+  auto ret = guard([&] { done = impl_->fs->read(fh, buf, offset, size); });
+  return ret == 0 ? static_cast<int64_t>(done) : ret;
+}
+
+int64_t Volume::write(const uint64_t fh, const char *buf, const uint32_t size,
+                      const uint64_t offset) {
+  NFS_OP(kWrite);
+  OpTrace::Scope trace(Op::kWrite, nullptr, fh, offset, size);
+  auto ret = guard([&] {
+    if (offset > UINT32_MAX || offset + size > UINT32_MAX)
+      throw FileTooBig();
+    impl_->fs->write(fh, const_cast<char *>(buf), offset, size);
+  });
+  return ret == 0 ? static_cast<int64_t>(size) : ret;
+}
+
+int Volume::truncate(const char *path, const uint64_t size) {
+  NFS_OP(kTruncate);
+  OpTrace::Scope trace(Op::kTruncate, path, 0, size);
+  return guard([&] {
+    if (size > UINT32_MAX)
+      throw FileTooBig();
+    impl_->fs->truncate(impl_->fs->get_inode_idx(path), size);
+  });
+}
+
+int Volume::ftruncate(const uint64_t fh, const uint64_t size) {
+  NFS_OP(kTruncate);
+  OpTrace::Scope trace(Op::kTruncate, nullptr, fh, size);
+  return guard([&] {
+    if (size > UINT32_MAX)
+      throw FileTooBig();
+    impl_->fs->truncate(impl_->fs->get_inode_idx(fh), size);
+  });
+}
+
+int Volume::fallocate(const uint64_t fh, const int mode, const uint64_t offset,
+                      const uint64_t size) {
+  NFS_OP(kFallocate);
+  OpTrace::Scope trace(Op::kFallocate, nullptr, fh, offset, size, mode);
+  return guard([&] { impl_->fs->fallocate(fh, mode, offset, size); });
+}
+
+int64_t Volume::lseek(const uint64_t fh, const uint64_t offset,
+                      const int whence) {
+  NFS_OP(kLseek);
+  OpTrace::Scope trace(Op::kLseek, nullptr, fh, offset, 0, whence);
+  uint64_t pos = 0;
+  auto ret = guard([&] { pos = impl_->fs->lseek(fh, offset, whence); });
+  return ret == 0 ? static_cast<int64_t>(pos) : ret;
+}
+
+int64_t Volume::copy_file_range(const uint64_t fh_in, const uint64_t offset_in,
+                                const uint64_t fh_out,
+                                const uint64_t offset_out,
+                                const uint64_t size) {
+  NFS_OP(kCopyFileRange);
+  OpTrace::Scope trace(Op::kCopyFileRange, nullptr, fh_out, offset_out,
+                       std::min<uint64_t>(size, UINT32_MAX));
+  trace.set_source(fh_in, offset_in);
+  uint64_t done = 0;
+  auto ret = guard([&] {
+    done = impl_->fs->copy_file_range(fh_in, offset_in, fh_out, offset_out,
+                                      size);
+  });
+  return ret == 0 ? static_cast<int64_t>(done) : ret;
+}
+
+int Volume::flush(const uint64_t fh) {
+  NFS_OP(kFlush);
+  OpTrace::Scope trace(Op::kFlush, nullptr, fh);
+  return guard([&] { impl_->fs->flush(fh); });
+}
+
+int Volume::release(const uint64_t fh) {
+  NFS_OP(kRelease);
+  OpTrace::Scope trace(Op::kRelease, nullptr, fh);
+  return guard([&] { impl_->fs->release(fh); });
+}
+
+int Volume::fsync(const uint64_t fh) {
+  NFS_OP(kFsync);
+  OpTrace::Scope trace(Op::kFsync, nullptr, fh);
+  return guard([&] { impl_->fs->fsync(fh); });
+}
+
+int Volume::sync() {
+  NFS_OP(kFsync);
+  OpTrace::Scope trace(Op::kFsync, nullptr);
+  return guard([&] { impl_->fs->fsync(); });
+}
+
+int Volume::snapshot(const char *name) {
+  NFS_OP(kSnapshot);
+  OpTrace::Scope trace(Op::kSnapshot, name);
+  return guard([&] { impl_->fs->create_snapshot(name); });
+}
+
+int Volume::delete_snapshot(const char *name) {
+  NFS_OP(kSnapshot);
+  OpTrace::Scope trace(Op::kSnapshot, name, 0, 0, 0, 1);
+  return guard([&] { impl_->fs->delete_snapshot(name); });
+}
+
+int Volume::list_snapshots(std::vector<std::string> &names) {
+  NFS_OP(kReaddir);
+  return guard([&] { names = impl_->fs->list_snapshots(); });
+}
+
+std::string Volume::stats() { return impl_->fs->stats(); }
+
+} // namespace naivefs
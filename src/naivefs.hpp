@@ -0,0 +1,122 @@
+// in-process api of the filesystem, what libnaivefs exports
+
+#pragma once
+
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+/*
+  A Volume is one filesystem on one disk image. Paths are absolute, handles
+  from open are only valid on the volume which returned them, and errors are
+  returned as negative errno values like the FUSE callbacks do.
+
+    auto volume = naivefs::Volume::open("/tmp/disk");
+    uint64_t fh;
+    if (volume->open("/foo", O_CREAT | O_RDWR, fh) == 0) ...
+
+  Only one volume per process can record an op trace, opening a second one
+  with optrace fails.
+*/
+
+namespace naivefs {
+
+struct VolumeOptions {
+  // file, mmap or mem
+  std::string backend = "file";
+  // a SimDisk profile wrapping the backend: none, ssd or hdd
+  std::string sim;
+  double sim_torn = 0;
+  // a file to record every call into, see OpTrace
+  std::string optrace;
+  // run gc, checkpoints and the stats dump in background threads
+  bool background = true;
+  // compress blocks with LZ before they go to the log
+  bool compress = false;
+  // store identical data blocks once
+  bool dedup = false;
+  // mount this snapshot read-only instead of the live filesystem
+  std::string snapshot;
+};
+
+struct Stat {
+  uint32_t ino;
+  uint32_t mode;
+  uint32_t nlink;
+  uint32_t uid;
+  uint32_t gid;
+  uint64_t size;
+  // in 512 byte units
+  uint64_t blocks;
+  double atime;
+  double mtime;
+  double ctime;
+};
+
+class Volume {
+  struct Impl;
+  std::unique_ptr<Impl> impl_;
+
+  explicit Volume(std::unique_ptr<Impl> impl);
+
+public:
+  // nullptr if the options are invalid or the disk cannot be opened
+  static std::unique_ptr<Volume> open(const std::string &path,
+                                      const VolumeOptions &options = {});
+
+  // checkpoints before returning
+  ~Volume();
+
+  Volume(const Volume &) = delete;
+  Volume &operator=(const Volume &) = delete;
+
+  int stat(const char *path, Stat &st);
+  int fstat(uint64_t fh, Stat &st);
+  int mkdir(const char *path, uint32_t mode);
+  int rmdir(const char *path);
+  int unlink(const char *path);
+  int rename(const char *old_path, const char *new_path, uint32_t flags);
+  int readdir(const char *path, std::vector<std::string> &names);
+  // fill(name, st, next_offset) for the entries from offset on until it
+  // returns false, st is only set with plus. The offsets are stable cookies
+  int readdir(const char *path, uint64_t offset,
+              const std::function<bool(const char *name, const Stat *st,
+                                       uint64_t next_offset)> &fill,
+              bool plus);
+  int utimens(const char *path, double atime, double mtime);
+
+  int open(const char *path, int flags, uint64_t &fh);
+  // bytes read or written. Files end at 4 GiB, past it write and truncate
+  // fail with -EFBIG
+  int64_t read(uint64_t fh, char *buf, uint32_t size, uint64_t offset);
+  int64_t write(uint64_t fh, const char *buf, uint32_t size, uint64_t offset);
+  int truncate(const char *path, uint64_t size);
+  int ftruncate(uint64_t fh, uint64_t size);
+  // holes read as zeros, nothing is reserved by plain allocation
+  int fallocate(uint64_t fh, int mode, uint64_t offset, uint64_t size);
+  // SEEK_DATA or SEEK_HOLE, the offset found
+  int64_t lseek(uint64_t fh, uint64_t offset, int whence);
+  // bytes copied, whole blocks are shared with the source rather than copied
+  // when both offsets are block aligned. Overlapping ranges of one file fail
+  // with -EINVAL
+  int64_t copy_file_range(uint64_t fh_in, uint64_t offset_in, uint64_t fh_out,
+                          uint64_t offset_out, uint64_t size);
+  int flush(uint64_t fh);
+  int release(uint64_t fh);
+  int fsync(uint64_t fh);
+  // checkpoint everything
+  int sync();
+
+  // a read-only copy of the whole volume as of now, only the checkpoint
+  // region is copied
+  int snapshot(const char *name);
+  int delete_snapshot(const char *name);
+  int list_snapshots(std::vector<std::string> &names);
+
+  // the content of /.naivefs/stats
+  std::string stats();
+};
+
+} // namespace naivefs
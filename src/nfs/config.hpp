@@ -5,16 +5,34 @@
 
 constexpr uint32_t kCRFlushingSeconds = 30;
 constexpr const char *kDiskPath = "/tmp/disk";
-constexpr uint32_t kMaxInode = 65536;
+constexpr const char *kStatsPath = "/tmp/naivefs.stats";
+constexpr uint32_t kStatsDumpSeconds = 10;
 constexpr uint32_t kFreeSegmentsUpperbound = 128;
 constexpr uint32_t kNumMergingSegments = 32;
 constexpr uint32_t kBlockSize = 4 * 1024;
 constexpr uint32_t kSegmentSize = 512 * 1024;
-constexpr uint32_t kSummarySize = 2048;
-constexpr uint32_t kCRImapSize = kMaxInode * 4 + 512;
-
-// for MemDisk
-constexpr uint32_t kMemDiskCapacityMB = 16;
+constexpr uint32_t kSummarySize = 8192;
+constexpr uint32_t kCompressUnit = 256;
+constexpr uint32_t kImapPageEntries = kBlockSize / 4;
+constexpr uint32_t kMaxImapPages = 16384;
+constexpr uint32_t kMaxInode = kImapPageEntries * kMaxImapPages;
+constexpr uint32_t kCRImapHeaderSize = 512;
+constexpr uint32_t kCRImapSize = kCRImapHeaderSize + kMaxImapPages * 4;
+constexpr uint32_t kCRIDSize = 512;
+constexpr uint32_t kIDBatchSize = 32;
+constexpr uint32_t kFDChunkSlots = 1024;
+constexpr uint32_t kFDMaxChunks = 1024;
+constexpr uint32_t kReadaheadSize = 128 * 1024;
+constexpr uint32_t kDirScanSize = 16 * 1024;
+constexpr uint32_t kInodeCacheBlocks = 256;
+constexpr uint32_t kDiscardSegmentsPerCheckpoint = 64;
+constexpr uint32_t kPoolBytesPerClass = 1024 * 1024;
+constexpr uint32_t kPoolObjects = 64;
+constexpr uint32_t kTraceRingEntries = 2048;
+constexpr uint32_t kTraceStrSize = 48;
+constexpr uint32_t kSpanRingEntries = 16384;
+constexpr uint32_t kLockSites = 64;
+constexpr uint32_t kLockTopSites = 5;
 
 #ifdef SMALL_DISK
 
@@ -34,4 +52,4 @@ constexpr uint32_t kFreeSegmentsLowerbound = 32;
 
 constexpr uint32_t kMaxSegments =
     kDiskCapacityMB * 1024 / (kSegmentSize / 1024);
-constexpr uint32_t kCRSize = kCRImapSize + kMaxSegments * 8;
\ No newline at end of file
+constexpr uint32_t kCRSize = kCRImapSize + kCRIDSize + kMaxSegments * 8;
\ No newline at end of file
@@ -0,0 +1,107 @@
+#pragma once
+
+#include <algorithm>
+#include <cstring>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#include "nfs/utils.hpp"
+
+/*
+  Read-only virtual files under /.naivefs, hidden from the root listing. The
+  content is generated once on open, so a reader sees a consistent snapshot.
+
+  Handles have the top bit set, FDManager never hands out such a handle.
+
+  /.naivefs/snapshots lists the snapshots of the volume, mkdir and rmdir in
+  it take and drop one. A snapshot is browsed by mounting it.
+*/
+
+class CtlFiles {
+  std::map<std::string, std::function<std::string()>, std::less<>> files_;
+  std::mutex lock_;
+  std::unordered_map<uint64_t, std::string> opened_;
+  uint64_t next_fh_ = 0;
+
+public:
+  static constexpr std::string_view kDir = "/.naivefs";
+  static constexpr uint64_t kFhFlag = 1ull << 63;
+
+  static bool is_ctl(const std::string_view path) {
+    return path.substr(0, kDir.length()) == kDir &&
+           (path.length() == kDir.length() || path[kDir.length()] == '/');
+  }
+
+  static constexpr std::string_view kSnapshots = "/.naivefs/snapshots";
+
+  static bool is_ctl(const uint64_t fh) { return (fh & kFhFlag) != 0; }
+
+  static bool is_dir(const std::string_view path) {
+    return path.length() == kDir.length() || path == kSnapshots;
+  }
+
+  // the name in /.naivefs/snapshots/<name>, empty for any other path
+  static std::string_view snapshot_of(const std::string_view path) {
+    if (path.substr(0, kSnapshots.length()) != kSnapshots ||
+        path.length() <= kSnapshots.length() + 1 ||
+        path[kSnapshots.length()] != '/')
+      return {};
+    auto name = path.substr(kSnapshots.length() + 1);
+    return name.find('/') == std::string_view::npos ? name
+                                                    : std::string_view{};
+  }
+
+  void add(std::string name, std::function<std::string()> generate) {
+    files_.emplace(std::move(name), std::move(generate));
+  }
+
+  bool exists(const std::string_view path) const {
+    return is_dir(path) ||
+           files_.find(path.substr(kDir.length() + 1)) != files_.end();
+  }
+
+  std::vector<std::string> list() const {
+    auto snapshots = kSnapshots.substr(kDir.length() + 1);
+    std::vector<std::string> names{std::string(snapshots)};
+    for (const auto &[name, _] : files_)
+      names.push_back(name);
+    return names;
+  }
+
+  uint64_t open(const std::string_view path) {
+    if (is_dir(path))
+      throw NoEntry();
+    auto it = files_.find(path.substr(kDir.length() + 1));
+    if (it == files_.end())
+      throw NoEntry();
+    auto content = it->second();
+    auto lock = std::unique_lock(lock_);
+    auto fh = kFhFlag | next_fh_++;
+    opened_.emplace(fh, std::move(content));
+    return fh;
+  }
+
+  uint32_t read(const uint64_t fh, char *buf, const uint32_t offset,
+                const uint32_t size) {
+    auto lock = std::unique_lock(lock_);
+    auto it = opened_.find(fh);
+    if (it == opened_.end())
+      throw NoFd();
+    const auto &content = it->second;
+    if (offset >= content.length())
+      return 0;
+    auto ret = std::min<uint32_t>(size, content.length() - offset);
+    std::memcpy(buf, content.data() + offset, ret);
+    return ret;
+  }
+
+  void release(const uint64_t fh) {
+    auto lock = std::unique_lock(lock_);
+    opened_.erase(fh);
+  }
+};
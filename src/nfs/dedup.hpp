@@ -0,0 +1,250 @@
+#pragma once
+
+#include <cassert>
+#include <cstdint>
+#include <cstring>
+#include <optional>
+#include <unordered_map>
+#include <vector>
+
+#include "nfs/config.hpp"
+#include "nfs/disk.hpp"
+#include "nfs/disk_inode.hpp"
+
+/*
+  Data blocks written with dedup on are stored once per distinct content. An
+  inode refers to such a block by a handle, kHandleBit | slot, instead of its
+  log address, and the slot holds the rest:
+
+    [fingerprint: uint64_t * 2, addr: uint32_t, refs: uint32_t] * N
+
+  A slot with no refs is free. The table is the content of a hidden file,
+  kPageEntries slots per block of it, and dirty pages are written at each
+  checkpoint. The stored blocks are owned by kOwner in segment summaries with
+  the slot as code, so the cleaner moves one by updating its slot only.
+
+  Fingerprints are not collision resistant, so SegmentsManager compares the
+  content behind a hit before sharing it, and stores a block which only
+  collides on its own. Not thread safe, SegmentsManager locks it.
+
+  A clone shares blocks through the table too. A block it shares in place is
+  adopted with a zero fingerprint, so it is never a hit, and still belongs to
+  the inode which wrote it in the summary until the cleaner moves it.
+*/
+
+class DedupTable {
+public:
+  // owner recorded in segment summaries, next to Imap::kPageOwner
+  static constexpr uint32_t kOwner = UINT32_MAX - 1;
+  // log addresses stay below 2 GiB, TEMPORARY_ADDR is no handle
+  static constexpr uint32_t kHandleBit = 1u << 31;
+  static_assert(uint64_t(kDiskCapacityMB) * 1024 * 1024 <= kHandleBit);
+
+  struct Fingerprint {
+    uint64_t lo;
+    uint64_t hi;
+
+    bool operator==(const Fingerprint &rhs) const {
+      return lo == rhs.lo && hi == rhs.hi;
+    }
+  };
+
+  struct Entry {
+    Fingerprint fp;
+    uint32_t addr;
+    uint32_t refs;
+  };
+  static constexpr uint32_t kPageEntries = kBlockSize / sizeof(Entry);
+
+private:
+  struct FingerprintHash {
+    size_t operator()(const Fingerprint &fp) const { return fp.lo; }
+  };
+
+  std::vector<Entry> entries_;
+  std::vector<bool> dirty_;
+  std::vector<uint32_t> free_;
+  std::unordered_map<Fingerprint, uint32_t, FingerprintHash> index_;
+  // adopted blocks not moved yet, by addr
+  std::unordered_map<uint32_t, uint32_t> adopted_;
+
+  static uint64_t mix(uint64_t v) {
+    v ^= v >> 33;
+    v *= 0xff51afd7ed558ccdull;
+    v ^= v >> 33;
+    v *= 0xc4ceb9fe1a85ec53ull;
+    return v ^ (v >> 33);
+  }
+
+  void touch(const uint32_t slot) { dirty_[slot / kPageEntries] = true; }
+
+  Entry &entry(const uint32_t slot) {
+    assert(slot < entries_.size());
+    return entries_[slot];
+  }
+
+  uint32_t allocate() {
+    if (free_.empty()) {
+      auto first = static_cast<uint32_t>(entries_.size());
+      entries_.resize(entries_.size() + kPageEntries, Entry{});
+      dirty_.push_back(true);
+      for (auto slot = first + kPageEntries; slot > first; slot--)
+        free_.push_back(slot - 1);
+    }
+    auto slot = free_.back();
+    free_.pop_back();
+    assert(slot < kHandleBit - 1);
+    return slot;
+  }
+
+  void unadopt(const uint32_t slot) {
+    auto it = adopted_.find(entries_[slot].addr);
+    if (it != adopted_.end() && it->second == slot)
+      adopted_.erase(it);
+  }
+
+public:
+  static bool is_handle(const uint32_t addr) {
+    return (addr & kHandleBit) != 0 && addr != DiskInode::TEMPORARY_ADDR;
+  }
+
+  static uint32_t handle_of(const uint32_t slot) { return kHandleBit | slot; }
+
+  static uint32_t slot_of(const uint32_t handle) {
+    return handle & ~kHandleBit;
+  }
+
+  // two independent lanes, blocks differing in a single word always get
+  // different fingerprints
+  static Fingerprint fingerprint(const char *block) {
+    uint64_t lo = 0x9e3779b97f4a7c15ull, hi = 0x2545f4914f6cdd1dull;
+    for (uint32_t i = 0; i < kBlockSize; i += 8) {
+      uint64_t v;
+      std::memcpy(&v, block + i, 8);
+      lo = (lo ^ v) * 0xbf58476d1ce4e5b9ull;
+      lo ^= lo >> 31;
+      hi = (hi + v) * 0x94d049bb133111ebull;
+      hi ^= hi >> 29;
+    }
+    return {mix(lo), mix(hi ^ (lo << 1))};
+  }
+
+  std::optional<uint32_t> find(const Fingerprint &fp) const {
+    auto it = index_.find(fp);
+    if (it == index_.end())
+      return std::nullopt;
+    return it->second;
+  }
+
+  // a slot with one ref, its addr is set once the block is in the log
+  uint32_t insert(const Fingerprint &fp) {
+    auto slot = allocate();
+    entry(slot) = Entry{fp, DiskInode::INVALID_ADDR, 1};
+    index_[fp] = slot;
+    touch(slot);
+    return slot;
+  }
+
+  // a slot with refs for the block at addr, which stays where it is
+  uint32_t adopt(const uint32_t addr, const uint32_t refs) {
+    auto slot = allocate();
+    entry(slot) = Entry{Fingerprint{0, 0}, addr, refs};
+    adopted_[addr] = slot;
+    touch(slot);
+    return slot;
+  }
+
+  std::optional<uint32_t> adopted(const uint32_t addr) const {
+    auto it = adopted_.find(addr);
+    if (it == adopted_.end())
+      return std::nullopt;
+    return it->second;
+  }
+
+  void ref(const uint32_t slot) {
+    entry(slot).refs += 1;
+    touch(slot);
+  }
+
+  // the addr of the block if this was the last ref, INVALID_ADDR if not
+  uint32_t unref(const uint32_t slot) {
+    auto &e = entry(slot);
+    assert(e.refs > 0);
+    e.refs -= 1;
+    touch(slot);
+    if (e.refs != 0)
+      return DiskInode::INVALID_ADDR;
+    auto addr = e.addr;
+    if (e.fp == Fingerprint{0, 0})
+      unadopt(slot);
+    else
+      index_.erase(e.fp);
+    e = Entry{};
+    free_.push_back(slot);
+    return addr;
+  }
+
+  uint32_t addr_of(const uint32_t slot) { return entry(slot).addr; }
+
+  // an adopted block moved by the cleaner is owned by the table from then
+  void set_addr(const uint32_t slot, const uint32_t addr) {
+    if (entry(slot).fp == Fingerprint{0, 0})
+      unadopt(slot);
+    entry(slot).addr = addr;
+    touch(slot);
+  }
+
+  // whether the live block of slot is the one at addr
+  bool holds(const uint32_t slot, const uint32_t addr) const {
+    return slot < entries_.size() && entries_[slot].refs != 0 &&
+           entries_[slot].addr == addr;
+  }
+
+  uint32_t count() const {
+    return static_cast<uint32_t>(entries_.size() - free_.size());
+  }
+
+  // from the content of the file, size is a multiple of kBlockSize
+  void load(const char *from, const uint32_t size) {
+    auto pages = size / kBlockSize;
+    entries_.assign(pages * kPageEntries, Entry{});
+    dirty_.assign(pages, false);
+    free_.clear();
+    index_.clear();
+    adopted_.clear();
+    for (uint32_t page = 0; page < pages; page++)
+      std::memcpy(&entries_[page * kPageEntries], from + page * kBlockSize,
+                  kPageEntries * sizeof(Entry));
+    for (auto slot = static_cast<uint32_t>(entries_.size()); slot > 0; slot--) {
+      auto &e = entries_[slot - 1];
+      if (e.refs == 0)
+        free_.push_back(slot - 1);
+      else if (e.fp == Fingerprint{0, 0})
+        adopted_[e.addr] = slot - 1;
+      else
+        index_[e.fp] = slot - 1;
+    }
+  }
+
+  // hand each run of dirty pages to f(buf, offset, size), buf is aligned
+  template <typename F> void flush(F f) {
+    uint32_t pages = dirty_.size();
+    for (uint32_t first = 0; first < pages; first++) {
+      if (!dirty_[first])
+        continue;
+      auto last = first;
+      while (last + 1 < pages && dirty_[last + 1])
+        last += 1;
+      auto buf = Disk::align_alloc((last - first + 1) * kBlockSize);
+      std::memset(buf.get(), 0, (last - first + 1) * kBlockSize);
+      for (auto page = first; page <= last; page++) {
+        std::memcpy(buf.get() + (page - first) * kBlockSize,
+                    &entries_[page * kPageEntries],
+                    kPageEntries * sizeof(Entry));
+        dirty_[page] = false;
+      }
+      f(buf.get(), first * kBlockSize, (last - first + 1) * kBlockSize);
+      first = last;
+    }
+  }
+};
@@ -3,66 +3,84 @@
 #include <cassert>
 #include <cerrno>
 #include <cstring>
+#include <memory>
+#include <optional>
 #include <string>
+#include <string_view>
 #include <unistd.h>
 
 #include <fcntl.h>
+#include <linux/falloc.h>
+#include <sys/mman.h>
 
 #include "nfs/config.hpp"
+#include "nfs/metrics.hpp"
+#include "nfs/pool.hpp"
+#include "nfs/span.hpp"
+#include "nfs/trace.hpp"
 #include "nfs/utils.hpp"
 
-class MemDisk {
-  char *mem_;
+enum class DiskBackend { kFile, kMmap, kMem };
+
+/*
+  Storage under the log, picked at mount time:
+    - file: O_DIRECT file, durable after fdatasync
+    - mmap: shared mapping of a file, durable after msync
+    - mem:  anonymous memory, gone on unmount
+  Offsets and sizes of read and write are 512 aligned, nread takes any range.
+*/
 
+class Disk {
 public:
-  MemDisk(const char *, const int) {
-    mem_ = new char[kMemDiskCapacityMB * 1024 * 1024];
-    std::memset(mem_, 0, kMemDiskCapacityMB * 1024 * 1024);
+  virtual ~Disk() = default;
+
+  static AlignedBuffer align_alloc(uint32_t size) {
+    return BufferPool::allocate(size);
   }
 
-  ~MemDisk() { delete[] mem_; }
+  static std::optional<DiskBackend> backend_of(const std::string_view name) {
+    if (name == "file")
+      return DiskBackend::kFile;
+    if (name == "mmap")
+      return DiskBackend::kMmap;
+    if (name == "mem")
+      return DiskBackend::kMem;
+    return std::nullopt;
+  }
 
-  uint32_t end() const { return kMemDiskCapacityMB * 1024 * 1024; }
+  static std::unique_ptr<Disk> make(const DiskBackend backend,
+                                    const char *path, const uint32_t capacity);
 
-  void read(char *buf, const uint32_t offset, const uint32_t size) {
-    debug("Disk read [" + std::to_string(offset) + ", " +
-          std::to_string(offset + size) + ")");
-    assert(offset + size <= kMemDiskCapacityMB * 1024 * 1024);
-    std::memcpy(buf, mem_ + offset, size);
-  }
+  uint32_t end() const { return kDiskCapacityMB * 1024 * 1024; }
 
-  void write(const char *buf, const uint32_t offset, const uint32_t size) {
-    // debug("Disk write [" + std::to_string(offset) + ", " +
-    // std::to_string(offset + size) + ")");
-    assert(offset + size < kMemDiskCapacityMB * 1024 * 1024);
-    std::memcpy(mem_ + offset, buf, size);
-  }
+  virtual void read(char *buf, const uint32_t offset, const uint32_t size) = 0;
+  virtual void nread(char *buf, const uint32_t offset, const uint32_t size) = 0;
+  virtual void write(const char *buf, const uint32_t offset,
+                     const uint32_t size) = 0;
+  virtual void sync() = 0;
+  // give the range back to the host, its content is undefined afterwards
+  virtual void discard(const uint32_t, const uint32_t) {}
+
+  // lines appended to the stats, nothing unless the backend keeps its own
+  virtual std::string report() { return ""; }
 };
 
-class FileDisk {
+class FileDisk : public Disk {
   int fd;
 
 public:
   FileDisk(const char *_path, const uint32_t capacity) {
     fd = open(_path, O_CREAT | O_DIRECT | O_NOATIME | O_RDWR, 0666);
-    assert(errno == 0);
-    assert(fd != -1);
-    debug("Disk size " + std::to_string(capacity * 1024 * 1024));
-    auto res = ftruncate(fd, capacity * 1024 * 1024);
+    if (fd == -1)
+      throw DiskOpenFailed();
+    NFS_TRACE(kInfo, kDisk, "size {}", uint64_t(capacity) * 1024 * 1024);
+    [[maybe_unused]] auto res = ftruncate(fd, capacity * 1024 * 1024);
     assert(res != -1);
   }
 
   ~FileDisk() { close(fd); }
 
-  static char *align_alloc(uint32_t size) {
-    char *buf;
-    posix_memalign(reinterpret_cast<void **>(&buf), 512, size);
-    return buf;
-  }
-
-  uint32_t end() const { return kDiskCapacityMB * 1024 * 1024; }
-
-  void read(char *buf, const uint32_t offset, const uint32_t size) {
+  void read(char *buf, const uint32_t offset, const uint32_t size) override {
     if (size <= 4 * kBlockSize) {
       nread(buf, offset, size);
       return;
@@ -70,36 +88,166 @@ public:
     assert(offset + size <= end());
     assert((size_t)buf % 512 == 0);
     assert(offset % 512 == 0);
-    auto res = pread(fd, buf, size, offset);
+    NFS_SPAN("disk read");
+    [[maybe_unused]] auto res = pread(fd, buf, size, offset);
     assert(res != -1);
+    Metrics::add(Metrics::Counter::kDiskBytesRead, size);
   }
-  void nread(char *buf, const uint32_t offset, const uint32_t size) {
+  void nread(char *buf, const uint32_t offset, const uint32_t size) override {
     assert(offset + size <= end());
     uint32_t loffset = offset / 512 * 512;
     uint32_t rsize = ((size + (offset - loffset)) + 511) / 512 * 512;
-    char *newbuf;
-    posix_memalign(reinterpret_cast<void **>(&newbuf), 512, rsize);
-    auto res = pread(fd, newbuf, rsize, loffset);
+    auto newbuf = align_alloc(rsize);
+    NFS_SPAN("disk read");
+    [[maybe_unused]] auto res = pread(fd, newbuf.get(), rsize, loffset);
     assert(res == rsize);
-    memcpy(buf, newbuf + (offset - loffset), size);
+    Metrics::add(Metrics::Counter::kDiskBytesRead, rsize);
+    memcpy(buf, newbuf.get() + (offset - loffset), size);
   }
 
-  void write(const char *buf, const uint32_t offset, const uint32_t size) {
+  void write(const char *buf, const uint32_t offset,
+             const uint32_t size) override {
     // debug("Disk write [" + std::to_string(offset) + ", " +
     // std::to_string(offset + size) + ")");
     assert(offset + size <= end());
     assert((size_t)buf % 512 == 0);
     assert(size % 512 == 0);
     assert(offset % 512 == 0);
-    auto res = pwrite(fd, buf, size, offset);
+    NFS_SPAN("disk write");
+    [[maybe_unused]] auto res = pwrite(fd, buf, size, offset);
     assert(res == size);
+    Metrics::add(Metrics::Counter::kDiskBytesWritten, size);
   }
 
-  void sync() {
+  void sync() override {
+    NFS_SPAN("disk sync");
+    Metrics::add(Metrics::Counter::kDiskSyncs);
     auto ret = fdatasync(fd);
     if (ret != 0)
       throw DiskSyncFailed();
   }
+
+  // best effort, the range is simply kept if the filesystem cannot punch
+  void discard(const uint32_t offset, const uint32_t size) override {
+    assert(offset + size <= end());
+    fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, offset, size);
+  }
 };
 
-using Disk = FileDisk;
\ No newline at end of file
+// the page cache does the caching, writes reach the file on msync
+class MmapDisk : public Disk {
+  int fd_;
+  char *mem_;
+
+public:
+  MmapDisk(const char *path, [[maybe_unused]] const uint32_t capacity) {
+    assert(capacity == kDiskCapacityMB);
+    fd_ = open(path, O_CREAT | O_NOATIME | O_RDWR, 0666);
+    if (fd_ == -1 || ftruncate(fd_, end()) == -1)
+      throw DiskOpenFailed();
+    auto mem = mmap(nullptr, end(), PROT_READ | PROT_WRITE, MAP_SHARED, fd_, 0);
+    if (mem == MAP_FAILED)
+      throw DiskOpenFailed();
+    mem_ = static_cast<char *>(mem);
+    NFS_TRACE(kInfo, kDisk, "mapped {}", path);
+  }
+
+  ~MmapDisk() {
+    munmap(mem_, end());
+    close(fd_);
+  }
+
+  void read(char *buf, const uint32_t offset, const uint32_t size) override {
+    assert(offset + size <= end());
+    std::memcpy(buf, mem_ + offset, size);
+    Metrics::add(Metrics::Counter::kDiskBytesRead, size);
+  }
+
+  void nread(char *buf, const uint32_t offset, const uint32_t size) override {
+    read(buf, offset, size);
+  }
+
+  void write(const char *buf, const uint32_t offset,
+             const uint32_t size) override {
+    assert(offset + size <= end());
+    NFS_SPAN("disk write");
+    std::memcpy(mem_ + offset, buf, size);
+    Metrics::add(Metrics::Counter::kDiskBytesWritten, size);
+  }
+
+  // only the dirty pages of the mapping are written back
+  void sync() override {
+    NFS_SPAN("disk sync");
+    Metrics::add(Metrics::Counter::kDiskSyncs);
+    if (msync(mem_, end(), MS_SYNC) != 0)
+      throw DiskSyncFailed();
+  }
+
+  // punching the file drops the pages from the mapping as well
+  void discard(const uint32_t offset, const uint32_t size) override {
+    assert(offset + size <= end());
+    fallocate(fd_, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, offset, size);
+  }
+};
+
+// keeps the whole disk in memory, for scratch mounts, benchmarks and tests,
+// pages are zero filled on first touch
+class MemDisk : public Disk {
+  char *mem_;
+
+public:
+  MemDisk(const char *, [[maybe_unused]] const uint32_t capacity) {
+    assert(capacity == kDiskCapacityMB);
+    auto mem = mmap(nullptr, end(), PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mem == MAP_FAILED)
+      throw DiskOpenFailed();
+    mem_ = static_cast<char *>(mem);
+  }
+
+  ~MemDisk() { munmap(mem_, end()); }
+
+  void read(char *buf, const uint32_t offset, const uint32_t size) override {
+    NFS_TRACE(kVerbose, kDisk, "read [{}, {})", offset, offset + size);
+    assert(offset + size <= end());
+    std::memcpy(buf, mem_ + offset, size);
+    Metrics::add(Metrics::Counter::kDiskBytesRead, size);
+  }
+
+  void nread(char *buf, const uint32_t offset, const uint32_t size) override {
+    read(buf, offset, size);
+  }
+
+  void write(const char *buf, const uint32_t offset,
+             const uint32_t size) override {
+    assert(offset + size <= end());
+    std::memcpy(mem_ + offset, buf, size);
+    Metrics::add(Metrics::Counter::kDiskBytesWritten, size);
+  }
+
+  void sync() override { Metrics::add(Metrics::Counter::kDiskSyncs); }
+
+  // only the whole pages inside the range are dropped
+  void discard(const uint32_t offset, const uint32_t size) override {
+    assert(offset + size <= end());
+    const uint32_t page = sysconf(_SC_PAGESIZE);
+    auto start = (offset + page - 1) / page * page;
+    auto stop = (offset + size) / page * page;
+    if (start < stop)
+      madvise(mem_ + start, stop - start, MADV_DONTNEED);
+  }
+};
+
+inline std::unique_ptr<Disk> Disk::make(const DiskBackend backend,
+                                        const char *path,
+                                        const uint32_t capacity) {
+  switch (backend) {
+  case DiskBackend::kFile:
+    return std::make_unique<FileDisk>(path, capacity);
+  case DiskBackend::kMmap:
+    return std::make_unique<MmapDisk>(path, capacity);
+  case DiskBackend::kMem:
+    return std::make_unique<MemDisk>(path, capacity);
+  }
+  return nullptr;
+}
@@ -1,6 +1,7 @@
 #pragma once
 
 #include <cassert>
+#include <cstddef>
 #include <cstring>
 #include <limits>
 #include <memory>
@@ -9,8 +10,9 @@
 #include <unistd.h>
 
 #include "nfs/config.hpp"
+#include "nfs/pool.hpp"
 
-struct DiskInode {
+struct DiskInode : Pooled<DiskInode> {
   uint32_t size, access_time, modify_time, change_time;
   uint16_t uid, gid, link_cnt, mode;
   uint32_t directs[kInodeDirectCnt];
@@ -20,6 +22,8 @@ struct DiskInode {
   static constexpr uint32_t TEMPORARY_ADDR =
       std::numeric_limits<uint32_t>::max();
   static constexpr uint32_t INVALID_INDIRECT_IDX = 4095;
+  // content up to this size is kept in place of the block addresses
+  static constexpr uint32_t kInlineSize = 4 * (kInodeDirectCnt + 2);
 
   static std::unique_ptr<DiskInode> make() {
     auto disk_inode = std::make_unique<DiskInode>();
@@ -48,9 +52,25 @@ struct DiskInode {
     return disk_inode;
   }
 
-  uint32_t st_blocks() {
-    // todo
-    return 0;
+  bool is_inline() const { return size <= kInlineSize; }
+
+  char *inline_data() { return reinterpret_cast<char *>(directs); }
+
+  // in 512-byte units, an upper bound which counts holes below size too
+  uint64_t st_blocks() const {
+    if (is_inline())
+      return 0;
+    constexpr uint64_t per_block = kBlockSize / 4;
+    uint64_t blocks =
+        (static_cast<uint64_t>(size) + kBlockSize - 1) / kBlockSize;
+    uint64_t indirects = 0;
+    if (blocks > kInodeDirectCnt)
+      indirects += 1;
+    if (blocks > kInodeDirectCnt + per_block) {
+      auto rest = blocks - kInodeDirectCnt - per_block;
+      indirects += 1 + (rest + per_block - 1) / per_block;
+    }
+    return (blocks + indirects) * (kBlockSize / 512);
   }
 
   static std::tuple<uint32_t, uint32_t, uint32_t>
@@ -76,6 +96,18 @@ struct DiskInode {
     return "[" + std::to_string(i0) + "]";
   }
 
+  // whether the block holds file content rather than indirect addresses
+  static bool is_data(const uint32_t code) {
+    const auto [i0, i1, i2] = decode(code);
+    (void)i1;
+    (void)i2;
+    if (code & (1 << 29))
+      return true;
+    if (code & (1 << 30))
+      return i0 == kInodeDirectCnt;
+    return i0 < kInodeDirectCnt;
+  }
+
   static std::tuple<uint32_t, uint32_t, uint32_t> decode(const uint32_t code) {
     auto this_i0 = code & ((1 << 5) - 1);
     auto this_i1 = (code >> 5) & ((1 << 10) - 1);
@@ -104,3 +136,7 @@ struct DiskInode {
     return this_i01 | (this_i2 << 15) | (1 << 29);
   }
 };
+
+static_assert(offsetof(DiskInode, indirect2) + 4 -
+                  offsetof(DiskInode, directs) ==
+              DiskInode::kInlineSize);
@@ -2,30 +2,175 @@
 
 #include <atomic>
 #include <cassert>
-#include <map>
+#include <cstdint>
+#include <memory>
+#include <mutex>
 #include <optional>
+#include <unordered_map>
+#include <vector>
 
 #include "nfs/config.hpp"
+#include "nfs/pool.hpp"
 #include "nfs/utils.hpp"
 
+// shared by every handle opened on the same inode, pins the inode number
+struct OpenInode {
+  static constexpr uint64_t kUnknownEpoch = UINT64_MAX;
+
+  const uint32_t inode_idx;
+  // serializes writes and truncates of this inode
+  std::mutex lock;
+  // bumped after every change of the content
+  std::atomic<uint64_t> version;
+  // checkpoint epoch of the last change, see NaiveFS::fsync. Unknown until
+  // the next checkpoint, an earlier open may have changed the inode
+  std::atomic<uint64_t> dirty_epoch;
+  // guarded by FDManager
+  uint32_t open_cnt;
+  bool unlinked;
+
+  explicit OpenInode(const uint32_t idx)
+      : inode_idx(idx), version(0), dirty_epoch(kUnknownEpoch), open_cnt(0),
+        unlinked(false) {}
+};
+
+struct FileHandle {
+  std::shared_ptr<OpenInode> inode;
+  int flags;
+  std::mutex lock;
+  // readahead window, valid while ra_version matches the inode version
+  uint32_t next_offset = 0;
+  uint32_t ra_offset = 0;
+  uint32_t ra_size = 0;
+  bool ra_eof = false;
+  uint64_t ra_version = 0;
+  AlignedBuffer ra_buf;
+  // written since the last flush
+  bool dirty = false;
+};
+
+/*
+  fh = [generation: 32 bits][slot index + 1: 32 bits]
+
+  Slots are kept in chunks which are never freed while mounted, so get() is
+  lock-free. The generation protects against a stale fh hitting a reused slot.
+*/
+
 class FDManager {
-  std::map<uint32_t, uint32_t> fd2id;
-  std::atomic<uint32_t> cnt_;
+  struct Slot {
+    std::atomic<uint32_t> gen;
+    std::atomic<FileHandle *> handle;
+  };
+
+  std::unique_ptr<std::atomic<Slot *>[]> chunks_;
+  std::atomic<uint32_t> num_slots_;
+  std::mutex lock_;
+  std::vector<uint32_t> free_slots_;
+  std::unordered_map<uint32_t, std::shared_ptr<OpenInode>> open_inodes_;
+
+  Slot *get_slot(const uint32_t slot_idx) const {
+    auto chunk =
+        chunks_[slot_idx / kFDChunkSlots].load(std::memory_order_acquire);
+    if (chunk == nullptr)
+      return nullptr;
+    return chunk + slot_idx % kFDChunkSlots;
+  }
+
+  Slot *find_slot(const uint64_t fh) const {
+    uint32_t slot_idx = static_cast<uint32_t>(fh) - 1;
+    if (static_cast<uint32_t>(fh) == 0 || slot_idx >= num_slots_.load())
+      throw NoFd();
+    auto slot = get_slot(slot_idx);
+    if (slot == nullptr || slot->gen.load() != (fh >> 32))
+      throw NoFd();
+    return slot;
+  }
 
 public:
-  FDManager() : cnt_{2} {}
+  FDManager()
+      : chunks_(std::make_unique<std::atomic<Slot *>[]>(kFDMaxChunks)),
+        num_slots_(0) {
+    for (uint32_t i = 0; i < kFDMaxChunks; i++)
+      chunks_[i].store(nullptr);
+  }
+
+  ~FDManager() {
+    for (uint32_t i = 0; i < num_slots_; i++)
+      delete get_slot(i)->handle.load();
+    for (uint32_t i = 0; i < kFDMaxChunks; i++)
+      delete[] chunks_[i].load();
+  }
 
-  uint32_t allocate(const uint32_t inode_idx) {
-    auto fd = ++cnt_;
-    fd2id[fd] = inode_idx;
-    return fd;
+  uint64_t allocate(const uint32_t inode_idx, const int flags) {
+    auto handle = new FileHandle();
+    handle->flags = flags;
+    auto lock = std::unique_lock(lock_);
+    auto &inode = open_inodes_[inode_idx];
+    if (inode == nullptr)
+      inode = std::make_shared<OpenInode>(inode_idx);
+    inode->open_cnt += 1;
+    handle->inode = inode;
+    uint32_t slot_idx;
+    if (!free_slots_.empty()) {
+      slot_idx = free_slots_.back();
+      free_slots_.pop_back();
+    } else {
+      slot_idx = num_slots_;
+      if (slot_idx % kFDChunkSlots == 0) {
+        assert(slot_idx / kFDChunkSlots < kFDMaxChunks);
+        auto chunk = new Slot[kFDChunkSlots]();
+        chunks_[slot_idx / kFDChunkSlots].store(chunk,
+                                                std::memory_order_release);
+      }
+      num_slots_ += 1;
+    }
+    auto slot = get_slot(slot_idx);
+    slot->handle.store(handle, std::memory_order_release);
+    return (static_cast<uint64_t>(slot->gen.load()) << 32) | (slot_idx + 1);
   }
 
-  uint32_t get(const uint32_t fd) {
-    assert(fd >= 3);
-    auto it = fd2id.find(fd);
-    if (it == fd2id.end())
+  FileHandle &get(const uint64_t fh) const {
+    auto handle = find_slot(fh)->handle.load(std::memory_order_acquire);
+    if (handle == nullptr)
       throw NoFd();
+    return *handle;
+  }
+
+  // return the inode to free if this was the last handle of an unlinked inode
+  std::optional<uint32_t> release(const uint64_t fh) {
+    auto lock = std::unique_lock(lock_);
+    auto slot = find_slot(fh);
+    auto handle = std::unique_ptr<FileHandle>(slot->handle.exchange(nullptr));
+    if (handle == nullptr)
+      throw NoFd();
+    // the top bit of a fh is left to CtlFiles
+    slot->gen = (slot->gen + 1) & 0x7fffffff;
+    free_slots_.push_back(static_cast<uint32_t>(fh) - 1);
+    auto &inode = handle->inode;
+    inode->open_cnt -= 1;
+    if (inode->open_cnt != 0)
+      return std::nullopt;
+    open_inodes_.erase(inode->inode_idx);
+    if (inode->unlinked)
+      return inode->inode_idx;
+    return std::nullopt;
+  }
+
+  // return false if the inode is not open and can be freed right now
+  bool defer_free(const uint32_t inode_idx) {
+    auto lock = std::unique_lock(lock_);
+    auto it = open_inodes_.find(inode_idx);
+    if (it == open_inodes_.end())
+      return false;
+    it->second->unlinked = true;
+    return true;
+  }
+
+  std::shared_ptr<OpenInode> find(const uint32_t inode_idx) {
+    auto lock = std::unique_lock(lock_);
+    auto it = open_inodes_.find(inode_idx);
+    if (it == open_inodes_.end())
+      return nullptr;
     return it->second;
   }
-};
\ No newline at end of file
+};
@@ -1,17 +1,158 @@
 #pragma once
 
+#include <algorithm>
 #include <atomic>
+#include <cassert>
+#include <cstring>
+#include <functional>
 #include <memory>
+#include <mutex>
+#include <vector>
 
 #include "nfs/config.hpp"
 
+/*
+  Inode numbers below next_ that are not in use are kept in a bitmap, so freed
+  numbers are handed out again before next_ grows. Only next_ and the hidden
+  inodes of the dedup table, the snapshot directory and the orphan list are
+  stored in the checkpoint, the bitmap is rebuilt from the imap when
+  mounting.
+
+  Each thread takes kIDBatchSize numbers at once and allocates from its own
+  batch without locking. Numbers left in a batch are simply free again after
+  remount since they never reach the imap.
+*/
+
 class IDManager {
-  std::atomic<uint32_t> cur_idx;
+  struct Batch {
+    uint64_t owner = 0;
+    std::vector<uint32_t> ids;
+  };
+
+  std::mutex lock_;
+  std::vector<uint64_t> free_bits_;
+  uint32_t next_;
+  uint32_t dedup_inode_idx_;
+  uint32_t snapshots_inode_idx_;
+  uint32_t orphans_inode_idx_;
+  uint32_t free_cnt_;
+  // no free bit before this word
+  uint32_t hint_;
+  const uint64_t serial_;
+
+  static uint64_t make_serial() {
+    static std::atomic<uint64_t> serial{0};
+    return ++serial;
+  }
+
+  static Batch &local_batch() {
+    thread_local Batch batch;
+    return batch;
+  }
+
+  void refill(Batch &batch) {
+    auto lock = std::unique_lock(lock_);
+    while (batch.ids.size() < kIDBatchSize && free_cnt_ > 0) {
+      while (free_bits_[hint_] == 0)
+        hint_ += 1;
+      auto bit = __builtin_ctzll(free_bits_[hint_]);
+      free_bits_[hint_] &= free_bits_[hint_] - 1;
+      free_cnt_ -= 1;
+      batch.ids.push_back(hint_ * 64 + bit);
+    }
+    while (batch.ids.size() < kIDBatchSize) {
+      assert(next_ < kMaxInode);
+      batch.ids.push_back(next_++);
+    }
+    free_bits_.resize((next_ + 63) / 64, 0);
+    std::reverse(batch.ids.begin(), batch.ids.end());
+  }
 
 public:
   static constexpr uint32_t root_inode_idx = 0;
 
-  IDManager() { cur_idx = root_inode_idx; }
+  IDManager(const char *from) : free_cnt_(0), hint_(0), serial_(make_serial()) {
+    std::memcpy(&next_, from, 4);
+    std::memcpy(&dedup_inode_idx_, from + 4, 4);
+    std::memcpy(&snapshots_inode_idx_, from + 8, 4);
+    std::memcpy(&orphans_inode_idx_, from + 12, 4);
+    next_ = std::max(next_, root_inode_idx + 1);
+    free_bits_.resize((next_ + 63) / 64, 0);
+  }
+
+  // collect numbers below next_ which are not used by any inode
+  void load(std::function<bool(const uint32_t)> in_use) {
+    auto lock = std::unique_lock(lock_);
+    for (uint32_t i = root_inode_idx + 1; i < next_; i++) {
+      if (in_use(i))
+        continue;
+      free_bits_[i / 64] |= 1ull << (i % 64);
+      free_cnt_ += 1;
+    }
+  }
+
+  void store(char *to) {
+    auto lock = std::unique_lock(lock_);
+    std::memset(to, 0, kCRIDSize);
+    std::memcpy(to, &next_, 4);
+    std::memcpy(to + 4, &dedup_inode_idx_, 4);
+    std::memcpy(to + 8, &snapshots_inode_idx_, 4);
+    std::memcpy(to + 12, &orphans_inode_idx_, 4);
+  }
+
+  // root_inode_idx if there is no dedup table
+  uint32_t dedup_inode_idx() {
+    auto lock = std::unique_lock(lock_);
+    return dedup_inode_idx_;
+  }
+
+  void set_dedup_inode_idx(const uint32_t inode_idx) {
+    auto lock = std::unique_lock(lock_);
+    dedup_inode_idx_ = inode_idx;
+  }
+
+  // root_inode_idx if no snapshot was ever taken
+  uint32_t snapshots_inode_idx() {
+    auto lock = std::unique_lock(lock_);
+    return snapshots_inode_idx_;
+  }
+
+  void set_snapshots_inode_idx(const uint32_t inode_idx) {
+    auto lock = std::unique_lock(lock_);
+    snapshots_inode_idx_ = inode_idx;
+  }
+
+  // root_inode_idx if no inode was ever unlinked while open
+  uint32_t orphans_inode_idx() {
+    auto lock = std::unique_lock(lock_);
+    return orphans_inode_idx_;
+  }
+
+  void set_orphans_inode_idx(const uint32_t inode_idx) {
+    auto lock = std::unique_lock(lock_);
+    orphans_inode_idx_ = inode_idx;
+  }
+
+  uint32_t allocate() {
+    auto &batch = local_batch();
+    if (batch.owner != serial_) {
+      batch.owner = serial_;
+      batch.ids.clear();
+    }
+    if (batch.ids.empty())
+      refill(batch);
+    auto ret = batch.ids.back();
+    batch.ids.pop_back();
+    return ret;
+  }
 
-  int allocate() { return ++cur_idx; }
-};
\ No newline at end of file
+  void release(const uint32_t inode_idx) {
+    assert(inode_idx != root_inode_idx);
+    auto lock = std::unique_lock(lock_);
+    assert(inode_idx < next_);
+    assert((free_bits_[inode_idx / 64] & (1ull << (inode_idx % 64))) == 0);
+    free_bits_[inode_idx / 64] |= 1ull << (inode_idx % 64);
+    free_cnt_ += 1;
+    hint_ = std::min(hint_, inode_idx / 64);
+  }
+};
@@ -1,63 +1,211 @@
 #pragma once
 
 #include "nfs/config.hpp"
+#include "nfs/disk.hpp"
+#include "nfs/trace.hpp"
 #include "nfs/utils.hpp"
 
+#include <atomic>
 #include <cassert>
 #include <cstdint>
+#include <cstring>
+#include <functional>
+#include <limits>
+#include <memory>
 #include <optional>
 #include <string>
 #include <vector>
 
 class NaiveFS;
 
+/*
+  The imap is split into pages of kImapPageEntries entries. Pages live in the
+  log like any other block; the checkpoint region only stores a small header
+  and the page directory (the log address of every populated page):
+
+    [version: uint32_t, active_count: uint32_t, ...][page_addr: uint32_t] * N
+
+  Lookups are lock-free: a page is published once with a CAS and never freed
+  while mounted, and every entry is an atomic.
+*/
+
 class Imap {
-  uint32_t *map_;
-  uint32_t active_count;
-  uint32_t *version_;
+  struct Page {
+    std::atomic<uint32_t> entries[kImapPageEntries];
+  };
+  static_assert(sizeof(Page) == kBlockSize);
+
+  struct Header {
+    uint32_t version;
+    uint32_t active_count;
+  };
+  static_assert(sizeof(Header) <= kCRImapHeaderSize);
+
+  std::unique_ptr<std::atomic<Page *>[]> pages_;
+  std::unique_ptr<std::atomic<bool>[]> dirty_;
+  // only touched by checkpoint and gc, which hold lock_flushing_cr_ exclusively
+  std::unique_ptr<uint32_t[]> page_addrs_;
+  std::atomic<uint32_t> active_count_;
+  std::atomic<uint32_t> num_pages_;
+  uint32_t version_;
+
   static const uint32_t INVALID_VALUE = 0;
-  // todo: ensure thread safety
-  // flushing imap to cr should ensure mutex against update
+
+  Page *get_page(const uint32_t page_idx) const {
+    return pages_[page_idx].load(std::memory_order_acquire);
+  }
+
+  Page *get_or_create_page(const uint32_t page_idx) {
+    auto page = get_page(page_idx);
+    if (page != nullptr)
+      return page;
+    auto new_page = new Page();
+    if (pages_[page_idx].compare_exchange_strong(page, new_page,
+                                                 std::memory_order_acq_rel)) {
+      page = new_page;
+      auto num_pages = num_pages_.load();
+      while (num_pages <= page_idx &&
+             !num_pages_.compare_exchange_weak(num_pages, page_idx + 1))
+        ;
+    } else {
+      delete new_page;
+    }
+    return page;
+  }
 
 public:
-  Imap(char *from)
-      : map_(reinterpret_cast<uint32_t *>(from + 4)),
-        version_(reinterpret_cast<uint32_t *>(from)) {
-    active_count = 0;
-    for (uint32_t i = 0; i < kMaxInode; i++) {
-      active_count += (map_[i] != INVALID_VALUE);
+  // owner recorded in segment summaries for imap pages, code is page_idx
+  static constexpr uint32_t kPageOwner = std::numeric_limits<uint32_t>::max();
+
+  Imap(const char *from)
+      : pages_(std::make_unique<std::atomic<Page *>[]>(kMaxImapPages)),
+        dirty_(std::make_unique<std::atomic<bool>[]>(kMaxImapPages)),
+        page_addrs_(std::make_unique<uint32_t[]>(kMaxImapPages)),
+        num_pages_(0) {
+    Header header;
+    std::memcpy(&header, from, sizeof(Header));
+    version_ = header.version;
+    active_count_ = header.active_count;
+    std::memcpy(page_addrs_.get(), from + kCRImapHeaderSize,
+                kMaxImapPages * 4);
+    for (uint32_t i = 0; i < kMaxImapPages; i++) {
+      pages_[i].store(nullptr);
+      dirty_[i].store(false);
+      if (page_addrs_[i] != INVALID_VALUE)
+        num_pages_ = i + 1;
     }
-    debug(std::string("IMAP init with active_count = ") +
-          std::to_string(active_count) +
-          " version = " + std::to_string(version()));
+    NFS_TRACE(kInfo, kImap, "init with active_count = {} version = {}",
+              count(), version());
   }
 
-  ~Imap() { delete[](map_ - 1); }
+  ~Imap() {
+    for (uint32_t i = 0; i < kMaxImapPages; i++)
+      delete get_page(i);
+  }
 
-  const char *get_buf() {
-    *version_ = version() + 1;
-    return reinterpret_cast<const char *>(version_);
+  // read every populated page, cost depends on the pages in use only
+  void load(Disk *disk) {
+    for (uint32_t i = 0; i < num_pages_; i++) {
+      if (page_addrs_[i] == INVALID_VALUE)
+        continue;
+      auto page = get_or_create_page(i);
+      disk->read(reinterpret_cast<char *>(page), page_addrs_[i], kBlockSize);
+    }
   }
 
-  uint32_t count() const { return active_count; }
-  uint32_t version() const { return *version_; }
+  /*
+    push:
+      - arg0: 页的内容
+      - arg1: 页号
+      - arg2: 页的旧地址
+      - return: 页的新地址
+  */
 
-  uint32_t get(const uint32_t inode_idx) {
+  void flush(std::function<uint32_t(const char *, const uint32_t,
+                                    const uint32_t)>
+                 push) {
+    for (uint32_t i = 0; i < num_pages_; i++) {
+      if (!dirty_[i].exchange(false))
+        continue;
+      page_addrs_[i] = push(reinterpret_cast<const char *>(get_page(i)), i,
+                            page_addrs_[i]);
+    }
+  }
+
+  // move a page out of a segment selected by gc if it is still live
+  void relocate_page(const uint32_t page_idx, const uint32_t addr,
+                     std::function<uint32_t(const char *, const uint32_t,
+                                            const uint32_t)>
+                         push) {
+    assert(page_idx < kMaxImapPages);
+    if (page_addrs_[page_idx] != addr || get_page(page_idx) == nullptr)
+      return;
+    page_addrs_[page_idx] =
+        push(reinterpret_cast<const char *>(get_page(page_idx)), page_idx,
+             addr);
+  }
+
+  // dump header and page directory to the checkpoint region
+  void store(char *to) {
+    version_ += 1;
+    Header header{version_, count()};
+    std::memset(to, 0, kCRImapHeaderSize);
+    std::memcpy(to, &header, sizeof(Header));
+    std::memcpy(to + kCRImapHeaderSize, page_addrs_.get(), kMaxImapPages * 4);
+  }
+
+  uint32_t count() const { return active_count_.load(); }
+  uint32_t version() const { return version_; }
+
+  uint32_t get(const uint32_t inode_idx) const {
     assert(inode_idx < kMaxInode);
-    auto entry = map_[inode_idx];
+    auto page = get_page(inode_idx / kImapPageEntries);
+    if (page == nullptr)
+      throw NoImapEntry();
+    auto entry = page->entries[inode_idx % kImapPageEntries].load(
+        std::memory_order_acquire);
     if (entry == INVALID_VALUE) {
       throw NoImapEntry();
     }
     return entry;
   }
 
+  bool contains(const uint32_t inode_idx) const {
+    assert(inode_idx < kMaxInode);
+    auto page = get_page(inode_idx / kImapPageEntries);
+    if (page == nullptr)
+      return false;
+    return page->entries[inode_idx % kImapPageEntries].load(
+               std::memory_order_acquire) != INVALID_VALUE;
+  }
+
+  void remove(const uint32_t inode_idx) {
+    NFS_TRACE(kVerbose, kImap, "remove inode_idx {}", inode_idx);
+    if (inode_idx >= kMaxInode)
+      throw NoImapEntry();
+    auto page_idx = inode_idx / kImapPageEntries;
+    auto page = get_page(page_idx);
+    if (page == nullptr)
+      throw NoImapEntry();
+    auto old = page->entries[inode_idx % kImapPageEntries].exchange(
+        INVALID_VALUE, std::memory_order_acq_rel);
+    if (old == INVALID_VALUE)
+      throw NoImapEntry();
+    active_count_ -= 1;
+    dirty_[page_idx].store(true, std::memory_order_release);
+  }
+
   void update(const uint32_t inode_idx, const uint32_t inode_addr) {
-    debug(std::string("IMAP set inode_idx ") + std::to_string(inode_idx) +
-          std::string(" -> ") + std::to_string(inode_addr));
+    NFS_TRACE(kVerbose, kImap, "set inode_idx {} -> {}", inode_idx,
+              inode_addr);
     assert(inode_idx < kMaxInode);
     assert(inode_addr != INVALID_VALUE);
-    if (map_[inode_idx] == INVALID_VALUE)
-      active_count += 1;
-    map_[inode_idx] = inode_addr;
+    auto page_idx = inode_idx / kImapPageEntries;
+    auto page = get_or_create_page(page_idx);
+    auto old = page->entries[inode_idx % kImapPageEntries].exchange(
+        inode_addr, std::memory_order_acq_rel);
+    if (old == INVALID_VALUE)
+      active_count_ += 1;
+    dirty_[page_idx].store(true, std::memory_order_release);
   }
-};
\ No newline at end of file
+};
@@ -1,20 +1,26 @@
 #pragma once
 
+#include <algorithm>
 #include <cassert>
 #include <cstring>
 #include <functional>
 #include <limits>
 #include <memory>
 #include <optional>
+#include <string_view>
+#include <vector>
 
 #include "nfs/config.hpp"
 #include "nfs/disk.hpp"
 #include "nfs/disk_inode.hpp"
 #include "nfs/imap.hpp"
+#include "nfs/metrics.hpp"
 #include "nfs/seg.hpp"
+#include "nfs/span.hpp"
+#include "nfs/trace.hpp"
 #include "nfs/utils.hpp"
 
-class Inode {
+class Inode : public Pooled<Inode> {
   std::unique_ptr<DiskInode> disk_inode_;
   SegmentsManager *seg_;
   bool dirty_;
@@ -25,13 +31,16 @@ class Inode {
   uint32_t indirect2_idx = 0;
   uint32_t *indirect2 = nullptr;
   uint32_t indirect2_addr = DiskInode::INVALID_ADDR;
+  AlignedBuffer indirect1_buf_;
+  AlignedBuffer indirect2_buf_;
 
   void fetch_indirect1(const uint32_t idx, const uint32_t addr) {
 #ifndef NDEBUG
     seg_->assert_not_discarded(addr);
 #endif
     // 当前 indirect1 和目标一致，返回
-    if (indirect1_addr == addr)
+    // 两个新分配的 indirect 地址同为 TEMPORARY_ADDR，还需比较下标
+    if (indirect1_addr == addr && indirect1_idx == idx)
       return;
     // debug("fetch_indirect1(idx = " + std::to_string(idx) + ", addr = " +
     // std::to_string(addr) + ")");
@@ -46,20 +55,23 @@ class Inode {
         disk_inode_->indirect1 = new_addr;
       else
         disk_inode_->indirect2 = new_addr;
-      std::memset(indirect1, 0, kBlockSize);
       indirect1_addr = DiskInode::INVALID_ADDR;
-      // todo: handle the memory leak here
     }
     // 若不希望读新块，则停止
     if (addr == DiskInode::INVALID_ADDR)
       return;
     // 若未分配，分配并读入
-    if (indirect1_addr == DiskInode::INVALID_ADDR) {
-      indirect1 = reinterpret_cast<uint32_t *>(Disk::align_alloc(kBlockSize));
+    if (indirect1_buf_ == nullptr) {
+      indirect1_buf_ = Disk::align_alloc(kBlockSize);
+      indirect1 = reinterpret_cast<uint32_t *>(indirect1_buf_.get());
+    }
+    if (addr == DiskInode::TEMPORARY_ADDR) {
       std::memset(indirect1, 0, kBlockSize);
+    } else {
+      NFS_SPAN("fetch indirect1");
+      seg_->read_block(reinterpret_cast<char *>(indirect1), addr, 0,
+                       kBlockSize);
     }
-    if (addr != DiskInode::TEMPORARY_ADDR)
-      seg_->read(reinterpret_cast<char *>(indirect1), addr, kBlockSize);
     indirect1_addr = addr;
     indirect1_idx = idx;
   };
@@ -68,7 +80,7 @@ class Inode {
 #ifndef NDEBUG
     seg_->assert_not_discarded(addr);
 #endif
-    if (indirect2_addr == addr)
+    if (indirect2_addr == addr && indirect2_idx == idx)
       return;
     if (dirty_ && indirect2_addr != DiskInode::INVALID_ADDR) {
       assert(idx != indirect2_idx);
@@ -77,17 +89,21 @@ class Inode {
                           DiskInode::encode(indirect1_idx, indirect2_idx)),
           indirect2_addr);
       indirect1[indirect2_idx] = new_addr;
-      std::memset(indirect2, 0, kBlockSize);
       indirect2_addr = DiskInode::INVALID_ADDR;
     }
     if (addr == DiskInode::INVALID_ADDR)
       return;
-    if (indirect2_addr == DiskInode::INVALID_ADDR) {
-      indirect2 = reinterpret_cast<uint32_t *>(Disk::align_alloc(kBlockSize));
+    if (indirect2_buf_ == nullptr) {
+      indirect2_buf_ = Disk::align_alloc(kBlockSize);
+      indirect2 = reinterpret_cast<uint32_t *>(indirect2_buf_.get());
+    }
+    if (addr == DiskInode::TEMPORARY_ADDR) {
       std::memset(indirect2, 0, kBlockSize);
+    } else {
+      NFS_SPAN("fetch indirect2");
+      seg_->read_block(reinterpret_cast<char *>(indirect2), addr, 0,
+                       kBlockSize);
     }
-    if (addr != DiskInode::TEMPORARY_ADDR)
-      seg_->read(reinterpret_cast<char *>(indirect2), addr, kBlockSize);
     indirect2_addr = addr;
     indirect2_idx = idx;
   }
@@ -99,14 +115,16 @@ class Inode {
       - arg2: 在块内相关的字节数
       - arg3: 这个块在 Inode 内的编码
       - return: 这个块下一个版本的地址
+    空洞的地址为 INVALID_ADDR，只有 callback 返回新地址时才分配 indirect 块
   */
 
-  void for_each_block(uint32_t offset, const uint32_t size,
-                      std::function<uint32_t(const uint32_t, const uint32_t,
-                                             const uint32_t, const uint32_t)>
-                          callback) {
+  template <typename callback_t>
+  void for_each_block(const uint32_t start, const uint32_t size,
+                      callback_t callback) {
     assert(dirty_ == false);
-    auto end = offset + size;
+    // 64 bits, the last block of a file ending at 4 GiB ends past uint32_t
+    const uint64_t end = static_cast<uint64_t>(start) + size;
+    uint64_t offset = start;
     while (offset < end) {
       const auto [i0, i1, i2] = DiskInode::translate(offset);
       /*debug("offset = " + std::to_string(offset) +
@@ -121,37 +139,50 @@ class Inode {
             callback(this_addr, offset % kBlockSize, this_size, this_code);
         if (new_addr != this_addr) {
           dirty_ = true;
-          debug("set disk_inode directs " + std::to_string(i0) + " -> " +
-                std::to_string(new_addr));
+          NFS_TRACE(kVerbose, kInode, "set disk_inode directs {} -> {}", i0,
+                    new_addr);
           disk_inode_->directs[i0] = new_addr;
         }
       } else if (i0 < kInodeDirectCnt + 1) {
-        if (disk_inode_->indirect1 == DiskInode::INVALID_ADDR) {
-          disk_inode_->indirect1 = DiskInode::TEMPORARY_ADDR;
+        auto &top = disk_inode_->indirect1;
+        auto this_addr = DiskInode::INVALID_ADDR;
+        if (top != DiskInode::INVALID_ADDR) {
+          fetch_indirect1(i0, top);
+          this_addr = indirect1[i1];
         }
-        fetch_indirect1(i0, disk_inode_->indirect1);
-        auto this_addr = indirect1[i1];
         auto this_code = DiskInode::encode(i0, i1);
         auto new_addr =
             callback(this_addr, offset % kBlockSize, this_size, this_code);
         if (new_addr != this_addr) {
+          if (top == DiskInode::INVALID_ADDR) {
+            top = DiskInode::TEMPORARY_ADDR;
+            fetch_indirect1(i0, top);
+          }
           dirty_ = true;
           indirect1[i1] = new_addr;
         }
       } else {
-        if (disk_inode_->indirect2 == DiskInode::INVALID_ADDR) {
-          disk_inode_->indirect2 = DiskInode::TEMPORARY_ADDR;
-        }
-        fetch_indirect1(i0, disk_inode_->indirect2);
-        if (indirect1[i1] == DiskInode::INVALID_ADDR) {
-          indirect1[i1] = DiskInode::TEMPORARY_ADDR;
+        auto &top = disk_inode_->indirect2;
+        auto this_addr = DiskInode::INVALID_ADDR;
+        if (top != DiskInode::INVALID_ADDR) {
+          fetch_indirect1(i0, top);
+          if (indirect1[i1] != DiskInode::INVALID_ADDR) {
+            fetch_indirect2(i1, indirect1[i1]);
+            this_addr = indirect2[i2];
+          }
         }
-        fetch_indirect2(i1, indirect1[i1]);
-        auto this_addr = indirect2[i2];
         auto this_code = DiskInode::encode(i0, i1, i2);
         auto new_addr =
             callback(this_addr, offset % kBlockSize, this_size, this_code);
         if (new_addr != this_addr) {
+          if (top == DiskInode::INVALID_ADDR) {
+            top = DiskInode::TEMPORARY_ADDR;
+            fetch_indirect1(i0, top);
+          }
+          if (indirect1[i1] == DiskInode::INVALID_ADDR) {
+            indirect1[i1] = DiskInode::TEMPORARY_ADDR;
+            fetch_indirect2(i1, indirect1[i1]);
+          }
           dirty_ = true;
           indirect2[i2] = new_addr;
         }
@@ -170,30 +201,43 @@ class Inode {
       - return: 是否完成
   */
 
-  void for_each_entry_once(std::function<bool(const std::string &name,
-                                              const uint32_t, const uint32_t)>
-                               callback) {
-    // assume that directory should not be very large here
-    // fix: support large directory
-    assert(disk_inode_->size <= kBlockSize * 3);
-    if (disk_inode_->size == 0)
+  template <typename callback_t> void for_each_entry_once(callback_t callback) {
+    NFS_TRACE(kVerbose, kInode, "disk_inode_->size = {}", disk_inode_->size);
+    for_each_entry_from(0, [&callback](const std::string_view name,
+                                       const uint32_t inode_idx,
+                                       const uint32_t offset, uint32_t) {
+      return callback(name, inode_idx, offset);
+    });
+  }
+
+  // callback(name, inode_idx, offset, next_offset) from the entry at offset
+  // on until it returns true. The directory is read kDirScanSize at a time,
+  // stopping early reads only what was visited
+  template <typename callback_t>
+  void for_each_entry_from(const uint32_t offset, callback_t callback) {
+    auto size = disk_inode_->size;
+    if (offset >= size)
       return;
-    debug("disk_inode_->size = " + std::to_string(disk_inode_->size));
-    auto buf = new char[disk_inode_->size];
-    read(buf, 0, disk_inode_->size);
-    uint32_t offset = 0;
-    while (offset < disk_inode_->size) {
-      auto this_offset = offset;
+    NFS_SPAN("scan dir");
+    auto buf = Disk::align_alloc(kDirScanSize);
+    uint32_t start = offset, end = offset, pos = offset;
+    while (pos < size) {
+      // refill unless the whole next entry is in the window
+      if (end < size && pos + kMaxDirEntrySize > end) {
+        start = pos;
+        end = std::min(size, start + kDirScanSize);
+        read(buf.get(), start, end - start);
+      }
+      auto this_offset = pos;
+      auto next = pos - start;
       const auto [this_name, this_inode_idx, this_deleted] =
-          parse_one_dir_entry(buf, offset);
+          parse_one_dir_entry(buf.get(), next);
+      pos = start + next;
       if (this_deleted)
         continue;
-      auto done = callback(this_name, this_inode_idx, this_offset);
-      if (done) {
-        break;
-      }
+      if (callback(this_name, this_inode_idx, this_offset, pos))
+        return;
     }
-    delete[] buf;
   }
 
   void load_indirects(const uint32_t code) {
@@ -271,10 +315,72 @@ class Inode {
           "]->rewrite(addr = " + std::to_string(addr) +
           ", code = " + DiskInode::to_string(code) + ")"); */
     auto buf = Disk::align_alloc(kBlockSize);
-    seg_->read(buf, addr, kBlockSize);
-    auto new_addr = seg_->push(std::make_tuple(buf, inode_idx_, code), addr);
-    delete[] buf;
+    seg_->read_block(buf.get(), addr, 0, kBlockSize);
+    auto new_addr =
+        seg_->push(std::make_tuple(buf.get(), inode_idx_, code), addr);
     update_addr_by_code(new_addr, code);
+    Metrics::add(Metrics::Counter::kGCBytesCopied, kBlockSize);
+  }
+
+  // move the inline content to a block before the inode grows past it
+  void spill() {
+    char block[kBlockSize] = {};
+    auto size = disk_inode_->size;
+    std::memcpy(block, disk_inode_->inline_data(), size);
+    std::memset(disk_inode_->inline_data(), 0, DiskInode::kInlineSize);
+    if (size != 0)
+      disk_inode_->directs[0] = seg_->push(
+          std::make_tuple(block, inode_idx_, DiskInode::encode(0)));
+  }
+
+  // what lies past the old size is a hole, nothing is written
+  void grow(const uint32_t size) {
+    if (disk_inode_->is_inline() && size > DiskInode::kInlineSize)
+      spill();
+    disk_inode_->size = size;
+  }
+
+  void shrink(const uint32_t size) {
+    auto data = disk_inode_->inline_data();
+    if (disk_inode_->is_inline()) {
+      std::memset(data + size, 0, disk_inode_->size - size);
+      disk_inode_->size = size;
+      return;
+    }
+    if (size <= DiskInode::kInlineSize) {
+      char head[DiskInode::kInlineSize];
+      read(head, 0, size);
+      release();
+      std::memset(data, 0, DiskInode::kInlineSize);
+      std::memcpy(data, head, size);
+      disk_inode_->size = size;
+      return;
+    }
+    // the tail of the last block is zeroed too, a later grow reads zeros
+    zero_range(size, disk_inode_->size - size);
+    disk_inode_->size = size;
+  }
+
+  // drop the blocks inside [offset, offset + size), and those from which
+  // it runs to the end of file, zero the rest of it
+  void zero_range(const uint32_t offset, const uint32_t size) {
+    auto to_end = offset + size >= disk_inode_->size;
+    for_each_block(
+        offset, size,
+        [this, to_end](const uint32_t addr, const uint32_t this_offset,
+                       const uint32_t this_size, const uint32_t this_code) {
+          if (addr == DiskInode::INVALID_ADDR)
+            return addr;
+          if (this_offset == 0 && (this_size == kBlockSize || to_end)) {
+            seg_->discard(addr, kBlockSize);
+            return DiskInode::INVALID_ADDR;
+          }
+          auto buf = Disk::align_alloc(kBlockSize);
+          seg_->read_block(buf.get(), addr, 0, kBlockSize);
+          std::memset(buf.get() + this_offset, 0, this_size);
+          return seg_->push(std::make_tuple(buf.get(), inode_idx_, this_code),
+                            addr);
+        });
   }
 
 public:
@@ -283,11 +389,6 @@ public:
       : disk_inode_(std::move(disk_inode)), seg_(seg), dirty_(false),
         inode_idx_(inode_idx) {}
 
-  ~Inode() {
-    delete[] indirect1;
-    delete[] indirect2;
-  }
-
   std::unique_ptr<DiskInode> downgrade() {
     assert(disk_inode_ != nullptr);
     auto ret = std::unique_ptr<DiskInode>(nullptr);
@@ -296,23 +397,122 @@ public:
   }
 
   std::unique_ptr<DiskInode> truncate(const uint32_t size) {
-    debug("Inode[" + std::to_string(inode_idx_) + "]->truncate(" +
-          std::to_string(size) + ")");
-    for_each_block(size, disk_inode_->size - size,
-                   [this](const uint32_t addr, const uint32_t this_offset,
-                          const uint32_t, const uint32_t) {
-                     if (this_offset != 0)
-                       return addr;
-                     seg_->discard(addr, kBlockSize);
-                     return DiskInode::INVALID_ADDR;
+    NFS_TRACE(kDebug, kInode, "Inode[{}]->truncate({})", inode_idx_, size);
+    if (size >= disk_inode_->size)
+      grow(size);
+    else
+      shrink(size);
+    return downgrade();
+  }
+
+  // zero [offset, offset + size) if punch, dropping the blocks inside it,
+  // then grow to cover it unless keep_size. Nothing is reserved ahead in a
+  // log, so allocating only moves the size
+  std::unique_ptr<DiskInode> fallocate(const uint32_t offset,
+                                       const uint32_t size, const bool punch,
+                                       const bool keep_size) {
+    NFS_TRACE(kDebug, kInode,
+              "Inode[{}]->fallocate(offset = {}, size = {}, punch = {})",
+              inode_idx_, offset, size, punch);
+    if (punch && offset < disk_inode_->size) {
+      auto len = std::min(size, disk_inode_->size - offset);
+      if (disk_inode_->is_inline())
+        std::memset(disk_inode_->inline_data() + offset, 0, len);
+      else
+        zero_range(offset, len);
+    }
+    if (!keep_size && offset + size > disk_inode_->size)
+      grow(offset + size);
+    return downgrade();
+  }
+
+  // the first offset from offset on which is in data, or in a hole if not
+  // data, the size if there is none
+  uint32_t seek(const uint32_t offset, const bool data) {
+    if (offset >= disk_inode_->size)
+      return disk_inode_->size;
+    if (disk_inode_->is_inline())
+      return data ? offset : disk_inode_->size;
+    auto ret = disk_inode_->size;
+    auto cur = offset;
+    for_each_block(offset, disk_inode_->size - offset,
+                   [&](const uint32_t addr, const uint32_t,
+                       const uint32_t this_size, const uint32_t) {
+                     if (ret == disk_inode_->size &&
+                         (addr != DiskInode::INVALID_ADDR) == data)
+                       ret = cur;
+                     cur += this_size;
+                     return addr;
                    });
-    dirty_ = true;
-    disk_inode_->size = size;
+    return ret;
+  }
+
+  // share the whole blocks of [offset, offset + size) with a clone, every
+  // address put in addrs carries a ref of its own, a hole stays INVALID_ADDR
+  std::unique_ptr<DiskInode> share(const uint32_t offset, const uint32_t size,
+                                   std::vector<uint32_t> &addrs) {
+    for_each_block(offset, size,
+                   [&](const uint32_t addr, const uint32_t, const uint32_t,
+                       const uint32_t) {
+                     auto shared = addr == DiskInode::INVALID_ADDR
+                                       ? addr
+                                       : seg_->share(addr);
+                     addrs.push_back(shared);
+                     return shared;
+                   });
+    return downgrade();
+  }
+
+  // map the blocks from offset on to addrs, dropping the ones replaced
+  std::unique_ptr<DiskInode> clone(const uint32_t offset,
+                                   const std::vector<uint32_t> &addrs) {
+    if (disk_inode_->is_inline())
+      spill();
+    uint32_t size = addrs.size() * kBlockSize;
+    uint32_t i = 0;
+    for_each_block(offset, size,
+                   [&](const uint32_t addr, const uint32_t, const uint32_t,
+                       const uint32_t) {
+                     if (addr != DiskInode::INVALID_ADDR)
+                       seg_->discard(addr, kBlockSize);
+                     return addrs[i++];
+                   });
+    disk_inode_->size = std::max(disk_inode_->size, offset + size);
     return downgrade();
   }
 
+  // discard every block owned by this inode before it is freed
+  void release() {
+    if (disk_inode_->is_inline())
+      return;
+    for_each_block(0, disk_inode_->size,
+                   [this](const uint32_t addr, const uint32_t, const uint32_t,
+                          const uint32_t) {
+                     if (addr != DiskInode::INVALID_ADDR &&
+                         addr != DiskInode::TEMPORARY_ADDR)
+                       seg_->discard(addr, kBlockSize);
+                     return addr;
+                   });
+    if (disk_inode_->indirect2 != DiskInode::INVALID_ADDR &&
+        disk_inode_->indirect2 != DiskInode::TEMPORARY_ADDR) {
+      fetch_indirect1(kInodeDirectCnt + 1, disk_inode_->indirect2);
+      for (uint32_t i = 0; i < kBlockSize / 4; i++) {
+        if (indirect1[i] != DiskInode::INVALID_ADDR &&
+            indirect1[i] != DiskInode::TEMPORARY_ADDR)
+          seg_->discard(indirect1[i], kBlockSize);
+      }
+      seg_->discard(disk_inode_->indirect2, kBlockSize);
+    }
+    if (disk_inode_->indirect1 != DiskInode::INVALID_ADDR &&
+        disk_inode_->indirect1 != DiskInode::TEMPORARY_ADDR)
+      seg_->discard(disk_inode_->indirect1, kBlockSize);
+  }
+
   std::unique_ptr<DiskInode> rewrite_if_hit(
       const std::vector<std::pair<uint32_t, uint32_t>> &addr_and_code_list) {
+    // what the summary lists was dropped when the content went inline
+    if (disk_inode_->is_inline())
+      return nullptr;
     for (const auto &[addr, code] : addr_and_code_list) {
       auto this_addr = get_addr_by_code(code);
       const auto [i0, i1, i2] = DiskInode::decode(code);
@@ -337,9 +537,16 @@ public:
   }
 
   std::unique_ptr<DiskInode> write(char *buf, uint32_t offset, uint32_t size) {
-    debug("Inode[" + std::to_string(inode_idx_) + "]->write(offset = " +
-          std::to_string(offset) + ", size = " + std::to_string(size) + ")");
-    assert(offset <= disk_inode_->size);
+    NFS_TRACE(kDebug, kInode, "Inode[{}]->write(offset = {}, size = {})",
+              inode_idx_, offset, size);
+    if (disk_inode_->is_inline()) {
+      if (offset + size <= DiskInode::kInlineSize) {
+        std::memcpy(disk_inode_->inline_data() + offset, buf, size);
+        disk_inode_->size = std::max(disk_inode_->size, offset + size);
+        return downgrade();
+      }
+      spill();
+    }
     for_each_block(
         offset, size,
         [&buf, this](const uint32_t addr, const uint32_t this_offset,
@@ -362,17 +569,18 @@ public:
           }
           auto this_buf = Disk::align_alloc(kBlockSize);
           if (addr != DiskInode::INVALID_ADDR)
-            seg_->read(this_buf, addr, kBlockSize);
-          std::memcpy(this_buf + this_offset, buf, this_size);
+            seg_->read_block(this_buf.get(), addr, 0, kBlockSize);
+          else
+            std::memset(this_buf.get(), 0, kBlockSize);
+          std::memcpy(this_buf.get() + this_offset, buf, this_size);
           uint32_t new_addr;
           if (addr == DiskInode::INVALID_ADDR) {
-            new_addr =
-                seg_->push(std::make_tuple(this_buf, inode_idx_, this_code));
+            new_addr = seg_->push(
+                std::make_tuple(this_buf.get(), inode_idx_, this_code));
           } else {
             new_addr = seg_->push(
-                std::make_tuple(this_buf, inode_idx_, this_code), addr);
+                std::make_tuple(this_buf.get(), inode_idx_, this_code), addr);
           }
-          delete[] this_buf;
           buf += this_size;
           return new_addr;
         });
@@ -383,22 +591,29 @@ public:
 
   void sanity_check() {
 #ifndef NDEBUG
+    if (disk_inode_->is_inline())
+      return;
     for_each_block(0, disk_inode_->size,
                    [&](const uint32_t addr, const uint32_t, const uint32_t,
                        const uint32_t) {
-                     seg_->assert_not_discarded(addr);
+                     if (addr != DiskInode::INVALID_ADDR)
+                       seg_->assert_not_discarded(addr);
                      return addr;
                    });
 #endif
   }
 
   uint32_t read(char *buf, uint32_t offset, uint32_t size) {
-    debug("Inode[" + std::to_string(inode_idx_) + "]->read(offset = " +
-          std::to_string(offset) + ", size = " + std::to_string(size) + ")");
+    NFS_TRACE(kDebug, kInode, "Inode[{}]->read(offset = {}, size = {})",
+              inode_idx_, offset, size);
     if (offset >= disk_inode_->size)
       return 0;
     uint32_t actual_read = 0;
     size = std::min(size, disk_inode_->size - offset);
+    if (disk_inode_->is_inline()) {
+      std::memcpy(buf, disk_inode_->inline_data() + offset, size);
+      return size;
+    }
     for_each_block(offset, size,
                    [&buf, &actual_read,
                     this](const uint32_t addr, const uint32_t this_offset,
@@ -407,7 +622,11 @@ public:
                            ", this_offset = " + std::to_string(this_offset) +
                            ", this_size = " + std::to_string(this_size) + ")");
                       */
-                     seg_->read(buf, addr + this_offset, this_size);
+                     // a hole reads as zeros without touching the disk
+                     if (addr == DiskInode::INVALID_ADDR)
+                       std::memset(buf, 0, this_size);
+                     else
+                       seg_->read_block(buf, addr, this_offset, this_size);
                      buf += this_size;
                      actual_read += this_size;
                      return addr;
@@ -415,31 +634,58 @@ public:
     return actual_read;
   }
 
-  std::unique_ptr<DiskInode> push(const std::string &name,
+  std::unique_ptr<DiskInode> push(const std::string_view name,
                                   const uint32_t inode_idx) {
-    auto [buf, len] = make_one_dir_entry(name, inode_idx);
+    char buf[kMaxDirEntrySize];
+    auto len = make_one_dir_entry(buf, name, inode_idx);
     return write(buf, disk_inode_->size, len);
   }
 
+  bool is_dir() const { return S_ISDIR(disk_inode_->mode); }
+  uint32_t size() const { return disk_inode_->size; }
+
+  bool empty() {
+    bool ret = true;
+    for_each_entry_once([&ret](const std::string_view, const uint32_t,
+                               const uint32_t) {
+      ret = false;
+      return true;
+    });
+    return ret;
+  }
+
   std::vector<std::string> list_entries() {
     std::vector<std::string> names;
     for_each_entry_once(
-        [&names](const std::string &this_name, const uint32_t, const uint32_t) {
-          names.push_back(this_name);
+        [&names](const std::string_view this_name, const uint32_t,
+                 const uint32_t) {
+          names.emplace_back(this_name);
           return false;
         });
     return names;
   }
 
-  std::unique_ptr<DiskInode> erase_entry(const std::string &name) {
-    debug("Inode[" + std::to_string(inode_idx_) +
-          "]->erase_entry(name = " + name + ")");
+  // f(name, inode_idx, next_offset) for the entries from offset on until it
+  // returns false. Entries never move, so an offset stays a valid cursor
+  template <typename callback_t>
+  void list_entries_from(const uint32_t offset, callback_t f) {
+    for_each_entry_from(offset, [&f](const std::string_view this_name,
+                                     const uint32_t this_inode_idx, uint32_t,
+                                     const uint32_t next_offset) {
+      return !f(this_name, this_inode_idx, next_offset);
+    });
+  }
+
+  std::unique_ptr<DiskInode> erase_entry(const std::string_view name) {
+    NFS_TRACE(kDebug, kInode, "Inode[{}]->erase_entry(name = {})", inode_idx_,
+              name);
     std::unique_ptr<DiskInode> ret = nullptr;
-    for_each_entry_once([this, &name, &ret](const std::string &this_name,
+    for_each_entry_once([this, name, &ret](const std::string_view this_name,
                                             const uint32_t this_inode_idx,
                                             const uint32_t offset) {
       if (name == this_name) {
-        auto [buf, len] = make_one_dir_entry(this_name, this_inode_idx);
+        char buf[kMaxDirEntrySize];
+        auto len = make_one_dir_entry(buf, this_name, this_inode_idx);
         buf[len - 1] = true; /* deleted = true */
         ret = write(buf, offset, len);
         return true;
@@ -449,9 +695,9 @@ public:
     return ret;
   }
 
-  std::optional<uint32_t> find_entry(const std::string &name) {
+  std::optional<uint32_t> find_entry(const std::string_view name) {
     std::optional<uint32_t> ret = std::nullopt;
-    for_each_entry_once([&name, &ret](const std::string &this_name,
+    for_each_entry_once([name, &ret](const std::string_view this_name,
                                       const uint32_t this_inode_idx,
                                       const uint32_t) {
       if (this_name == name) {
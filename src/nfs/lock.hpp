@@ -0,0 +1,301 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <mutex>
+#include <shared_mutex>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+#include "nfs/config.hpp"
+#include "nfs/metrics.hpp"
+
+/*
+  A mutex which counts acquisitions, wait and hold times, and the call sites
+  which had to wait, when built with NFS_LOCK_PROFILE. Otherwise it is a plain
+  Mutex and the guards just lock and unlock it.
+
+    auto guard = lock_.lock();          // exclusive
+    auto guard = lock_.lock_shared();   // shared, Mutex = std::shared_mutex
+
+  The call site is taken from the caller through the default arguments, a
+  helper which locks on behalf of its callers should forward its own.
+*/
+
+#ifdef NFS_LOCK_PROFILE
+
+class LockStats {
+  struct Site {
+    // 0 while free, claimed once by CAS and never released. The claimer
+    // stores line, then file, a prober which finds the key waits for file
+    std::atomic<uint64_t> key{0};
+    std::atomic<const char *> file{nullptr};
+    std::atomic<uint32_t> line{0};
+    std::atomic<uint64_t> waits{0};
+    std::atomic<uint64_t> wait_ns{0};
+  };
+
+  const char *name_;
+  std::atomic<uint64_t> exclusive_{0};
+  std::atomic<uint64_t> shared_{0};
+  std::atomic<uint64_t> contended_{0};
+  std::atomic<uint64_t> wait_buckets_[Metrics::kNumBuckets] = {};
+  std::atomic<uint64_t> hold_buckets_[Metrics::kNumBuckets] = {};
+  Site sites_[kLockSites];
+
+  struct Registry {
+    std::mutex lock;
+    std::vector<LockStats *> stats;
+  };
+
+  static Registry &registry() {
+    static Registry registry;
+    return registry;
+  }
+
+  static bool holds(const Site &site, const char *file, const uint32_t line) {
+    const char *site_file;
+    while ((site_file = site.file.load(std::memory_order_acquire)) == nullptr)
+      ;
+    return site_file == file &&
+           site.line.load(std::memory_order_relaxed) == line;
+  }
+
+  Site *find_site(const char *file, const uint32_t line) {
+    auto key = (reinterpret_cast<uintptr_t>(file) * 31 + line) | 1;
+    for (uint32_t i = 0; i < kLockSites; i++) {
+      auto &site = sites_[(key + i) % kLockSites];
+      auto this_key = site.key.load(std::memory_order_acquire);
+      if (this_key == 0) {
+        if (site.key.compare_exchange_strong(this_key, key)) {
+          site.line.store(line, std::memory_order_relaxed);
+          site.file.store(file, std::memory_order_release);
+          return &site;
+        }
+      }
+      // another call site may hash to the same key
+      if (this_key == key && holds(site, file, line))
+        return &site;
+    }
+    // table is full, the wait still counts in the histogram
+    return nullptr;
+  }
+
+  static void bump(std::atomic<uint64_t> &value, const uint64_t delta = 1) {
+    value.fetch_add(delta, std::memory_order_relaxed);
+  }
+
+  static const char *basename(const char *file) {
+    auto slash = strrchr(file, '/');
+    return slash == nullptr ? file : slash + 1;
+  }
+
+public:
+  explicit LockStats(const char *name) : name_(name) {
+    auto &reg = registry();
+    auto lock = std::unique_lock(reg.lock);
+    reg.stats.push_back(this);
+  }
+
+  ~LockStats() {
+    auto &reg = registry();
+    auto lock = std::unique_lock(reg.lock);
+    reg.stats.erase(std::find(reg.stats.begin(), reg.stats.end(), this));
+  }
+
+  LockStats(const LockStats &) = delete;
+  LockStats &operator=(const LockStats &) = delete;
+
+  void acquired(const bool shared, const uint64_t wait_ns, const char *file,
+                const uint32_t line) {
+    bump(shared ? shared_ : exclusive_);
+    bump(wait_buckets_[Metrics::bucket_of(wait_ns)]);
+    if (wait_ns == 0)
+      return;
+    bump(contended_);
+    auto site = find_site(file, line);
+    if (site != nullptr) {
+      bump(site->waits);
+      bump(site->wait_ns, wait_ns);
+    }
+  }
+
+  void released(const uint64_t hold_ns) {
+    bump(hold_buckets_[Metrics::bucket_of(hold_ns)]);
+  }
+
+  /*
+    lock <name> exclusive <n> shared <n> contended <n> wait_p50_us <x> ...
+    lock_site <name> <file>:<line> waits <n> wait_us <x>
+  */
+
+  static std::string report() {
+    std::string ret;
+    char line[512];
+    auto &reg = registry();
+    auto lock = std::unique_lock(reg.lock);
+    for (auto stats : reg.stats) {
+      uint64_t wait[Metrics::kNumBuckets], hold[Metrics::kNumBuckets];
+      for (uint32_t i = 0; i < Metrics::kNumBuckets; i++) {
+        wait[i] = stats->wait_buckets_[i].load(std::memory_order_relaxed);
+        hold[i] = stats->hold_buckets_[i].load(std::memory_order_relaxed);
+      }
+      snprintf(line, sizeof(line),
+               "lock %s exclusive %llu shared %llu contended %llu "
+               "wait_p50_us %.1f wait_p99_us %.1f wait_p999_us %.1f "
+               "hold_p50_us %.1f hold_p99_us %.1f hold_p999_us %.1f\n",
+               stats->name_,
+               static_cast<unsigned long long>(stats->exclusive_.load()),
+               static_cast<unsigned long long>(stats->shared_.load()),
+               static_cast<unsigned long long>(stats->contended_.load()),
+               Metrics::percentile_us(wait, 0.5),
+               Metrics::percentile_us(wait, 0.99),
+               Metrics::percentile_us(wait, 0.999),
+               Metrics::percentile_us(hold, 0.5),
+               Metrics::percentile_us(hold, 0.99),
+               Metrics::percentile_us(hold, 0.999));
+      ret += line;
+      std::vector<const Site *> sites;
+      for (const auto &site : stats->sites_)
+        if (site.file.load() != nullptr && site.waits.load() != 0)
+          sites.push_back(&site);
+      std::sort(sites.begin(), sites.end(), [](auto lhs, auto rhs) {
+        return lhs->wait_ns.load() > rhs->wait_ns.load();
+      });
+      sites.resize(std::min<size_t>(sites.size(), kLockTopSites));
+      for (auto site : sites) {
+        snprintf(line, sizeof(line),
+                 "lock_site %s %s:%u waits %llu wait_us %.1f\n", stats->name_,
+                 basename(site->file.load()), site->line.load(),
+                 static_cast<unsigned long long>(site->waits.load()),
+                 site->wait_ns.load() / 1000.0);
+        ret += line;
+      }
+    }
+    return ret;
+  }
+};
+
+#else
+
+class LockStats {
+public:
+  explicit LockStats(const char *) {}
+  static std::string report() { return ""; }
+};
+
+#endif
+
+template <typename Mutex> class ProfiledLock {
+  Mutex mutex_;
+#ifdef NFS_LOCK_PROFILE
+  LockStats stats_;
+#endif
+
+public:
+  template <bool kShared> class Guard {
+    ProfiledLock *lock_;
+#ifdef NFS_LOCK_PROFILE
+    uint64_t acquired_ns_;
+#endif
+
+  public:
+    Guard() : lock_(nullptr) {}
+
+    Guard(ProfiledLock *lock, const char *file, const uint32_t line)
+        : lock_(lock) {
+#ifdef NFS_LOCK_PROFILE
+      uint64_t wait_ns = 0;
+      if (!try_lock()) {
+        auto start = Metrics::now_ns();
+        do_lock();
+        acquired_ns_ = Metrics::now_ns();
+        wait_ns = std::max<uint64_t>(acquired_ns_ - start, 1);
+      } else {
+        acquired_ns_ = Metrics::now_ns();
+      }
+      lock_->stats_.acquired(kShared, wait_ns, file, line);
+#else
+      (void)file;
+      (void)line;
+      do_lock();
+#endif
+    }
+
+    Guard(Guard &&other) : lock_(other.lock_) {
+#ifdef NFS_LOCK_PROFILE
+      acquired_ns_ = other.acquired_ns_;
+#endif
+      other.lock_ = nullptr;
+    }
+
+    Guard &operator=(Guard &&other) {
+      unlock();
+      lock_ = other.lock_;
+#ifdef NFS_LOCK_PROFILE
+      acquired_ns_ = other.acquired_ns_;
+#endif
+      other.lock_ = nullptr;
+      return *this;
+    }
+
+    ~Guard() { unlock(); }
+
+    bool owns_lock() const { return lock_ != nullptr; }
+
+    void unlock() {
+      if (lock_ == nullptr)
+        return;
+#ifdef NFS_LOCK_PROFILE
+      lock_->stats_.released(Metrics::now_ns() - acquired_ns_);
+#endif
+      if constexpr (kShared)
+        lock_->mutex_.unlock_shared();
+      else
+        lock_->mutex_.unlock();
+      lock_ = nullptr;
+    }
+
+  private:
+    bool try_lock() {
+      if constexpr (kShared)
+        return lock_->mutex_.try_lock_shared();
+      else
+        return lock_->mutex_.try_lock();
+    }
+
+    void do_lock() {
+      if constexpr (kShared)
+        lock_->mutex_.lock_shared();
+      else
+        lock_->mutex_.lock();
+    }
+  };
+
+  using ExclusiveGuard = Guard<false>;
+  using SharedGuard = Guard<true>;
+
+#ifdef NFS_LOCK_PROFILE
+  explicit ProfiledLock(const char *name) : stats_(name) {}
+#else
+  explicit ProfiledLock(const char *) {}
+#endif
+
+  ExclusiveGuard lock(const char *file = __builtin_FILE(),
+                      const uint32_t line = __builtin_LINE()) {
+    return ExclusiveGuard(this, file, line);
+  }
+
+  SharedGuard lock_shared(const char *file = __builtin_FILE(),
+                          const uint32_t line = __builtin_LINE()) {
+    static_assert(std::is_same_v<Mutex, std::shared_mutex>);
+    return SharedGuard(this, file, line);
+  }
+};
+
+using ProfiledMutex = ProfiledLock<std::mutex>;
+using ProfiledSharedMutex = ProfiledLock<std::shared_mutex>;
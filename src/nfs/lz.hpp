@@ -0,0 +1,165 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+
+/*
+  A small LZ77 codec in the spirit of the LZ4 block format, for compressing
+  one block at a time. The output is a list of sequences:
+
+    [token: uint8_t, literal_len..., literals, match_offset: uint16_t,
+     match_len...]
+
+  The high nibble of the token is the number of literals, the low one the
+  match length minus kMinMatch, a nibble of 15 is continued by bytes added to
+  it until one is below 255. The last sequence has literals only.
+*/
+
+class LZ {
+  static constexpr uint32_t kHashBits = 12;
+  static constexpr uint32_t kMinMatch = 4;
+  static constexpr uint32_t kMaxOffset = 65535;
+
+  static uint32_t load32(const char *p) {
+    uint32_t v;
+    std::memcpy(&v, p, 4);
+    return v;
+  }
+
+  static uint32_t hash(const uint32_t v) {
+    return (v * 2654435761u) >> (32 - kHashBits);
+  }
+
+  // false if it does not fit in [op, cap)
+  static bool put_len(char *dst, uint32_t &op, const uint32_t cap,
+                      uint32_t len) {
+    while (len >= 255) {
+      if (op >= cap)
+        return false;
+      dst[op++] = static_cast<char>(255);
+      len -= 255;
+    }
+    if (op >= cap)
+      return false;
+    dst[op++] = static_cast<char>(len);
+    return true;
+  }
+
+  static bool get_len(const char *src, uint32_t &ip, const uint32_t n,
+                      uint32_t &len) {
+    uint8_t byte;
+    do {
+      if (ip >= n)
+        return false;
+      byte = static_cast<uint8_t>(src[ip++]);
+      len += byte;
+    } while (byte == 255);
+    return true;
+  }
+
+  static bool put_sequence(char *dst, uint32_t &op, const uint32_t cap,
+                           const char *literals, const uint32_t lit_len,
+                           const uint32_t offset, const uint32_t match_len) {
+    if (op >= cap)
+      return false;
+    auto &token = dst[op++];
+    token = static_cast<char>(std::min<uint32_t>(lit_len, 15) << 4);
+    if (lit_len >= 15 && !put_len(dst, op, cap, lit_len - 15))
+      return false;
+    if (op + lit_len > cap)
+      return false;
+    std::memcpy(dst + op, literals, lit_len);
+    op += lit_len;
+    if (match_len == 0)
+      return true;
+    auto extra = match_len - kMinMatch;
+    token |= static_cast<char>(std::min<uint32_t>(extra, 15));
+    if (op + 2 > cap)
+      return false;
+    dst[op++] = static_cast<char>(offset & 0xff);
+    dst[op++] = static_cast<char>(offset >> 8);
+    return extra < 15 || put_len(dst, op, cap, extra - 15);
+  }
+
+public:
+  // size of the output, 0 if it does not fit in cap bytes
+  static uint32_t compress(const char *src, const uint32_t n, char *dst,
+                           const uint32_t cap) {
+    // position + 1 of the last occurrence of each hash, 0 if none
+    uint32_t table[1 << kHashBits] = {};
+    uint32_t ip = 0, anchor = 0, op = 0;
+    while (ip + kMinMatch <= n) {
+      auto v = load32(src + ip);
+      auto h = hash(v);
+      auto candidate = table[h];
+      table[h] = ip + 1;
+      if (candidate == 0 || ip - (candidate - 1) > kMaxOffset ||
+          load32(src + candidate - 1) != v) {
+        ip += 1;
+        continue;
+      }
+      auto match = candidate - 1;
+      auto len = kMinMatch;
+      while (ip + len + 8 <= n) {
+        uint64_t a, b;
+        std::memcpy(&a, src + match + len, 8);
+        std::memcpy(&b, src + ip + len, 8);
+        if (a != b) {
+          len += __builtin_ctzll(a ^ b) / 8;
+          break;
+        }
+        len += 8;
+      }
+      while (ip + len < n && src[match + len] == src[ip + len])
+        len += 1;
+      if (!put_sequence(dst, op, cap, src + anchor, ip - anchor, ip - match,
+                        len))
+        return 0;
+      ip += len;
+      anchor = ip;
+    }
+    if (!put_sequence(dst, op, cap, src + anchor, n - anchor, 0, 0))
+      return 0;
+    return op;
+  }
+
+  // false unless src decodes to exactly n bytes
+  static bool decompress(const char *src, const uint32_t len, char *dst,
+                         const uint32_t n) {
+    uint32_t ip = 0, op = 0;
+    while (ip < len) {
+      auto token = static_cast<uint8_t>(src[ip++]);
+      uint32_t lit_len = token >> 4;
+      if (lit_len == 15 && !get_len(src, ip, len, lit_len))
+        return false;
+      if (ip + lit_len > len || op + lit_len > n)
+        return false;
+      std::memcpy(dst + op, src + ip, lit_len);
+      ip += lit_len;
+      op += lit_len;
+      if (ip == len)
+        break;
+      if (ip + 2 > len)
+        return false;
+      uint32_t offset = static_cast<uint8_t>(src[ip]) |
+                        static_cast<uint8_t>(src[ip + 1]) << 8;
+      ip += 2;
+      uint32_t match_len = token & 15;
+      if (match_len == 15 && !get_len(src, ip, len, match_len))
+        return false;
+      match_len += kMinMatch;
+      if (offset == 0 || offset > op || op + match_len > n)
+        return false;
+      if (offset >= match_len) {
+        std::memcpy(dst + op, dst + op - offset, match_len);
+        op += match_len;
+        continue;
+      }
+      // byte by byte, the match overlaps what it produces
+      for (uint32_t i = 0; i < match_len; i++, op++)
+        dst[op] = dst[op - offset];
+    }
+    return op == n;
+  }
+};
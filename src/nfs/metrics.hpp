@@ -0,0 +1,230 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <string>
+
+#include "nfs/config.hpp"
+#include "nfs/per_thread.hpp"
+
+/*
+  Counters and latency histograms kept per thread, every shard is written by
+  its owner only so recording is a plain load and store. report() sums the
+  shards of every thread. The shard of a thread which exited goes on to the
+  next new thread, which adds to what it holds, so nothing recorded is lost
+  and there are only as many shards as threads ever ran at once.
+
+  Latencies are bucketed by log2 of the nanoseconds, percentiles are reported
+  as the upper bound of their bucket.
+*/
+
+class Metrics {
+public:
+  enum class Counter : uint32_t {
+    kUserBytesRead,
+    kUserBytesWritten,
+    kLogBytesAppended,
+    kLogBytesDiscarded,
+    kSegmentsWritten,
+    kBuilderReadHits,
+    kDiskBytesRead,
+    kDiskBytesWritten,
+    kDiskSyncs,
+    kGCSegmentsSelected,
+    kGCBytesCopied,
+    kBlocksCompressed,
+    kCompressBytesSaved,
+    kInodeCacheHits,
+    kInodeCacheMisses,
+    kSegmentsDiscarded,
+    kDedupHits,
+    kDedupMismatches,
+    kBlocksCloned,
+    kNumCounters,
+  };
+
+  enum class Timer : uint32_t {
+    kGetattr,
+    kMkdir,
+    kUnlink,
+    kRmdir,
+    kRename,
+    kTruncate,
+    kOpen,
+    kCreate,
+    kRead,
+    kWrite,
+    kFlush,
+    kRelease,
+    kFsync,
+    kReaddir,
+    kAccess,
+    kUtimens,
+    kFallocate,
+    kLseek,
+    kSnapshot,
+    kCopyFileRange,
+    kGC,
+    kCheckpoint,
+    kNumTimers,
+  };
+
+  // bucket i holds latencies in [2^(i-1), 2^i) ns, the last one is open
+  static constexpr uint32_t kNumBuckets = 40;
+
+  static uint32_t bucket_of(const uint64_t ns) {
+    auto bucket = ns == 0 ? 0 : 64 - __builtin_clzll(ns);
+    return std::min<uint32_t>(bucket, kNumBuckets - 1);
+  }
+
+  // upper bound of the bucket holding the given fraction of the samples
+  static double percentile_us(const uint64_t *buckets, const double fraction) {
+    uint64_t count = 0;
+    for (uint32_t j = 0; j < kNumBuckets; j++)
+      count += buckets[j];
+    uint64_t seen = 0;
+    uint32_t j = 0;
+    for (; j < kNumBuckets - 1; j++) {
+      seen += buckets[j];
+      if (seen >= fraction * count)
+        break;
+    }
+    return static_cast<double>(1ull << j) / 1000;
+  }
+
+private:
+  static constexpr uint32_t kNumCounters =
+      static_cast<uint32_t>(Counter::kNumCounters);
+  static constexpr uint32_t kNumTimers =
+      static_cast<uint32_t>(Timer::kNumTimers);
+
+  struct Shard {
+    std::atomic<uint64_t> counters[kNumCounters] = {};
+    std::atomic<uint64_t> sum_ns[kNumTimers] = {};
+    std::atomic<uint64_t> buckets[kNumTimers][kNumBuckets] = {};
+  };
+
+  using Shards = PerThread<Shard>;
+
+  // single writer, no read-modify-write needed
+  static void bump(std::atomic<uint64_t> &value, const uint64_t delta) {
+    value.store(value.load(std::memory_order_relaxed) + delta,
+                std::memory_order_relaxed);
+  }
+
+  static const char *counter_name(const uint32_t i) {
+    static const char *names[] = {
+        "user_bytes_read",      "user_bytes_written",  "log_bytes_appended",
+        "log_bytes_discarded",  "segments_written",    "builder_read_hits",
+        "disk_bytes_read",      "disk_bytes_written",  "disk_syncs",
+        "gc_segments_selected", "gc_bytes_copied",     "blocks_compressed",
+        "compress_bytes_saved", "inode_cache_hits",    "inode_cache_misses",
+        "segments_discarded",   "dedup_hits",          "dedup_mismatches",
+        "blocks_cloned",
+    };
+    static_assert(sizeof(names) / sizeof(names[0]) == kNumCounters);
+    return names[i];
+  }
+
+public:
+  static const char *timer_name(const uint32_t i) {
+    static const char *names[] = {
+        "getattr", "mkdir",     "unlink", "rmdir",    "rename",
+        "truncate", "open",     "create", "read",     "write",
+        "flush",   "release",   "fsync",  "readdir",  "access",
+        "utimens", "fallocate", "lseek",  "snapshot", "copy_file_range",
+        "gc",      "checkpoint",
+    };
+    static_assert(sizeof(names) / sizeof(names[0]) == kNumTimers);
+    return names[i];
+  }
+
+  static uint64_t now_ns() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+               std::chrono::steady_clock::now().time_since_epoch())
+        .count();
+  }
+
+  static void add(const Counter counter, const uint64_t delta = 1) {
+    bump(Shards::local().counters[static_cast<uint32_t>(counter)], delta);
+  }
+
+  static void observe(const Timer timer, const uint64_t ns) {
+    auto &shard = Shards::local();
+    auto i = static_cast<uint32_t>(timer);
+    bump(shard.sum_ns[i], ns);
+    bump(shard.buckets[i][bucket_of(ns)], 1);
+  }
+
+  // records the lifetime of the scope into a timer
+  class Scope {
+    const Timer timer_;
+    const uint64_t start_;
+
+  public:
+    explicit Scope(const Timer timer) : timer_(timer), start_(now_ns()) {}
+    ~Scope() { observe(timer_, now_ns() - start_); }
+  };
+
+  static uint64_t get(const Counter counter) {
+    uint64_t ret = 0;
+    Shards::for_each([&ret, counter](const Shard &shard, uint32_t) {
+      ret += shard.counters[static_cast<uint32_t>(counter)].load(
+          std::memory_order_relaxed);
+    });
+    return ret;
+  }
+
+  /*
+    counter <name> <value>
+    timer <name> count <n> avg_us <x> p50_us <x> p99_us <x> p999_us <x> max_us
+  */
+
+  static std::string report() {
+    uint64_t counters[kNumCounters] = {};
+    uint64_t sum_ns[kNumTimers] = {};
+    uint64_t buckets[kNumTimers][kNumBuckets] = {};
+    Shards::for_each([&](const Shard &shard, uint32_t) {
+      for (uint32_t i = 0; i < kNumCounters; i++)
+        counters[i] += shard.counters[i].load(std::memory_order_relaxed);
+      for (uint32_t i = 0; i < kNumTimers; i++) {
+        sum_ns[i] += shard.sum_ns[i].load(std::memory_order_relaxed);
+        for (uint32_t j = 0; j < kNumBuckets; j++)
+          buckets[i][j] += shard.buckets[i][j].load(std::memory_order_relaxed);
+      }
+    });
+    std::string ret;
+    char line[256];
+    for (uint32_t i = 0; i < kNumCounters; i++) {
+      snprintf(line, sizeof(line), "counter %s %llu\n", counter_name(i),
+               static_cast<unsigned long long>(counters[i]));
+      ret += line;
+    }
+    for (uint32_t i = 0; i < kNumTimers; i++) {
+      uint64_t count = 0;
+      for (uint32_t j = 0; j < kNumBuckets; j++)
+        count += buckets[i][j];
+      if (count == 0)
+        continue;
+      uint32_t max = kNumBuckets - 1;
+      while (buckets[i][max] == 0)
+        max -= 1;
+      snprintf(line, sizeof(line),
+               "timer %s count %llu avg_us %.1f p50_us %.1f p99_us %.1f "
+               "p999_us %.1f max_us %.1f\n",
+               timer_name(i), static_cast<unsigned long long>(count),
+               static_cast<double>(sum_ns[i]) / count / 1000,
+               percentile_us(buckets[i], 0.5), percentile_us(buckets[i], 0.99),
+               percentile_us(buckets[i], 0.999),
+               static_cast<double>(1ull << max) / 1000);
+      ret += line;
+    }
+    return ret;
+  }
+};
+
+#define NFS_TIMER(timer)                                                       \
+  Metrics::Scope nfs_timer_scope_(Metrics::Timer::timer)
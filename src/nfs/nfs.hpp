@@ -2,23 +2,33 @@
 
 #include <cassert>
 #include <chrono>
+#include <condition_variable>
 #include <cstdio>
+#include <cstring>
 #include <fcntl.h>
+#include <linux/falloc.h>
 #include <memory>
 #include <mutex>
 #include <optional>
+#include <set>
 #include <shared_mutex>
 #include <string>
 #include <thread>
+#include <vector>
 
 #include "nfs/config.hpp"
+#include "nfs/dedup.hpp"
 #include "nfs/disk.hpp"
 #include "nfs/disk_inode.hpp"
 #include "nfs/fd.hpp"
 #include "nfs/id.hpp"
 #include "nfs/imap.hpp"
 #include "nfs/inode.hpp"
+#include "nfs/lock.hpp"
+#include "nfs/metrics.hpp"
 #include "nfs/seg.hpp"
+#include "nfs/span.hpp"
+#include "nfs/trace.hpp"
 #include "nfs/utils.hpp"
 
 class NaiveFS {
@@ -29,123 +39,595 @@ class NaiveFS {
   std::unique_ptr<IDManager> id_mgr_;
 
   enum class CR_DEST { START, END } last_cr_dest_;
+  // number of checkpoints written since mount
+  std::atomic<uint64_t> cr_epoch_;
+  // a snapshot is mounted, nothing is ever written
+  bool read_only_ = false;
 
   // We need to promote imap lock to this level
   // to prevent partial update. That is to say,
   // every atomic fs operation should acquire a shared
   // lock before any other update.
-  std::shared_mutex lock_flushing_cr_;
+  ProfiledSharedMutex lock_flushing_cr_{"lock_flushing_cr_"};
   std::unique_ptr<std::thread> gc_;
   std::unique_ptr<std::thread> ckpt_;
+  std::unique_ptr<std::thread> stats_;
+  // creating the file of the dedup table
+  std::mutex lock_dedup_inode_;
+  // unlinked inodes still open, kept in a hidden file at each checkpoint so
+  // that the next mount frees them after a crash
+  std::mutex lock_orphans_;
+  std::set<uint32_t> orphans_;
+  bool orphans_dirty_ = false;
+  std::mutex lock_stop_;
+  std::condition_variable stop_cv_;
+  bool stopping_ = false;
+
+  ProfiledSharedMutex::SharedGuard
+  lock_cr_shared(const char *file = __builtin_FILE(),
+                 const uint32_t line = __builtin_LINE()) {
+    return Spans::timed("wait lock_flushing_cr_ (shared)", [&] {
+      return lock_flushing_cr_.lock_shared(file, line);
+    });
+  }
+
+  ProfiledSharedMutex::ExclusiveGuard
+  lock_cr_unique(const char *file = __builtin_FILE(),
+                 const uint32_t line = __builtin_LINE()) {
+    return Spans::timed("wait lock_flushing_cr_", [&] {
+      return lock_flushing_cr_.lock(file, line);
+    });
+  }
+
+  uint32_t push_imap_page(const char *page, const uint32_t page_idx,
+                          const uint32_t old_addr) {
+    return seg_mgr_->push(std::make_tuple(const_cast<char *>(page),
+                                          Imap::kPageOwner, page_idx),
+                          old_addr);
+  }
+
+  // write the dirty pages of the dedup table into its file, before the imap
+  // which then points at the new version of the file
+  void flush_dedup() {
+    auto inode_idx = id_mgr_->dedup_inode_idx();
+    if (inode_idx == IDManager::root_inode_idx)
+      return;
+    seg_mgr_->flush_dedup(
+        [&](char *pages, const uint32_t offset, const uint32_t size) {
+          auto dinode_addr = imap_->get(inode_idx);
+          auto disk_inode = get_inode(inode_idx)->write(pages, offset, size);
+          auto addr = seg_mgr_->push(
+              std::make_pair(disk_inode.get(), inode_idx), dinode_addr);
+          imap_->update(inode_idx, addr);
+        });
+  }
+
+  // rewrite the orphan list as a file of inode numbers
+  void flush_orphans() {
+    std::vector<uint32_t> list;
+    {
+      auto lock = std::unique_lock(lock_orphans_);
+      if (!orphans_dirty_)
+        return;
+      orphans_dirty_ = false;
+      list.assign(orphans_.begin(), orphans_.end());
+    }
+    auto inode_idx = id_mgr_->orphans_inode_idx();
+    if (inode_idx == IDManager::root_inode_idx) {
+      if (list.empty())
+        return;
+      auto disk_inode = DiskInode::make_file();
+      inode_idx = id_mgr_->allocate();
+      imap_->update(inode_idx, seg_mgr_->push(std::make_pair(
+                                   disk_inode.get(), inode_idx)));
+      id_mgr_->set_orphans_inode_idx(inode_idx);
+    }
+    uint32_t size = list.size() * 4;
+    if (size != 0) {
+      auto buf = Disk::align_alloc(size);
+      std::memcpy(buf.get(), list.data(), size);
+      auto disk_inode = get_inode(inode_idx)->write(buf.get(), 0, size);
+      imap_->update(inode_idx,
+                    seg_mgr_->push(std::make_pair(disk_inode.get(), inode_idx),
+                                   imap_->get(inode_idx)));
+    }
+    auto inode = get_inode(inode_idx);
+    if (inode->size() > size) {
+      auto disk_inode = inode->truncate(size);
+      imap_->update(inode_idx,
+                    seg_mgr_->push(std::make_pair(disk_inode.get(), inode_idx),
+                                   imap_->get(inode_idx)));
+    }
+  }
+
+  // free what the last mount left unlinked but open, then checkpoint before
+  // any of their numbers can be reused
+  void free_orphans() {
+    auto inode_idx = id_mgr_->orphans_inode_idx();
+    if (inode_idx == IDManager::root_inode_idx)
+      return;
+    auto inode = get_inode(inode_idx);
+    if (inode->size() == 0)
+      return;
+    std::vector<uint32_t> list(inode->size() / 4);
+    auto buf = Disk::align_alloc(inode->size());
+    inode->read(buf.get(), 0, inode->size());
+    std::memcpy(list.data(), buf.get(), list.size() * 4);
+    for (auto orphan : list) {
+      if (!imap_->contains(orphan))
+        continue;
+      NFS_TRACE(kInfo, kFS, "free orphan inode {}", orphan);
+      free_inode(orphan);
+    }
+    orphans_dirty_ = true;
+    flush_cr();
+  }
 
   void flush_cr() {
-    debug("BACKGROUND: flushing checkpoint region");
-    auto lock = std::unique_lock(lock_flushing_cr_);
+    if (read_only_)
+      return;
+    auto lock = lock_cr_unique();
+    flush_cr_locked();
+  }
+
+  // return the image of the checkpoint region just written
+  AlignedBuffer flush_cr_locked() {
+    NFS_TRACE(kInfo, kCheckpoint, "flushing checkpoint region");
+    NFS_SPAN("checkpoint");
+    NFS_TIMER(kCheckpoint);
+    flush_orphans();
+    flush_dedup();
+    imap_->flush([this](const char *page, const uint32_t page_idx,
+                        const uint32_t old_addr) {
+      return push_imap_page(page, page_idx, old_addr);
+    });
     seg_mgr_->flush();
-    const char *imap_buf = imap_->get_buf();
     const char *seg_buf = seg_mgr_->get_buf();
-    char *newbuf = disk_->align_alloc(kCRSize);
-    memcpy(newbuf, imap_buf, kCRImapSize);
-    memcpy(newbuf + kCRImapSize, seg_buf, kCRSize - kCRImapSize);
+    auto newbuf = disk_->align_alloc(kCRSize);
+    imap_->store(newbuf.get());
+    id_mgr_->store(newbuf.get() + kCRImapSize);
+    memcpy(newbuf.get() + kCRImapSize + kCRIDSize, seg_buf, kMaxSegments * 8);
     auto addr = last_cr_dest_ == CR_DEST::START ? disk_->end() - kCRSize : 0;
     last_cr_dest_ =
         last_cr_dest_ == CR_DEST::START ? CR_DEST::END : CR_DEST::START;
-    disk_->write(newbuf, addr, kCRSize);
+    // header last, a torn checkpoint keeps the version of the older one
+    disk_->write(newbuf.get() + kCRImapHeaderSize, addr + kCRImapHeaderSize,
+                 kCRSize - kCRImapHeaderSize);
+    disk_->sync();
+    disk_->write(newbuf.get(), addr, kCRImapHeaderSize);
     disk_->sync();
-    debug("flushed with version = " + std::to_string(imap_->version()) +
-          " count = " + std::to_string(imap_->count()));
+    seg_mgr_->discard_free_segments();
+    cr_epoch_ += 1;
+    NFS_TRACE(kInfo, kCheckpoint, "flushed with version = {} count = {}",
+              imap_->version(), imap_->count());
+    return newbuf;
+  }
+
+  // build the imap, the id manager and the segment table from the image of
+  // a checkpoint region
+  void load_cr(const char *cr) {
+    seg_mgr_.reset();
+    imap_ = std::make_unique<Imap>(cr);
+    imap_->load(disk_.get());
+    id_mgr_ = std::make_unique<IDManager>(cr + kCRImapSize);
+    id_mgr_->load([this](const uint32_t inode_idx) {
+      return imap_->contains(inode_idx);
+    });
+    auto seg_status = Disk::align_alloc(kMaxSegments * 8);
+    std::memcpy(seg_status.get(), cr + kCRImapSize + kCRIDSize,
+                kMaxSegments * 8);
+    seg_mgr_ = std::make_unique<SegmentsManager>(disk_.get(), imap_.get(),
+                                                 std::move(seg_status));
+  }
+
+  // the checkpoint image a snapshot was taken from, the content of its file
+  AlignedBuffer read_snapshot(const uint32_t inode_idx) {
+    auto image = Disk::align_alloc(kCRSize);
+    get_inode(inode_idx)->read(image.get(), 0, kCRSize);
+    return image;
+  }
+
+  std::optional<uint32_t> find_snapshot(const std::string_view name) {
+    auto dir_idx = id_mgr_->snapshots_inode_idx();
+    if (dir_idx == IDManager::root_inode_idx)
+      return std::nullopt;
+    return get_inode(dir_idx)->find_entry(name);
+  }
+
+  // every snapshot keeps what it refers to, pinned before anything is
+  // written after mounting
+  void load_snapshots() {
+    auto dir_idx = id_mgr_->snapshots_inode_idx();
+    if (dir_idx == IDManager::root_inode_idx)
+      return;
+    for (const auto &name : get_inode(dir_idx)->list_entries()) {
+      auto image = read_snapshot(find_snapshot(name).value());
+      seg_mgr_->pin(image.get() + kCRImapSize + kCRIDSize);
+    }
+  }
+
+  void check_writable() const {
+    if (read_only_)
+      throw ReadOnly();
+  }
+
+  // handles already in the block maps are resolved even with dedup off
+  void load_dedup() {
+    auto inode_idx = id_mgr_->dedup_inode_idx();
+    if (inode_idx == IDManager::root_inode_idx)
+      return;
+    auto inode = get_inode(inode_idx);
+    auto table = Disk::align_alloc(std::max(inode->size(), kBlockSize));
+    inode->read(table.get(), 0, inode->size());
+    seg_mgr_->load_dedup(table.get(), inode->size());
+    seg_mgr_->set_dedup_inode(inode_idx);
+  }
+
+  // the hidden inode holding the dedup table, created on first use
+  uint32_t dedup_inode() {
+    auto lock = std::unique_lock(lock_dedup_inode_);
+    auto inode_idx = id_mgr_->dedup_inode_idx();
+    if (inode_idx != IDManager::root_inode_idx)
+      return inode_idx;
+    auto disk_inode = DiskInode::make_file();
+    inode_idx = id_mgr_->allocate();
+    imap_->update(inode_idx,
+                  seg_mgr_->push(std::make_pair(disk_inode.get(), inode_idx)));
+    id_mgr_->set_dedup_inode_idx(inode_idx);
+    seg_mgr_->set_dedup_inode(inode_idx);
+    return inode_idx;
   }
 
   // running in a seperate thread
   void checkpoint_background() {
-    while (true) {
-      std::this_thread::sleep_for(std::chrono::seconds(kCRFlushingSeconds));
+    while (wait_or_stop(kCRFlushingSeconds))
       flush_cr();
+  }
+
+  // running in a seperate thread
+  void stats_background() {
+    std::string tmp_path = std::string(kStatsPath) + ".tmp";
+    while (wait_or_stop(kStatsDumpSeconds)) {
+      auto report = stats();
+      auto file = fopen(tmp_path.c_str(), "w");
+      if (file == nullptr)
+        continue;
+      fwrite(report.data(), 1, report.length(), file);
+      fclose(file);
+      std::rename(tmp_path.c_str(), kStatsPath);
     }
   }
 
+  // sleep unless stopping, return false once stopping
+  bool wait_or_stop(const uint32_t seconds) {
+    auto lock = std::unique_lock(lock_stop_);
+    return !stop_cv_.wait_for(lock, std::chrono::seconds(seconds),
+                              [this] { return stopping_; });
+  }
+
   // running in a seperate thread
   void gc_background() {
-    while (true) {
-      std::this_thread::sleep_for(std::chrono::seconds(kGCCheckSeconds));
-      auto lock = std::unique_lock(lock_flushing_cr_);
-      debug("BACKGROUND: checking for gc");
-      const auto [ds_by_inode_idx, addr_by_inode_idx] =
-          seg_mgr_->select_segments_for_gc();
-      debug("\tds_by_inode_idx of size " +
-            std::to_string(ds_by_inode_idx.size()) +
-            ", addr_by_inode_idx of size " +
-            std::to_string(addr_by_inode_idx.size()));
-      for (const auto &[inode_idx, addr_and_code_list] : ds_by_inode_idx) {
-        auto inode = get_inode(inode_idx);
-        auto ret = inode->rewrite_if_hit(addr_and_code_list);
-        if (ret != nullptr) {
-          auto addr = seg_mgr_->push(std::make_pair(ret.get(), inode_idx),
-                                     imap_->get(inode_idx));
-          imap_->update(inode_idx, addr);
-        }
-#ifndef NDEBUG
-        inode = get_inode(inode_idx);
-        inode->sanity_check();
-#endif
-      }
-      for (const auto &[inode_idx, inode_addr] : addr_by_inode_idx) {
-        if (inode_addr != imap_->get(inode_idx))
-          continue;
-        debug("update inode(" + std::to_string(inode_idx) +
-              ", inode_addr = " + std::to_string(inode_addr) + ")");
-        auto inode = get_diskinode(inode_idx);
-        auto addr =
-            seg_mgr_->push(std::make_pair(inode.get(), inode_idx), inode_addr);
-        imap_->update(inode_idx, addr);
-      }
-    }
+    while (wait_or_stop(kGCCheckSeconds))
+      gc();
   }
 
 public:
   NaiveFS()
-      : disk_(std::make_unique<Disk>(kDiskPath, kDiskCapacityMB)),
-        fd_mgr_(std::make_unique<FDManager>()),
-        id_mgr_(std::make_unique<IDManager>()) {
-    char *buf_start = Disk::align_alloc(kCRImapSize);
-    char *buf_end = Disk::align_alloc(kCRImapSize);
-    char *buf_seg_status = Disk::align_alloc(kMaxSegments * 8);
-    disk_->read(buf_start, 0, kCRImapSize);
-    disk_->read(buf_end, disk_->end() - kCRSize, kCRImapSize);
-    auto imap1_ = std::make_unique<Imap>(buf_start);
-    auto imap2_ = std::make_unique<Imap>(buf_end);
-    if (imap1_->version() > imap2_->version()) {
-      imap_.swap(imap1_);
+      : NaiveFS(Disk::make(DiskBackend::kFile, kDiskPath, kDiskCapacityMB)) {}
+
+  // without background threads, gc and checkpoints only run when asked. A
+  // snapshot is mounted read-only and never runs them
+  explicit NaiveFS(std::unique_ptr<Disk> disk, const bool background = true,
+                   const std::string_view snapshot = {})
+      : disk_(std::move(disk)), fd_mgr_(std::make_unique<FDManager>()),
+        cr_epoch_(0) {
+    auto buf_start = Disk::align_alloc(kCRSize);
+    auto buf_end = Disk::align_alloc(kCRSize);
+    disk_->read(buf_start.get(), 0, kCRSize);
+    disk_->read(buf_end.get(), disk_->end() - kCRSize, kCRSize);
+    if (Imap(buf_start.get()).version() > Imap(buf_end.get()).version()) {
       last_cr_dest_ = CR_DEST::START;
-      disk_->read(buf_seg_status, kCRImapSize, kMaxSegments * 8);
-      debug("use left CR");
+      load_cr(buf_start.get());
+      NFS_TRACE(kInfo, kCheckpoint, "use left CR");
     } else {
-      imap_.swap(imap2_);
       last_cr_dest_ = CR_DEST::END;
-      disk_->read(buf_seg_status, disk_->end() - kCRSize + kCRImapSize,
-                  kMaxSegments * 8);
-      debug("use right CR");
+      load_cr(buf_end.get());
+      NFS_TRACE(kInfo, kCheckpoint, "use right CR");
     }
-    seg_mgr_ = std::make_unique<SegmentsManager>(disk_.get(), imap_.get(),
-                                                 buf_seg_status);
+    load_dedup();
+    if (!snapshot.empty()) {
+      auto inode_idx = find_snapshot(snapshot);
+      if (!inode_idx.has_value())
+        throw NoEntry();
+      load_cr(read_snapshot(inode_idx.value()).get());
+      read_only_ = true;
+      load_dedup();
+      return;
+    }
+    load_snapshots();
+    free_orphans();
     if (imap_->count() == 0) {
       auto root_inode = DiskInode::make_dir();
       auto addr = seg_mgr_->push(
           std::make_pair(root_inode.get(), IDManager::root_inode_idx));
       imap_->update(IDManager::root_inode_idx, addr);
     }
+    if (!background)
+      return;
     gc_ = std::make_unique<std::thread>(&NaiveFS::gc_background, this);
     ckpt_ =
         std::make_unique<std::thread>(&NaiveFS::checkpoint_background, this);
+    stats_ = std::make_unique<std::thread>(&NaiveFS::stats_background, this);
   }
 
-  ~NaiveFS() { flush_cr(); }
+  ~NaiveFS() {
+    {
+      auto lock = std::unique_lock(lock_stop_);
+      stopping_ = true;
+    }
+    stop_cv_.notify_all();
+    for (auto thread : {gc_.get(), ckpt_.get(), stats_.get()})
+      if (thread != nullptr)
+        thread->join();
+    // nothing can read the inodes unlinked while open any more
+    if (!read_only_) {
+      for (auto orphan : orphans_)
+        free_inode(orphan);
+      orphans_.clear();
+      orphans_dirty_ = true;
+    }
+    flush_cr();
+  }
+
+  // drop an inode which is no longer linked from any directory
+  void free_inode(const uint32_t inode_idx) {
+    NFS_TRACE(kDebug, kInode, "free inode {}", inode_idx);
+    auto dinode_addr = imap_->get(inode_idx);
+    auto inode = get_inode(inode_idx);
+    inode->release();
+    seg_mgr_->discard(dinode_addr, sizeof(DiskInode));
+    imap_->remove(inode_idx);
+    id_mgr_->release(inode_idx);
+  }
+
+  // free now, or on the last release if the inode is still open
+  void free_inode_or_defer(const uint32_t inode_idx) {
+    {
+      auto lock = std::unique_lock(lock_orphans_);
+      if (fd_mgr_->defer_free(inode_idx)) {
+        orphans_.insert(inode_idx);
+        orphans_dirty_ = true;
+        return;
+      }
+    }
+    free_inode(inode_idx);
+  }
 
   void fsync() { flush_cr(); }
 
+  // compress blocks written from now on, the ones already in the log are
+  // read either way
+  void set_compress(const bool compress) { seg_mgr_->set_compress(compress); }
+
+  // share data blocks written from now on with identical ones
+  void set_dedup(const bool dedup) {
+    if (read_only_)
+      return;
+    auto lock = lock_cr_shared();
+    if (dedup)
+      dedup_inode();
+    seg_mgr_->set_dedup(dedup);
+  }
+
+  // pin everything the next checkpoint refers to under name, only the image
+  // of the checkpoint region is copied. It is kept in a file of a hidden
+  // directory, whose entries are the snapshots
+  void create_snapshot(const std::string_view name) {
+    check_writable();
+    if (name.empty() || name.length() > 255 ||
+        name.find('/') != std::string_view::npos)
+      throw InvalidArgument();
+    auto lock = lock_cr_unique();
+    NFS_SPAN("snapshot");
+    if (find_snapshot(name).has_value())
+      throw DuplicateEntry();
+    auto dir_idx = id_mgr_->snapshots_inode_idx();
+    if (dir_idx == IDManager::root_inode_idx) {
+      auto dir_disk_inode = DiskInode::make_dir();
+      dir_idx = id_mgr_->allocate();
+      imap_->update(dir_idx, seg_mgr_->push(std::make_pair(
+                                 dir_disk_inode.get(), dir_idx)));
+      id_mgr_->set_snapshots_inode_idx(dir_idx);
+    }
+    auto image = flush_cr_locked();
+    seg_mgr_->pin(image.get() + kCRImapSize + kCRIDSize);
+    auto inode_idx = id_mgr_->allocate();
+    auto disk_inode = DiskInode::make_file();
+    imap_->update(inode_idx,
+                  seg_mgr_->push(std::make_pair(disk_inode.get(), inode_idx)));
+    disk_inode = get_inode(inode_idx)->write(image.get(), 0, kCRSize);
+    imap_->update(inode_idx,
+                  seg_mgr_->push(std::make_pair(disk_inode.get(), inode_idx),
+                                 imap_->get(inode_idx)));
+    auto dir_disk_inode = get_inode(dir_idx)->push(name, inode_idx);
+    imap_->update(dir_idx,
+                  seg_mgr_->push(std::make_pair(dir_disk_inode.get(), dir_idx),
+                                 imap_->get(dir_idx)));
+    flush_cr_locked();
+  }
+
+  // the segments are unpinned once the checkpoint without the snapshot is
+  // whole, a crash before brings the snapshot back intact
+  void delete_snapshot(const std::string_view name) {
+    check_writable();
+    auto lock = lock_cr_unique();
+    NFS_SPAN("snapshot");
+    auto inode_idx = find_snapshot(name);
+    if (!inode_idx.has_value())
+      throw NoEntry();
+    auto image = read_snapshot(inode_idx.value());
+    auto dir_idx = id_mgr_->snapshots_inode_idx();
+    auto dir_disk_inode = get_inode(dir_idx)->erase_entry(name);
+    imap_->update(dir_idx,
+                  seg_mgr_->push(std::make_pair(dir_disk_inode.get(), dir_idx),
+                                 imap_->get(dir_idx)));
+    free_inode(inode_idx.value());
+    flush_cr_locked();
+    seg_mgr_->unpin(image.get() + kCRImapSize + kCRIDSize);
+  }
+
+  std::vector<std::string> list_snapshots() {
+    auto lock = lock_cr_shared();
+    auto dir_idx = id_mgr_->snapshots_inode_idx();
+    if (dir_idx == IDManager::root_inode_idx)
+      return {};
+    return get_inode(dir_idx)->list_entries();
+  }
+
+  // one cleaning pass, return false if there was nothing to clean
+  bool gc() {
+    if (read_only_)
+      return false;
+    auto lock = lock_cr_unique();
+    NFS_TRACE(kDebug, kGC, "checking for gc");
+    NFS_SPAN("gc");
+    auto start = Metrics::now_ns();
+    auto [ds_by_inode_idx, addr_by_inode_idx] =
+        seg_mgr_->select_segments_for_gc();
+    if (ds_by_inode_idx.empty() && addr_by_inode_idx.empty())
+      return false;
+    seg_mgr_->claim_shared(ds_by_inode_idx);
+    NFS_TRACE(kDebug, kGC,
+              "ds_by_inode_idx of size {}, addr_by_inode_idx of size {}",
+              ds_by_inode_idx.size(), addr_by_inode_idx.size());
+    for (const auto &[inode_idx, addr_and_code_list] : ds_by_inode_idx) {
+      if (inode_idx == Imap::kPageOwner) {
+        for (const auto &[addr, code] : addr_and_code_list)
+          imap_->relocate_page(code, addr,
+                               [this](const char *page,
+                                      const uint32_t page_idx,
+                                      const uint32_t old_addr) {
+                                 Metrics::add(
+                                     Metrics::Counter::kGCBytesCopied,
+                                     kBlockSize);
+                                 return push_imap_page(page, page_idx,
+                                                       old_addr);
+                               });
+        continue;
+      }
+      if (inode_idx == DedupTable::kOwner) {
+        for (const auto &[addr, slot] : addr_and_code_list)
+          if (seg_mgr_->relocate_dedup(slot, addr))
+            Metrics::add(Metrics::Counter::kGCBytesCopied, kBlockSize);
+        continue;
+      }
+      // freed since, every block it had is dead
+      if (!imap_->contains(inode_idx))
+        continue;
+      auto inode = get_inode(inode_idx);
+      auto ret = inode->rewrite_if_hit(addr_and_code_list);
+      if (ret != nullptr) {
+        auto addr = seg_mgr_->push(std::make_pair(ret.get(), inode_idx),
+                                   imap_->get(inode_idx));
+        imap_->update(inode_idx, addr);
+      }
+#ifndef NDEBUG
+      inode = get_inode(inode_idx);
+      inode->sanity_check();
+#endif
+    }
+    for (const auto &[inode_idx, inode_addr] : addr_by_inode_idx) {
+      if (!imap_->contains(inode_idx) || inode_addr != imap_->get(inode_idx))
+        continue;
+      NFS_TRACE(kVerbose, kGC, "update inode({}, inode_addr = {})",
+                inode_idx, inode_addr);
+      auto inode = get_diskinode(inode_idx);
+      auto addr =
+          seg_mgr_->push(std::make_pair(inode.get(), inode_idx), inode_addr);
+      imap_->update(inode_idx, addr);
+      Metrics::add(Metrics::Counter::kGCBytesCopied, sizeof(DiskInode));
+    }
+    Metrics::observe(Metrics::Timer::kGC, Metrics::now_ns() - start);
+    return true;
+  }
+
+  // metrics followed by the state of the log
+  std::string stats() {
+    auto ret = Metrics::report();
+    char line[256];
+    auto user_written = Metrics::get(Metrics::Counter::kUserBytesWritten);
+    auto disk_written = Metrics::get(Metrics::Counter::kDiskBytesWritten);
+    auto amplification =
+        user_written == 0 ? 0.0
+                          : static_cast<double>(disk_written) / user_written;
+    snprintf(line, sizeof(line),
+             "gauge write_amplification %.2f\n"
+             "gauge free_segments %u\n"
+             "gauge total_segments %u\n"
+             "gauge inodes %u\n"
+             "gauge checkpoints %llu\n"
+             "gauge dedup_blocks %u\n",
+             amplification, seg_mgr_->free_segments(), kMaxSegments,
+             imap_->count(),
+             static_cast<unsigned long long>(cr_epoch_.load()),
+             seg_mgr_->dedup_count());
+    ret += line;
+    auto utilization = seg_mgr_->utilization();
+    for (uint32_t i = 0; i < utilization.size(); i++) {
+      snprintf(line, sizeof(line), "segment_utilization %u-%u%% %u\n", i * 10,
+               i * 10 + 10, utilization[i]);
+      ret += line;
+    }
+    ret += LockStats::report();
+    ret += disk_->report();
+    return ret;
+  }
+
+  // skip the checkpoint if the inode has not changed since the last one
+  void fsync(const uint64_t fd) {
+    auto &open_inode = *fd_mgr_->get(fd).inode;
+    if (open_inode.dirty_epoch.load() < cr_epoch_.load())
+      return;
+    flush_cr();
+    // whatever an earlier open changed is in the checkpoint now, unless a
+    // write raced in and set an epoch of its own
+    auto unknown = OpenInode::kUnknownEpoch;
+    open_inode.dirty_epoch.compare_exchange_strong(unknown, 0);
+  }
+
+  void flush(const uint64_t fd) {
+    auto &handle = fd_mgr_->get(fd);
+    bool need_sync;
+    {
+      auto handle_lock = std::unique_lock(handle.lock);
+      need_sync = handle.dirty && (handle.flags & (O_SYNC | O_DSYNC));
+      handle.dirty = false;
+      handle.ra_buf.reset();
+      handle.ra_size = 0;
+    }
+    if (need_sync)
+      fsync(fd);
+  }
+
+  void release(const uint64_t fd) {
+    auto lock = lock_cr_shared();
+    std::optional<uint32_t> orphan;
+    {
+      auto orphans_lock = std::unique_lock(lock_orphans_);
+      orphan = fd_mgr_->release(fd);
+      if (orphan.has_value()) {
+        orphans_.erase(orphan.value());
+        orphans_dirty_ = true;
+      }
+    }
+    if (orphan.has_value())
+      free_inode(orphan.value());
+  }
+
   void rename_at_same_dir(const uint32_t parent_inode_idx,
-                          const std::string &old_name,
-                          const std::string &new_name, const uint32_t flags) {
+                          const std::string_view old_name,
+                          const std::string_view new_name,
+                          const uint32_t flags) {
     auto parent_dinode_addr = imap_->get(parent_inode_idx);
     auto parent_inode = get_inode(parent_inode_idx);
     auto found = parent_inode->find_entry(old_name);
@@ -156,16 +638,19 @@ public:
     parent_inode = std::make_unique<Inode>(std::move(parent_disk_inode),
                                            seg_mgr_.get(), parent_inode_idx);
     found = parent_inode->find_entry(new_name);
+    std::optional<uint32_t> replaced = std::nullopt;
     if (found != std::nullopt) {
       auto new_inode_idx = found.value();
       parent_disk_inode = parent_inode->erase_entry(new_name);
       parent_inode = std::make_unique<Inode>(std::move(parent_disk_inode),
                                              seg_mgr_.get(), parent_inode_idx);
       if (flags & RENAME_EXCHANGE) {
-        debug("rename with RENAME_EXCHANGE");
+        NFS_TRACE(kDebug, kFS, "rename with RENAME_EXCHANGE");
         parent_disk_inode = parent_inode->push(old_name, new_inode_idx);
         parent_inode = std::make_unique<Inode>(
             std::move(parent_disk_inode), seg_mgr_.get(), parent_inode_idx);
+      } else {
+        replaced = new_inode_idx;
       }
     }
     parent_disk_inode = parent_inode->push(new_name, old_inode_idx);
@@ -173,17 +658,17 @@ public:
         std::make_pair(parent_disk_inode.get(), parent_inode_idx),
         parent_dinode_addr);
     imap_->update(parent_inode_idx, parent_dinode_addr);
+    if (replaced.has_value())
+      free_inode_or_defer(replaced.value());
   }
 
   void rename(const char *old_path, const char *new_path,
               const uint32_t flags) {
-    auto lock = std::shared_lock(lock_flushing_cr_);
+    check_writable();
+    auto lock = lock_cr_shared();
 
-    auto old_path_components = parse_path_components(old_path);
-    auto old_name = old_path_components.back();
-    old_path_components.pop_back();
-    auto old_parent_inode_idx =
-        get_inode_idx(join_path_components(old_path_components).c_str());
+    auto [old_parent_path, old_name] = split_parent(old_path);
+    auto old_parent_inode_idx = get_inode_idx(old_parent_path);
     auto old_parent_dinode_addr = imap_->get(old_parent_inode_idx);
     auto old_parent_inode = get_inode(old_parent_inode_idx);
     auto found = old_parent_inode->find_entry(old_name);
@@ -191,11 +676,8 @@ public:
       throw NoEntry();
     auto old_inode_idx = found.value();
 
-    auto new_path_components = parse_path_components(new_path);
-    auto new_name = new_path_components.back();
-    new_path_components.pop_back();
-    auto new_parent_inode_idx =
-        get_inode_idx(join_path_components(new_path_components).c_str());
+    auto [new_parent_path, new_name] = split_parent(new_path);
+    auto new_parent_inode_idx = get_inode_idx(new_parent_path);
     if (old_parent_inode_idx == new_parent_inode_idx) {
       rename_at_same_dir(old_parent_inode_idx, old_name, new_name, flags);
       return;
@@ -203,6 +685,7 @@ public:
     auto new_parent_dinode_addr = imap_->get(new_parent_inode_idx);
     auto new_parent_inode = get_inode(new_parent_inode_idx);
     found = new_parent_inode->find_entry(new_name);
+    std::optional<uint32_t> replaced = std::nullopt;
     if (found == std::nullopt) {
       if (flags & RENAME_EXCHANGE)
         throw NoEntry();
@@ -218,6 +701,8 @@ public:
         old_parent_inode =
             std::make_unique<Inode>(std::move(old_parent_disk_inode),
                                     seg_mgr_.get(), old_parent_inode_idx);
+      } else {
+        replaced = new_inode_idx;
       }
     }
     auto new_parent_disk_inode =
@@ -231,15 +716,15 @@ public:
         std::make_pair(old_parent_disk_inode.get(), old_parent_inode_idx),
         old_parent_dinode_addr);
     imap_->update(old_parent_inode_idx, old_parent_dinode_addr);
+    if (replaced.has_value())
+      free_inode_or_defer(replaced.value());
   }
 
   void mkdir(const char *path, const uint32_t) {
-    auto lock = std::shared_lock(lock_flushing_cr_);
-    auto path_components = parse_path_components(path);
-    auto name = path_components.back();
-    path_components.pop_back();
-    auto parent_inode_idx =
-        get_inode_idx(join_path_components(path_components).c_str());
+    check_writable();
+    auto lock = lock_cr_shared();
+    auto [parent_path, name] = split_parent(path);
+    auto parent_inode_idx = get_inode_idx(parent_path);
     auto parent_dinode_addr = imap_->get(parent_inode_idx);
     auto parent_inode = get_inode(parent_inode_idx);
     if (parent_inode->find_entry(name) != std::nullopt) {
@@ -257,34 +742,32 @@ public:
     imap_->update(parent_inode_idx, parent_dinode_addr);
   }
 
-  void truncate(const uint32_t inode_idx, const uint32_t size) {
-    auto dinode_addr = imap_->get(inode_idx);
-    auto inode = get_inode(inode_idx);
-    auto dinode = inode->truncate(size);
-    auto addr =
-        seg_mgr_->push(std::make_pair(dinode.get(), inode_idx), dinode_addr);
-    imap_->update(inode_idx, addr);
+  void truncate(const uint32_t inode_idx, const uint64_t size) {
+    if (size > UINT32_MAX)
+      throw FileTooBig();
+    check_writable();
+    auto lock = lock_cr_shared();
+    truncate_locked(inode_idx, size);
   }
 
-  uint32_t open(const char *path, const int flags) {
-    auto lock = std::shared_lock(lock_flushing_cr_);
-    auto path_components = parse_path_components(path);
-    assert(path_components.size() >= 1);
-    auto name = path_components.back();
-    path_components.pop_back();
-    auto parent_path = join_path_components(path_components);
-    auto parent_inode_idx = get_inode_idx(parent_path.c_str());
+  uint64_t open(const char *path, const int flags) {
+    if ((flags & O_ACCMODE) != O_RDONLY || (flags & O_TRUNC))
+      check_writable();
+    auto lock = lock_cr_shared();
+    auto [parent_path, name] = split_parent(path);
+    auto parent_inode_idx = get_inode_idx(parent_path);
     auto parent_dinode_addr = imap_->get(parent_inode_idx);
     auto parent_inode = get_inode(parent_inode_idx);
     auto maybe_this_inode_idx = parent_inode->find_entry(name);
     if (maybe_this_inode_idx.has_value()) {
       auto this_inode_idx = maybe_this_inode_idx.value();
-      auto fd = fd_mgr_->allocate(this_inode_idx);
+      auto fd = fd_mgr_->allocate(this_inode_idx, flags);
       if (flags & O_TRUNC) {
-        truncate(this_inode_idx, 0);
+        truncate_locked(this_inode_idx, 0);
       }
       return fd;
     }
+    check_writable();
     auto this_disk_inode = DiskInode::make_file();
     auto this_inode_idx = id_mgr_->allocate();
     auto this_dinode_addr =
@@ -295,94 +778,285 @@ public:
         std::make_pair(nv_parent_disk_inode.get(), parent_inode_idx),
         parent_dinode_addr);
     imap_->update(parent_inode_idx, nv_parent_dinode_addr);
-    auto fd = fd_mgr_->allocate(this_inode_idx);
+    auto fd = fd_mgr_->allocate(this_inode_idx, flags);
+    fd_mgr_->get(fd).inode->dirty_epoch = cr_epoch_.load();
     return fd;
   }
 
   std::vector<std::string> readdir(const char *path) {
-    auto lock = std::shared_lock(lock_flushing_cr_);
+    auto lock = lock_cr_shared();
     auto inode_idx = get_inode_idx(path);
     auto inode = get_inode(inode_idx);
     auto names = inode->list_entries();
     return names;
   }
 
+  // f(name, inode_idx, next_offset) for the entries from the byte offset
+  // on, until it returns false
+  template <typename F>
+  void readdir(const char *path, const uint32_t offset, F f) {
+    auto lock = lock_cr_shared();
+    get_inode(get_inode_idx(path))->list_entries_from(offset, f);
+  }
+
   void unlink(const char *path) {
-    // todo: support real unlink after link implemented
-    auto lock = std::shared_lock(lock_flushing_cr_);
-    auto path_components = parse_path_components(path);
-    assert(path_components.size() >= 1);
-    auto name = path_components.back();
-    path_components.pop_back();
-    auto parent_path = join_path_components(path_components);
-    auto parent_inode_idx = get_inode_idx(parent_path.c_str());
-    debug("unlink parent_inode_idx = " + std::to_string(parent_inode_idx));
+    check_writable();
+    auto lock = lock_cr_shared();
+    auto [parent_path, name] = split_parent(path);
+    auto parent_inode_idx = get_inode_idx(parent_path);
+    NFS_TRACE(kDebug, kFS, "unlink parent_inode_idx = {}", parent_inode_idx);
+    auto parent_dinode_addr = imap_->get(parent_inode_idx);
     auto parent_inode = get_inode(parent_inode_idx);
-    auto nv_parent_disk_inode = parent_inode->erase_entry(name);
-    if (nv_parent_disk_inode == nullptr) {
+    auto found = parent_inode->find_entry(name);
+    if (found == std::nullopt) {
       throw NoEntry();
     }
+    auto this_inode_idx = found.value();
+    auto this_inode = get_inode(this_inode_idx);
+    if (this_inode->is_dir() && !this_inode->empty()) {
+      throw NotEmpty();
+    }
+    auto nv_parent_disk_inode = parent_inode->erase_entry(name);
     auto nv_parent_dinode_addr = seg_mgr_->push(
-        std::make_pair(nv_parent_disk_inode.get(), parent_inode_idx));
+        std::make_pair(nv_parent_disk_inode.get(), parent_inode_idx),
+        parent_dinode_addr);
     imap_->update(parent_inode_idx, nv_parent_dinode_addr);
+    free_inode_or_defer(this_inode_idx);
   }
 
-  uint32_t read(const uint32_t fd, char *buf, uint32_t offset, uint32_t size) {
-    auto lock = std::shared_lock(lock_flushing_cr_);
-    debug("read " + std::to_string(size));
-    auto inode_idx = fd_mgr_->get(fd);
-    auto inode = get_inode(inode_idx);
-    return inode->read(buf, offset, size);
+  uint32_t read(const uint64_t fd, char *buf, uint32_t offset, uint32_t size) {
+    auto lock = lock_cr_shared();
+    NFS_TRACE(kDebug, kFS, "read size {} offset {}", size, offset);
+    auto &handle = fd_mgr_->get(fd);
+    auto handle_lock = std::unique_lock(handle.lock);
+    auto ret = read_ahead(handle, buf, offset, size);
+    handle.next_offset = offset + ret;
+    Metrics::add(Metrics::Counter::kUserBytesRead, ret);
+    return ret;
   }
 
-  void write(const uint32_t fd, char *buf, uint32_t offset, uint32_t size) {
-    auto lock = std::shared_lock(lock_flushing_cr_);
-    debug("FILE write size " + std::to_string(size) + " offset " +
-          std::to_string(offset));
-    auto inode_idx = fd_mgr_->get(fd);
+  void write(const uint64_t fd, char *buf, uint64_t offset,
+             const uint32_t size) {
+    if (offset > UINT32_MAX || offset + size > UINT32_MAX)
+      throw FileTooBig();
+    check_writable();
+    auto lock = lock_cr_shared();
+    NFS_TRACE(kDebug, kFS, "write size {} offset {}", size, offset);
+    auto &handle = fd_mgr_->get(fd);
+    auto &open_inode = *handle.inode;
+    auto inode_idx = open_inode.inode_idx;
+    {
+      auto inode_lock = std::unique_lock(open_inode.lock);
+      auto dinode_addr = imap_->get(inode_idx);
+      auto inode = get_inode(inode_idx);
+      if (handle.flags & O_APPEND)
+        offset = inode->size();
+      if (offset + size > UINT32_MAX)
+        throw FileTooBig();
+      auto disk_inode = inode->write(buf, offset, size);
+      auto new_addr = seg_mgr_->push(
+          std::make_pair(disk_inode.get(), inode_idx), dinode_addr);
+      imap_->update(inode_idx, new_addr);
+      open_inode.version += 1;
+      open_inode.dirty_epoch = cr_epoch_.load();
+    }
+    auto handle_lock = std::unique_lock(handle.lock);
+    handle.dirty = true;
+    Metrics::add(Metrics::Counter::kUserBytesWritten, size);
+  }
+
+  // mode takes FALLOC_FL_KEEP_SIZE, FALLOC_FL_PUNCH_HOLE (with KEEP_SIZE) and
+  // FALLOC_FL_ZERO_RANGE, a zeroed range is punched out as well
+  void fallocate(const uint64_t fd, const int mode, const uint64_t offset,
+                 const uint64_t size) {
+    constexpr int supported =
+        FALLOC_FL_KEEP_SIZE | FALLOC_FL_PUNCH_HOLE | FALLOC_FL_ZERO_RANGE;
+    if (mode & ~supported)
+      throw NotSupported();
+    auto punch = (mode & (FALLOC_FL_PUNCH_HOLE | FALLOC_FL_ZERO_RANGE)) != 0;
+    if ((mode & FALLOC_FL_PUNCH_HOLE) &&
+        (mode & FALLOC_FL_ZERO_RANGE || !(mode & FALLOC_FL_KEEP_SIZE)))
+      throw InvalidArgument();
+    if (size == 0)
+      throw InvalidArgument();
+    if (offset + size > UINT32_MAX)
+      throw FileTooBig();
+    check_writable();
+    auto lock = lock_cr_shared();
+    NFS_TRACE(kDebug, kFS, "fallocate mode {} offset {} size {}", mode, offset,
+              size);
+    auto &handle = fd_mgr_->get(fd);
+    auto &open_inode = *handle.inode;
+    auto inode_idx = open_inode.inode_idx;
+    auto inode_lock = std::unique_lock(open_inode.lock);
     auto dinode_addr = imap_->get(inode_idx);
     auto inode = get_inode(inode_idx);
-    auto disk_inode = inode->write(buf, offset, size);
+    auto disk_inode = inode->fallocate(offset, size, punch,
+                                       (mode & FALLOC_FL_KEEP_SIZE) != 0);
     auto new_addr = seg_mgr_->push(std::make_pair(disk_inode.get(), inode_idx),
                                    dinode_addr);
     imap_->update(inode_idx, new_addr);
+    open_inode.version += 1;
+    open_inode.dirty_epoch = cr_epoch_.load();
+  }
+
+  // whole blocks at block aligned offsets of two files are shared through
+  // the dedup table, the rest is copied. Return the bytes copied, fewer past
+  // the end of the source
+  uint64_t copy_file_range(const uint64_t fd_in, const uint64_t offset_in,
+                           const uint64_t fd_out, const uint64_t offset_out,
+                           uint64_t size) {
+    check_writable();
+    auto lock = lock_cr_shared();
+    NFS_TRACE(kDebug, kFS, "copy_file_range offset {} -> {} size {}",
+              offset_in, offset_out, size);
+    auto &in = *fd_mgr_->get(fd_in).inode;
+    auto &out = *fd_mgr_->get(fd_out).inode;
+    auto in_lock = std::unique_lock(in.lock, std::defer_lock);
+    auto out_lock = std::unique_lock(out.lock, std::defer_lock);
+    if (&in == &out)
+      out_lock.lock();
+    else
+      std::lock(in_lock, out_lock);
+    auto in_size = get_inode(in.inode_idx)->size();
+    if (offset_in >= in_size)
+      return 0;
+    size = std::min<uint64_t>(size, in_size - offset_in);
+    // the chunks below would read what earlier ones wrote, Linux refuses too
+    if (&in == &out && offset_in < offset_out + size &&
+        offset_out < offset_in + size)
+      throw InvalidArgument();
+    if (offset_out + size > UINT32_MAX)
+      throw FileTooBig();
+    auto store = [this](const uint32_t inode_idx,
+                        std::unique_ptr<DiskInode> disk_inode) {
+      auto addr = seg_mgr_->push(std::make_pair(disk_inode.get(), inode_idx),
+                                 imap_->get(inode_idx));
+      imap_->update(inode_idx, addr);
+    };
+    uint64_t done = 0;
+    if (&in != &out && offset_in % kBlockSize == 0 &&
+        offset_out % kBlockSize == 0 && size >= kBlockSize) {
+      dedup_inode();
+      done = size / kBlockSize * kBlockSize;
+      std::vector<uint32_t> addrs;
+      store(in.inode_idx,
+            get_inode(in.inode_idx)->share(offset_in, done, addrs));
+      store(out.inode_idx,
+            get_inode(out.inode_idx)->clone(offset_out, addrs));
+      in.version += 1;
+      in.dirty_epoch = cr_epoch_.load();
+      Metrics::add(Metrics::Counter::kBlocksCloned, addrs.size());
+    }
+    if (done < size) {
+      auto buf = Disk::align_alloc(kReadaheadSize);
+      for (; done < size; done += kReadaheadSize) {
+        auto len = std::min<uint64_t>(kReadaheadSize, size - done);
+        get_inode(in.inode_idx)->read(buf.get(), offset_in + done, len);
+        store(out.inode_idx, get_inode(out.inode_idx)
+                                 ->write(buf.get(), offset_out + done, len));
+      }
+    }
+    out.version += 1;
+    out.dirty_epoch = cr_epoch_.load();
+    return size;
+  }
+
+  // SEEK_DATA or SEEK_HOLE, the end of file counts as a hole
+  uint64_t lseek(const uint64_t fd, const uint64_t offset, const int whence) {
+    if (whence != SEEK_DATA && whence != SEEK_HOLE)
+      throw InvalidArgument();
+    auto lock = lock_cr_shared();
+    auto &open_inode = *fd_mgr_->get(fd).inode;
+    auto inode_lock = std::unique_lock(open_inode.lock);
+    auto inode = get_inode(open_inode.inode_idx);
+    if (offset >= inode->size())
+      throw NoData();
+    auto ret = inode->seek(offset, whence == SEEK_DATA);
+    if (whence == SEEK_DATA && ret == inode->size())
+      throw NoData();
+    return ret;
   }
 
   void modify(std::unique_ptr<DiskInode>, const uint32_t) {
     // todo
   }
 
-  uint32_t get_inode_idx(const uint32_t fd) { return fd_mgr_->get(fd); }
+  uint32_t get_inode_idx(const uint64_t fd) {
+    return fd_mgr_->get(fd).inode->inode_idx;
+  }
 
-  uint32_t get_inode_idx(const char *path) {
+  // walk the path in place, no component is copied
+  uint32_t get_inode_idx(const std::string_view path) {
+    NFS_SPAN("resolve path");
     auto inode_idx = id_mgr_->root_inode_idx;
-    auto inode = get_inode(inode_idx);
-    auto path_components = parse_path_components(path);
-    for (const auto &com : path_components) {
+    PathIter iter(path);
+    std::string_view com;
+    while (iter.next(com)) {
+      auto inode = get_inode(inode_idx);
       auto found = inode->find_entry(com);
       if (!found.has_value()) {
         throw NoEntry();
       }
       inode_idx = found.value();
-      debug("get_inode_idx found " + com + " -> " + std::to_string(inode_idx));
-      inode = get_inode(inode_idx);
-      assert(inode != nullptr);
     }
-    debug("get inode index " + std::string(path) + " -> " +
-          std::to_string(inode_idx));
+    NFS_TRACE(kVerbose, kFS, "get inode index {} -> {}", path, inode_idx);
     return inode_idx;
   }
 
   std::unique_ptr<DiskInode> get_diskinode(const uint32_t inode_idx) {
     auto inode_addr = imap_->get(inode_idx);
     auto disk_inode = std::make_unique<DiskInode>();
-    seg_mgr_->read(reinterpret_cast<char *>(disk_inode.get()), inode_addr,
-                   sizeof(DiskInode));
+    seg_mgr_->read_inode(disk_inode.get(), inode_addr);
     assert(disk_inode->link_cnt != 0);
     return disk_inode;
   }
 
 private:
+  void truncate_locked(const uint32_t inode_idx, const uint32_t size) {
+    auto open_inode = fd_mgr_->find(inode_idx);
+    std::unique_lock<std::mutex> inode_lock;
+    if (open_inode != nullptr)
+      inode_lock = std::unique_lock(open_inode->lock);
+    auto dinode_addr = imap_->get(inode_idx);
+    auto inode = get_inode(inode_idx);
+    auto dinode = inode->truncate(size);
+    auto addr =
+        seg_mgr_->push(std::make_pair(dinode.get(), inode_idx), dinode_addr);
+    imap_->update(inode_idx, addr);
+    if (open_inode != nullptr) {
+      open_inode->version += 1;
+      open_inode->dirty_epoch = cr_epoch_.load();
+    }
+  }
+
+  // serve sequential reads from the readahead window of the handle
+  uint32_t read_ahead(FileHandle &handle, char *buf, const uint32_t offset,
+                      const uint32_t size) {
+    auto version = handle.inode->version.load();
+    if (handle.ra_buf != nullptr && handle.ra_version == version &&
+        offset >= handle.ra_offset &&
+        offset < handle.ra_offset + handle.ra_size &&
+        (offset + size <= handle.ra_offset + handle.ra_size ||
+         handle.ra_eof)) {
+      auto ret = std::min(size, handle.ra_offset + handle.ra_size - offset);
+      std::memcpy(buf, handle.ra_buf.get() + (offset - handle.ra_offset), ret);
+      return ret;
+    }
+    auto inode = get_inode(handle.inode->inode_idx);
+    if (offset != handle.next_offset || size >= kReadaheadSize)
+      return inode->read(buf, offset, size);
+    if (handle.ra_buf == nullptr)
+      handle.ra_buf = Disk::align_alloc(kReadaheadSize);
+    handle.ra_size = inode->read(handle.ra_buf.get(), offset, kReadaheadSize);
+    handle.ra_offset = offset;
+    handle.ra_eof = handle.ra_size < kReadaheadSize;
+    handle.ra_version = version;
+    auto ret = std::min(size, handle.ra_size);
+    std::memcpy(buf, handle.ra_buf.get(), ret);
+    return ret;
+  }
+
   std::unique_ptr<Inode> get_inode(const uint32_t inode_idx) {
     auto disk_inode = get_diskinode(inode_idx);
     if (disk_inode == nullptr)
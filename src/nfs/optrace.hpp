@@ -0,0 +1,188 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+
+#include "nfs/metrics.hpp"
+
+/*
+  Binary log of the calls made through naivefs::Volume, for replaying a
+  workload against NaiveFS without a mount. Off unless started with
+  -o optrace=<file>.
+
+  The file is a Header followed by records, each a Record followed by its
+  path and second path, not terminated. Records are in the order the calls
+  returned. Handles are the ones returned to the kernel, a replay maps them
+  through the open which returned them.
+
+  Op is Metrics::Timer, a record stores its value. Adding or reordering a
+  timer changes the format, bump kVersion along with it.
+*/
+
+class OpTrace {
+public:
+  // the entry points are the ones timed by Metrics
+  using Op = Metrics::Timer;
+
+  struct Header {
+    char magic[8];
+    uint32_t version;
+    uint32_t reserved;
+  };
+
+  struct Record {
+    // when the call came in, since the trace started
+    uint64_t ns;
+    uint64_t fh;
+    uint64_t offset;
+    // the source handle and offset of a copy_file_range
+    uint64_t fh2;
+    uint64_t offset2;
+    uint32_t size;
+    int32_t flags;
+    uint32_t dur_ns;
+    uint16_t op;
+    uint16_t path_len;
+    uint16_t path2_len;
+    uint16_t reserved;
+  };
+
+  static constexpr char kMagic[8] = {'N', 'F', 'S', 'O', 'P', 'T', 'R', 'C'};
+  static constexpr uint32_t kVersion = 2;
+
+  class Writer {
+    FILE *file_;
+    std::mutex lock_;
+    const uint64_t start_ns_;
+
+  public:
+    explicit Writer(FILE *file) : file_(file), start_ns_(Metrics::now_ns()) {
+      setvbuf(file_, nullptr, _IOFBF, 1 << 20);
+      Header header{};
+      std::memcpy(header.magic, kMagic, sizeof(kMagic));
+      header.version = kVersion;
+      fwrite(&header, sizeof(header), 1, file_);
+    }
+
+    ~Writer() { fclose(file_); }
+
+    uint64_t start_ns() const { return start_ns_; }
+
+    void write(Record rec, const std::string_view path,
+               const std::string_view path2) {
+      rec.path_len = path.length();
+      rec.path2_len = path2.length();
+      auto lock = std::unique_lock(lock_);
+      fwrite(&rec, sizeof(rec), 1, file_);
+      fwrite(path.data(), 1, path.length(), file_);
+      fwrite(path2.data(), 1, path2.length(), file_);
+    }
+  };
+
+  struct Entry {
+    Record rec;
+    std::string path;
+    std::string path2;
+
+    Op op() const { return static_cast<Op>(rec.op); }
+  };
+
+  class Reader {
+    FILE *file_;
+
+  public:
+    explicit Reader(FILE *file) : file_(file) {}
+    ~Reader() { fclose(file_); }
+
+    bool valid() {
+      Header header;
+      return fread(&header, sizeof(header), 1, file_) == 1 &&
+             std::memcmp(header.magic, kMagic, sizeof(kMagic)) == 0 &&
+             header.version == kVersion;
+    }
+
+    bool next(Entry &entry) {
+      if (fread(&entry.rec, sizeof(Record), 1, file_) != 1)
+        return false;
+      entry.path.resize(entry.rec.path_len);
+      entry.path2.resize(entry.rec.path2_len);
+      return fread(entry.path.data(), 1, entry.rec.path_len, file_) ==
+                 entry.rec.path_len &&
+             fread(entry.path2.data(), 1, entry.rec.path2_len, file_) ==
+                 entry.rec.path2_len;
+    }
+  };
+
+private:
+  static std::atomic<Writer *> &writer() {
+    static std::atomic<Writer *> writer{nullptr};
+    return writer;
+  }
+
+public:
+  // false if the file cannot be created or a trace is already recording
+  static bool start(const char *path) {
+    if (writer().load() != nullptr)
+      return false;
+    auto file = fopen(path, "wb");
+    if (file == nullptr)
+      return false;
+    auto fresh = new Writer(file);
+    Writer *expected = nullptr;
+    if (!writer().compare_exchange_strong(expected, fresh)) {
+      delete fresh;
+      return false;
+    }
+    return true;
+  }
+
+  // only once no call is in flight, at unmount
+  static void stop() { delete writer().exchange(nullptr); }
+
+  // records the call when the scope ends, so the handle of an open is known
+  class Scope {
+    Writer *writer_;
+    Record rec_;
+    const char *path_;
+    const char *path2_;
+
+  public:
+    Scope(const Op op, const char *path, const uint64_t fh = 0,
+          const uint64_t offset = 0, const uint32_t size = 0,
+          const int32_t flags = 0, const char *path2 = nullptr)
+        : writer_(writer().load()), path_(path),
+          path2_(path2) {
+      if (writer_ == nullptr)
+        return;
+      auto now = Metrics::now_ns();
+      rec_ = Record{now - writer_->start_ns(), fh, offset, 0, 0, size, flags,
+                    0, static_cast<uint16_t>(op), 0, 0, 0};
+    }
+
+    ~Scope() {
+      if (writer_ == nullptr)
+        return;
+      auto dur_ns = Metrics::now_ns() - writer_->start_ns() - rec_.ns;
+      rec_.dur_ns = std::min<uint64_t>(dur_ns, UINT32_MAX);
+      writer_->write(rec_, path_ == nullptr ? "" : path_,
+                     path2_ == nullptr ? "" : path2_);
+    }
+
+    Scope(const Scope &) = delete;
+    Scope &operator=(const Scope &) = delete;
+
+    void set_fh(const uint64_t fh) { rec_.fh = fh; }
+
+    void set_source(const uint64_t fh, const uint64_t offset) {
+      rec_.fh2 = fh;
+      rec_.offset2 = offset;
+    }
+  };
+};
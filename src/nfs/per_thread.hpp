@@ -0,0 +1,119 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+/*
+  PerThread<T> gives every thread a T of its own, for state written by its
+  owner only and read by anyone through for_each. A thread which exits hands
+  its T back, untouched, to the next thread which needs one. There are never
+  more Ts than threads once ran at the same time, however many a pool of
+  workers starts and retires over a mount, and whatever a T accumulated is
+  still there for the readers.
+
+    PerThread<Shard>::local().hits += 1;
+    PerThread<Shard>::for_each([](Shard &shard, uint32_t id) { ... });
+
+  The id names the T, threads which never ran at the same time may share one.
+
+  SeqRing<T, kSize> keeps the last kSize entries its owner pushed. Readers copy
+  an entry and drop it if the owner overwrote it meanwhile, so neither side
+  ever waits.
+*/
+
+template <typename T> class PerThread {
+  std::mutex lock_;
+  std::vector<std::unique_ptr<T>> values_;
+  std::vector<uint32_t> retired_;
+
+  struct Owner {
+    T *value = nullptr;
+    uint32_t id;
+
+    ~Owner() {
+      if (value == nullptr)
+        return;
+      auto &self = instance();
+      auto lock = std::unique_lock(self.lock_);
+      self.retired_.push_back(id);
+    }
+  };
+
+  // never destroyed, threads may still exit after static destructors ran
+  static PerThread &instance() {
+    static auto instance = new PerThread;
+    return *instance;
+  }
+
+  static Owner &owner() {
+    thread_local Owner owner;
+    if (owner.value == nullptr) {
+      auto &self = instance();
+      auto lock = std::unique_lock(self.lock_);
+      if (self.retired_.empty()) {
+        owner.id = self.values_.size();
+        self.values_.push_back(std::make_unique<T>());
+      } else {
+        owner.id = self.retired_.back();
+        self.retired_.pop_back();
+      }
+      owner.value = self.values_[owner.id].get();
+    }
+    return owner;
+  }
+
+public:
+  static T &local() { return *owner().value; }
+
+  // f(value, id) for every T, live or retired, in the order of their ids
+  template <typename F> static void for_each(F &&f) {
+    auto &self = instance();
+    auto lock = std::unique_lock(self.lock_);
+    for (uint32_t i = 0; i < self.values_.size(); i++)
+      f(*self.values_[i], i);
+  }
+};
+
+template <typename T, uint32_t kSize> class SeqRing {
+  struct Slot {
+    // odd while the owner is writing the entry
+    std::atomic<uint32_t> seq{0};
+    T entry;
+  };
+
+  Slot slots_[kSize];
+  std::atomic<uint64_t> head_{0};
+
+public:
+  // fill(entry) writes the next entry in place, owner only
+  template <typename F> void push(F &&fill) {
+    auto head = head_.load(std::memory_order_relaxed);
+    auto &slot = slots_[head % kSize];
+    auto seq = slot.seq.load(std::memory_order_relaxed);
+    slot.seq.store(seq + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    fill(slot.entry);
+    slot.seq.store(seq + 2, std::memory_order_release);
+    head_.store(head + 1, std::memory_order_release);
+  }
+
+  // f(copy) for the entries still retained, oldest first
+  template <typename F> void for_each(F &&f) const {
+    auto head = head_.load(std::memory_order_acquire);
+    auto begin = head > kSize ? head - kSize : 0;
+    for (auto i = begin; i < head; i++) {
+      auto &slot = slots_[i % kSize];
+      auto seq = slot.seq.load(std::memory_order_acquire);
+      if (seq % 2 == 1)
+        continue;
+      T copy = slot.entry;
+      std::atomic_thread_fence(std::memory_order_acquire);
+      if (slot.seq.load(std::memory_order_relaxed) != seq)
+        continue;
+      f(copy);
+    }
+  }
+};
@@ -0,0 +1,152 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cassert>
+#include <cstdlib>
+#include <memory>
+#include <new>
+#include <vector>
+
+#include "nfs/config.hpp"
+
+/*
+  Thread-local free lists for the buffers of the hot paths, so steady-state
+  reads and writes do not touch the heap.
+
+  Aligned buffers are 512-byte aligned for O_DIRECT and rounded up to a power
+  of two between kBlockSize and kSegmentSize. A buffer freed by another thread
+  simply joins that thread's free list.
+*/
+
+class BufferPool {
+  static constexpr uint32_t kNumClasses = 8;
+  static_assert((kBlockSize << (kNumClasses - 1)) == kSegmentSize);
+
+  struct FreeLists {
+    std::array<std::vector<char *>, kNumClasses> lists;
+
+    ~FreeLists() {
+      for (auto &list : lists)
+        for (auto buf : list)
+          free(buf);
+    }
+  };
+
+  // nullptr once the free lists of this thread are destroyed
+  static FreeLists *local() {
+    thread_local bool destroyed = false;
+    struct Holder {
+      FreeLists free_lists;
+      ~Holder() { destroyed = true; }
+    };
+    if (destroyed)
+      return nullptr;
+    thread_local Holder holder;
+    return &holder.free_lists;
+  }
+
+  static uint32_t class_size(const uint32_t size_class) {
+    return kBlockSize << size_class;
+  }
+
+  static uint32_t class_capacity(const uint32_t size_class) {
+    return std::max(2u, kPoolBytesPerClass / class_size(size_class));
+  }
+
+public:
+  // kNumClasses stands for buffers too large to be pooled
+  struct Deleter {
+    uint32_t size_class;
+
+    void operator()(char *buf) const {
+      BufferPool::deallocate(buf, size_class);
+    }
+  };
+
+  static std::unique_ptr<char[], Deleter> allocate(const uint32_t size) {
+    uint32_t size_class = 0;
+    while (size_class < kNumClasses && class_size(size_class) < size)
+      size_class += 1;
+    auto free_lists = local();
+    if (size_class < kNumClasses && free_lists != nullptr &&
+        !free_lists->lists[size_class].empty()) {
+      auto &list = free_lists->lists[size_class];
+      auto buf = list.back();
+      list.pop_back();
+      return {buf, Deleter{size_class}};
+    }
+    auto alloc_size = size_class < kNumClasses ? class_size(size_class) : size;
+    char *buf;
+    if (posix_memalign(reinterpret_cast<void **>(&buf), 512, alloc_size) != 0)
+      throw std::bad_alloc();
+    return {buf, Deleter{size_class}};
+  }
+
+  static void deallocate(char *buf, const uint32_t size_class) {
+    auto free_lists = local();
+    if (size_class < kNumClasses && free_lists != nullptr) {
+      auto &list = free_lists->lists[size_class];
+      if (list.size() < class_capacity(size_class)) {
+        if (list.capacity() == 0)
+          list.reserve(class_capacity(size_class));
+        list.push_back(buf);
+        return;
+      }
+    }
+    free(buf);
+  }
+};
+
+using AlignedBuffer = std::unique_ptr<char[], BufferPool::Deleter>;
+
+/*
+  Inherit to allocate objects of T from a thread-local free list, used for
+  the DiskInode and Inode objects created by every operation.
+*/
+
+template <typename T> struct Pooled {
+  static void *operator new(size_t size) {
+    assert(size == sizeof(T));
+    auto free_list = local();
+    if (free_list != nullptr && !free_list->empty()) {
+      auto ptr = free_list->back();
+      free_list->pop_back();
+      return ptr;
+    }
+    return ::operator new(size);
+  }
+
+  static void operator delete(void *ptr) {
+    auto free_list = local();
+    if (free_list != nullptr && free_list->size() < kPoolObjects) {
+      if (free_list->capacity() == 0)
+        free_list->reserve(kPoolObjects);
+      free_list->push_back(ptr);
+      return;
+    }
+    ::operator delete(ptr);
+  }
+
+private:
+  struct FreeList {
+    std::vector<void *> objects;
+
+    ~FreeList() {
+      for (auto ptr : objects)
+        ::operator delete(ptr);
+    }
+  };
+
+  static std::vector<void *> *local() {
+    thread_local bool destroyed = false;
+    struct Holder {
+      FreeList free_list;
+      ~Holder() { destroyed = true; }
+    };
+    if (destroyed)
+      return nullptr;
+    thread_local Holder holder;
+    return &holder.free_list.objects;
+  }
+};
@@ -1,5 +1,6 @@
 #pragma once
 
+#include <algorithm>
 #include <atomic>
 #include <cassert>
 #include <cstring>
@@ -13,9 +14,15 @@
 #include <vector>
 
 #include "nfs/config.hpp"
+#include "nfs/dedup.hpp"
 #include "nfs/disk.hpp"
 #include "nfs/disk_inode.hpp"
 #include "nfs/imap.hpp"
+#include "nfs/lock.hpp"
+#include "nfs/lz.hpp"
+#include "nfs/metrics.hpp"
+#include "nfs/span.hpp"
+#include "nfs/trace.hpp"
 #include "nfs/utils.hpp"
 
 /*
@@ -42,25 +49,87 @@ struct SegmentSummary {
   }
 };
 
+/*
+  A block compressed with LZ, stored as [len: uint16_t, data: char[len]]
+  padded to whole kCompressUnit. Its address is aligned to kCompressUnit and
+  carries the number of units in the low bits, everything else in the log
+  sits at a multiple of sizeof(DiskInode) so the two never collide.
+*/
+
+struct CompressedBlock {
+  // only worth it if at least one unit is saved
+  static constexpr uint32_t kMaxUnits = kBlockSize / kCompressUnit - 1;
+  static_assert(kCompressUnit % sizeof(DiskInode) == 0);
+  static_assert(kMaxUnits < sizeof(DiskInode));
+
+  uint32_t units;
+  char record[kBlockSize];
+
+  static bool is_compressed(const uint32_t addr) {
+    return addr != DiskInode::TEMPORARY_ADDR && addr % sizeof(DiskInode) != 0;
+  }
+
+  static uint32_t units_of(const uint32_t addr) { return addr % kCompressUnit; }
+
+  static uint32_t base_of(const uint32_t addr) {
+    return addr - units_of(addr);
+  }
+
+  // bytes taken in the log by what is at addr, given its uncompressed size
+  static uint32_t stored_size(const uint32_t addr, const uint32_t size) {
+    return is_compressed(addr) ? units_of(addr) * kCompressUnit : size;
+  }
+
+  // false if the block does not compress well enough
+  bool pack(const char *block) {
+    auto len = LZ::compress(block, kBlockSize, record + 2,
+                            kMaxUnits * kCompressUnit - 2);
+    if (len == 0)
+      return false;
+    auto len16 = static_cast<uint16_t>(len);
+    std::memcpy(record, &len16, 2);
+    units = (len + 2 + kCompressUnit - 1) / kCompressUnit;
+    return true;
+  }
+
+  static bool unpack(const char *record, const uint32_t units, char *block) {
+    uint16_t len;
+    std::memcpy(&len, record, 2);
+    return len + 2u <= units * kCompressUnit &&
+           LZ::decompress(record + 2, len, block, kBlockSize);
+  }
+};
+
 class SegmentBuilder {
-  char *buf_;
+  AlignedBuffer buf_;
   SegmentSummary *summary_;
   uint32_t offset_;
   uint32_t cursor_;
   uint32_t occupied_bytes_;
   uint32_t block_cnt_;
+  // free part [inode_slot_, inode_end_) of the inode block being filled
+  uint32_t inode_slot_;
+  uint32_t inode_end_;
   Disk *disk_;
   std::vector<std::pair<uint32_t /* inode_idx */, uint32_t /* addr */>> imap_;
 
+  void add_entry(const uint32_t addr, const uint32_t inode_idx,
+                 const uint32_t code) {
+    summary_->entries[block_cnt_][0] = addr;
+    summary_->entries[block_cnt_][1] = inode_idx;
+    summary_->entries[block_cnt_][2] = code;
+    block_cnt_ += 1;
+  }
+
 public:
   SegmentBuilder(Disk *disk)
       : offset_(kSummarySize), cursor_(kCRSize), disk_(disk) {
     buf_ = disk->align_alloc(kSegmentSize);
-    summary_ = reinterpret_cast<SegmentSummary *>(buf_);
+    summary_ = reinterpret_cast<SegmentSummary *>(buf_.get());
     block_cnt_ = 0;
+    inode_slot_ = inode_end_ = 0;
     imap_.clear();
   }
-  ~SegmentBuilder() { free(buf_); }
 
   uint32_t imap_size() const { return imap_.size() * 8; }
   uint32_t get_cursor() const { return cursor_; }
@@ -76,30 +145,30 @@ public:
     cursor_ = cursor;
     occupied_bytes_ = 0;
     block_cnt_ = 0;
+    inode_slot_ = inode_end_ = 0;
   }
 
-  void read(char *buf, const uint32_t offset, const uint32_t size) {
+  // return false if the range is not in the building segment
+  bool read(char *buf, const uint32_t offset, const uint32_t size) {
     if (offset >= cursor_ && offset < cursor_ + kSegmentSize) {
       assert(offset - cursor_ + size <= kSegmentSize);
-      std::memcpy(buf, buf_ + offset - cursor_, size);
-      return;
+      std::memcpy(buf, buf_.get() + offset - cursor_, size);
+      return true;
     }
-    disk_->read(buf, offset, size);
+    return false;
   }
 
   std::optional<uint32_t>
   push(const std::tuple<char *, uint32_t /* inode_idx */, uint32_t /* code */>
            block) {
-    if (offset_ + kBlockSize + imap_size() > kSegmentSize)
+    if (block_cnt_ == SegmentSummary::MAX_ENTRIES ||
+        offset_ + kBlockSize + imap_size() > kSegmentSize)
       return std::nullopt;
-    std::memcpy(buf_ + offset_, std::get<0>(block), kBlockSize);
+    std::memcpy(buf_.get() + offset_, std::get<0>(block), kBlockSize);
     auto ret = cursor_ + offset_;
     offset_ += kBlockSize;
     occupied_bytes_ += kBlockSize;
-    summary_->entries[block_cnt_][0] = ret;
-    summary_->entries[block_cnt_][1] = std::get<1>(block);
-    summary_->entries[block_cnt_][2] = std::get<2>(block);
-    block_cnt_ += 1;
+    add_entry(ret, std::get<1>(block), std::get<2>(block));
     /*debug("SegmentsManager: push block(inode_idx = " +
           std::to_string(std::get<1>(block)) + ", code = " +
           DiskInode::to_string(std::get<2>(block)) + ") at " +
@@ -107,14 +176,45 @@ public:
     return ret;
   }
 
+  std::optional<uint32_t>
+  push(const std::tuple<const CompressedBlock *, uint32_t /* inode_idx */,
+                        uint32_t /* code */>
+           block) {
+    auto compressed = std::get<0>(block);
+    auto size = compressed->units * kCompressUnit;
+    auto start = (cursor_ + offset_ + kCompressUnit - 1) / kCompressUnit *
+                     kCompressUnit -
+                 cursor_;
+    if (block_cnt_ == SegmentSummary::MAX_ENTRIES ||
+        start + size + imap_size() > kSegmentSize)
+      return std::nullopt;
+    std::memcpy(buf_.get() + start, compressed->record, size);
+    auto ret = cursor_ + start + compressed->units;
+    offset_ = start + size;
+    occupied_bytes_ += size;
+    add_entry(ret, std::get<1>(block), std::get<2>(block));
+    return ret;
+  }
+
+  // inodes written close in time share inode blocks, whole blocks of the
+  // segment, so a directory listed after its children were created or
+  // cleaned together is read one block at a time
   std::optional<uint32_t>
   push(const std::pair<DiskInode *, uint32_t /* inode_idx */> inode) {
     auto inc = sizeof(DiskInode);
-    if (offset_ + inc + imap_size() + 8 > kSegmentSize)
+    if (inode_slot_ == inode_end_) {
+      auto start = (offset_ + kBlockSize - 1) / kBlockSize * kBlockSize;
+      if (start + kBlockSize + imap_size() + 8 > kSegmentSize)
+        return std::nullopt;
+      inode_slot_ = start;
+      inode_end_ = start + kBlockSize;
+      offset_ = inode_end_;
+    } else if (offset_ + imap_size() + 8 > kSegmentSize) {
       return std::nullopt;
-    std::memcpy(buf_ + offset_, std::get<0>(inode), inc);
-    auto ret = cursor_ + offset_;
-    offset_ += inc;
+    }
+    std::memcpy(buf_.get() + inode_slot_, std::get<0>(inode), inc);
+    auto ret = cursor_ + inode_slot_;
+    inode_slot_ += inc;
     occupied_bytes_ += inc;
     imap_.push_back({std::get<1>(inode), ret});
     /*debug("SegmentsManager: push inode(inode_idx = " +
@@ -127,16 +227,18 @@ public:
     return: [buffer, offset, occupied_bytes]
    */
   std::tuple<const char *, uint32_t, uint32_t> build() {
-    auto ptr = buf_ + kSegmentSize;
+    auto ptr = buf_.get() + kSegmentSize;
     uint32_t len = imap_.size();
     summary_->len_imap_ = len;
     summary_->total_bytes_ = occupied_bytes_;
+    if (block_cnt_ < SegmentSummary::MAX_ENTRIES)
+      summary_->entries[block_cnt_][0] = SegmentSummary::INVALID_ENTRY;
     for (uint32_t i = 0; i < len; i++) {
       ptr -= 8;
       std::memcpy(ptr, &imap_[i].first, 4);
       std::memcpy(ptr + 4, &imap_[i].second, 4);
     }
-    return {buf_, cursor_, occupied_bytes_};
+    return {buf_.get(), cursor_, occupied_bytes_};
   }
 };
 
@@ -144,40 +246,122 @@ class SegmentsManager {
   Disk *disk_;
   std::unique_ptr<SegmentBuilder> builder_;
   Imap *imap_;
-  std::shared_mutex lock_seg_status_;
+  // guards builder_, always acquired before lock_seg_status_
+  ProfiledMutex lock_builder_{"lock_builder_"};
+  ProfiledSharedMutex lock_seg_status_{"lock_seg_status_"};
 
 #ifndef NDEBUG
   std::set<uint32_t> discarded;
 #endif
 
+  // a free segment already given back to the host has kDiscardedVersion as
+  // its flushing_version, it is kept across checkpoints so it is not
+  // punched again after a mount
   struct SegmentStatus {
     uint32_t flushing_version;
     uint32_t occupied_bytes;
   } * seg_status_;
+  static constexpr uint32_t kDiscardedVersion = UINT32_MAX;
+  AlignedBuffer seg_status_buf_;
+  // snapshots still referring to each segment, a pinned segment is neither
+  // reused nor cleaned even once nothing live is left in it
+  std::vector<uint16_t> pins_;
   std::atomic<uint32_t> free_segments_;
+  std::atomic<bool> compress_{false};
+
+  // acquired before lock_builder_
+  ProfiledMutex lock_dedup_{"lock_dedup_"};
+  DedupTable dedup_table_;
+  std::atomic<bool> dedup_{false};
+  // the file holding the table is never deduplicated itself
+  std::atomic<uint32_t> dedup_inode_idx_{0};
+
+  // inode blocks read from disk, direct mapped. A block only changes when
+  // its segment is reused, which drops it and bumps reuses_ so that a read
+  // racing with the reuse does not put the old content back
+  struct InodeBlock {
+    uint32_t addr = DiskInode::INVALID_ADDR;
+    char data[kBlockSize];
+  };
+  std::unique_ptr<InodeBlock[]> inode_cache_;
+  ProfiledMutex lock_inode_cache_{"lock_inode_cache_"};
+  std::atomic<uint64_t> reuses_{0};
+
+  ProfiledSharedMutex::ExclusiveGuard
+  lock_seg_status_unique(const char *file = __builtin_FILE(),
+                         const uint32_t line = __builtin_LINE()) {
+    return Spans::timed("wait lock_seg_status_", [&] {
+      return lock_seg_status_.lock(file, line);
+    });
+  }
 
   uint32_t find_next_empty(uint32_t cursor) {
     while (true) {
       if (cursor + kSegmentSize > disk_->end() - kCRSize)
         cursor = kCRSize;
       auto idx = (cursor - kCRSize) / kSegmentSize;
-      if (seg_status_[idx].occupied_bytes == 0) {
+      if (is_free(idx)) {
         return cursor;
       }
       cursor += kSegmentSize;
     }
   }
 
+  bool is_free(const uint32_t idx) const {
+    return seg_status_[idx].occupied_bytes == 0 && pins_[idx] == 0;
+  }
+
   static constexpr uint32_t get_size(const char *) { return kBlockSize; }
 
   static constexpr uint32_t get_size(const DiskInode *) {
     return sizeof(DiskInode);
   }
 
+  static uint32_t get_size(const CompressedBlock *compressed) {
+    return compressed->units * kCompressUnit;
+  }
+
+  void flush_locked() {
+    NFS_SPAN("segment flush");
+    auto [buf, offset, occupied_bytes] = builder_->build();
+    if (occupied_bytes == 0) {
+      return;
+    }
+    auto idx = (offset - kCRSize) / kSegmentSize;
+    {
+      auto lock = lock_seg_status_unique();
+      seg_status_[idx].occupied_bytes = occupied_bytes;
+      seg_status_[idx].flushing_version = imap_->version();
+    }
+    disk_->write(buf, offset, kSegmentSize);
+    auto next_segment_addr = find_next_empty(offset + kSegmentSize);
+#ifndef NDEBUG
+    // addresses in a reused segment are valid again
+    discarded.erase(discarded.lower_bound(next_segment_addr),
+                    discarded.lower_bound(next_segment_addr + kSegmentSize));
+#endif
+    {
+      auto lock = lock_inode_cache_.lock();
+      for (uint32_t i = 0; i < kInodeCacheBlocks; i++) {
+        auto &block = inode_cache_[i];
+        if (block.addr >= next_segment_addr &&
+            block.addr < next_segment_addr + kSegmentSize)
+          block.addr = DiskInode::INVALID_ADDR;
+      }
+      reuses_ += 1;
+    }
+    builder_->seek(next_segment_addr);
+    free_segments_ -= 1;
+    Metrics::add(Metrics::Counter::kSegmentsWritten);
+  }
+
 public:
-  SegmentsManager(Disk *disk, Imap *imap, char *from)
+  SegmentsManager(Disk *disk, Imap *imap, AlignedBuffer from)
       : disk_(disk), builder_(std::make_unique<SegmentBuilder>(disk)),
-        imap_(imap), seg_status_(reinterpret_cast<SegmentStatus *>(from)) {
+        imap_(imap),
+        seg_status_(reinterpret_cast<SegmentStatus *>(from.get())),
+        seg_status_buf_(std::move(from)), pins_(kMaxSegments, 0),
+        inode_cache_(std::make_unique<InodeBlock[]>(kInodeCacheBlocks)) {
     free_segments_ = 0;
     for (uint32_t i = 0; i < kMaxSegments; i++) {
       free_segments_ += seg_status_[i].occupied_bytes == 0;
@@ -185,15 +369,13 @@ public:
     builder_->seek(find_next_empty(kCRSize));
   }
 
-  ~SegmentsManager() { delete[] seg_status_; }
-
   std::pair<std::map<uint32_t, std::vector<std::pair<uint32_t, uint32_t>>>,
             std::map<uint32_t, uint32_t>>
   select_segments_for_gc() {
-    debug("\tfree_segments = " + std::to_string(free_segments_));
+    NFS_TRACE(kDebug, kGC, "free_segments = {}", free_segments_.load());
     if (free_segments_ >= kFreeSegmentsLowerbound)
       return {};
-    auto lock = std::shared_lock(lock_seg_status_);
+    auto lock = lock_seg_status_.lock_shared();
     std::vector<uint32_t> candidate_seg_indices;
     auto cmp = [this](const uint32_t lhs, const uint32_t rhs) {
       auto lhs_value =
@@ -206,7 +388,7 @@ public:
     for (uint32_t i = 0; i < kMaxSegments; i++) {
       if (i == builder_->get_cursor())
         continue;
-      if (seg_status_[i].occupied_bytes == 0)
+      if (seg_status_[i].occupied_bytes == 0 || pins_[i] != 0)
         continue;
       heap.insert(i);
       if (heap.size() > kNumMergingSegments)
@@ -228,11 +410,13 @@ public:
         ds_by_inode_idx;
     std::map<uint32_t, uint32_t> addr_by_inode_idx;
     candidate_seg_indices = std::vector<uint32_t>{heap.begin(), heap.end()};
+    Metrics::add(Metrics::Counter::kGCSegmentsSelected,
+                 candidate_seg_indices.size());
     auto seg_buf = Disk::align_alloc(kSegmentSize);
-    auto summary = reinterpret_cast<SegmentSummary *>(seg_buf);
+    auto summary = reinterpret_cast<SegmentSummary *>(seg_buf.get());
     for (auto seg_idx : candidate_seg_indices) {
       auto addr = kCRSize + seg_idx * kSegmentSize;
-      disk_->read(seg_buf, addr, kSummarySize);
+      disk_->read(seg_buf.get(), addr, kSummarySize);
       // 跳过空闲空间过小的
       if (kSegmentSize - kSummarySize - seg_status_[seg_idx].occupied_bytes <=
           kBlockSize)
@@ -242,16 +426,18 @@ public:
         ds_by_inode_idx[inode_idx].push_back({addr, code});
       });
       auto imap_len = summary->len_imap_;
-      disk_->nread(seg_buf, addr + kSegmentSize - imap_len * 8, imap_len * 8);
+      disk_->nread(seg_buf.get(), addr + kSegmentSize - imap_len * 8,
+                   imap_len * 8);
       for (uint32_t i = 0; i < imap_len; i++) {
-        auto inode_idx = reinterpret_cast<uint32_t *>(seg_buf)[i * 2];
-        auto inode_addr = reinterpret_cast<uint32_t *>(seg_buf)[i * 2 + 1];
-        if (imap_->get(inode_idx) == addr_by_inode_idx[inode_idx])
+        auto inode_idx = reinterpret_cast<uint32_t *>(seg_buf.get())[i * 2];
+        auto inode_addr =
+            reinterpret_cast<uint32_t *>(seg_buf.get())[i * 2 + 1];
+        if (!imap_->contains(inode_idx) ||
+            imap_->get(inode_idx) == addr_by_inode_idx[inode_idx])
           continue;
         addr_by_inode_idx[inode_idx] = inode_addr;
       }
     }
-    delete[] seg_buf;
     for (auto &[inode_idx, ds] : ds_by_inode_idx) {
       std::sort(ds.begin(), ds.end(),
                 [](const std::pair<uint32_t, uint32_t> &lhs,
@@ -266,44 +452,104 @@ public:
 
   const char *get_buf() { return reinterpret_cast<const char *>(seg_status_); }
 
-  static uint32_t addr2segidx(const uint32_t addr) {
-#ifndef NDEBUG
-    if (addr >= kDiskCapacityMB * 1024 * 1024 - kCRSize) {
-      debug("failed addr = " + std::to_string(addr));
+  // punch out segments which are free in the checkpoint just written, at
+  // most kDiscardSegmentsPerCheckpoint of them and adjacent ones in one go.
+  // The checkpoint lock is held, so none of them is reused meanwhile, and
+  // the older checkpoint is never read again once the newer one is whole
+  void discard_free_segments() {
+    auto lock_builder = lock_builder_.lock();
+    auto lock = lock_seg_status_unique();
+    auto cursor = addr2segidx(builder_->get_cursor());
+    // the tail of the table past the second checkpoint is never used
+    auto segments = (disk_->end() - 2 * kCRSize) / kSegmentSize;
+    uint32_t budget = kDiscardSegmentsPerCheckpoint;
+    uint32_t run_start = 0, run_len = 0;
+    auto punch = [&] {
+      if (run_len == 0)
+        return;
+      disk_->discard(kCRSize + run_start * kSegmentSize,
+                     run_len * kSegmentSize);
+      Metrics::add(Metrics::Counter::kSegmentsDiscarded, run_len);
+      run_len = 0;
+    };
+    for (uint32_t i = 0; i < segments && budget > 0; i++) {
+      auto &status = seg_status_[i];
+      if (i == cursor || !is_free(i) ||
+          status.flushing_version == kDiscardedVersion) {
+        punch();
+        continue;
+      }
+      if (run_len == 0)
+        run_start = i;
+      run_len += 1;
+      budget -= 1;
+      status.flushing_version = kDiscardedVersion;
     }
-#endif
+    punch();
+  }
+
+  uint32_t free_segments() const { return free_segments_.load(); }
+
+  // number of used segments in each tenth of utilization
+  std::vector<uint32_t> utilization() {
+    auto lock = lock_seg_status_.lock_shared();
+    std::vector<uint32_t> ret(10, 0);
+    for (uint32_t i = 0; i < kMaxSegments; i++) {
+      if (seg_status_[i].occupied_bytes == 0)
+        continue;
+      auto tenth = static_cast<uint64_t>(seg_status_[i].occupied_bytes) * 10 /
+                   (kSegmentSize - kSummarySize);
+      ret[std::min<uint64_t>(tenth, 9)] += 1;
+    }
+    return ret;
+  }
+
+  static uint32_t addr2segidx(const uint32_t addr) {
+    if (addr >= kDiskCapacityMB * 1024 * 1024 - kCRSize)
+      NFS_TRACE(kError, kSegment, "failed addr = {}", addr);
     assert(addr >= kCRSize);
     assert(addr < kDiskCapacityMB * 1024 * 1024 - kCRSize);
     return (addr - kCRSize) / kSegmentSize;
   }
 
   void flush() {
-    auto [buf, offset, occupied_bytes] = builder_->build();
-    if (occupied_bytes == 0) {
-      return;
-    }
-    auto idx = (offset - kCRSize) / kSegmentSize;
-    seg_status_[idx].occupied_bytes = occupied_bytes;
-    seg_status_[idx].flushing_version = imap_->version();
-    disk_->write(buf, offset, kSegmentSize);
-    auto next_segment_addr = find_next_empty(offset + kSegmentSize);
-    builder_->seek(next_segment_addr);
-    free_segments_ -= 1;
+    auto lock = lock_builder_.lock();
+    flush_locked();
   }
 
-  void assert_not_discarded(const uint32_t addr) {
+  void assert_not_discarded([[maybe_unused]] const uint32_t addr) {
 #ifndef NDEBUG
     assert(discarded.find(addr) == discarded.end());
 #endif
   }
 
-  void discard(const uint32_t addr, const uint32_t size) {
-    auto lock = std::unique_lock(lock_seg_status_);
+  // size is the uncompressed one, a compressed block frees what it took and
+  // a deduplicated one only once its last ref is gone
+  void discard(uint32_t addr, uint32_t size) {
+    if (DedupTable::is_handle(addr)) {
+      uint32_t freed;
+      {
+        auto lock = lock_dedup_.lock();
+        freed = dedup_table_.unref(DedupTable::slot_of(addr));
+      }
+      if (freed == DiskInode::INVALID_ADDR)
+        return;
+#ifndef NDEBUG
+      {
+        auto lock = lock_builder_.lock();
+        discarded.insert(addr);
+      }
+#endif
+      addr = freed;
+    }
+    size = CompressedBlock::stored_size(addr, size);
+    auto lock_builder = lock_builder_.lock();
+    auto lock = lock_seg_status_unique();
 #ifndef NDEBUG
     discarded.insert(addr);
-    debug("SegmentsManager: discard(addr = " + std::to_string(addr) +
-          ", size = " + std::to_string(size) + ")");
 #endif
+    NFS_TRACE(kVerbose, kSegment, "discard(addr = {}, size = {})", addr, size);
+    Metrics::add(Metrics::Counter::kLogBytesDiscarded, size);
     auto idx = addr2segidx(addr);
     if (addr2segidx(builder_->get_cursor()) == idx) {
       builder_->discard(size);
@@ -311,11 +557,43 @@ public:
     }
     assert(size <= seg_status_[idx].occupied_bytes);
     seg_status_[idx].occupied_bytes -= size;
-    if (seg_status_[idx].occupied_bytes == 0) {
+    if (is_free(idx)) {
       free_segments_ += 1;
     }
   }
 
+  // pin the segments in use in the segment table of a snapshot. Only done
+  // right after a checkpoint or when mounting, the building segment is free
+  // in that table, or else nothing was built in it yet
+  void pin(const char *snapshot_status) {
+    auto lock_builder = lock_builder_.lock();
+    auto lock = lock_seg_status_unique();
+    auto snapshot = reinterpret_cast<const SegmentStatus *>(snapshot_status);
+    for (uint32_t i = 0; i < kMaxSegments; i++) {
+      if (snapshot[i].occupied_bytes == 0)
+        continue;
+      if (is_free(i))
+        free_segments_ -= 1;
+      pins_[i] += 1;
+    }
+    auto cursor = builder_->get_cursor();
+    if (pins_[addr2segidx(cursor)] != 0)
+      builder_->seek(find_next_empty(cursor));
+  }
+
+  void unpin(const char *snapshot_status) {
+    auto lock = lock_seg_status_unique();
+    auto snapshot = reinterpret_cast<const SegmentStatus *>(snapshot_status);
+    for (uint32_t i = 0; i < kMaxSegments; i++) {
+      if (snapshot[i].occupied_bytes == 0)
+        continue;
+      assert(pins_[i] > 0);
+      pins_[i] -= 1;
+      if (is_free(i))
+        free_segments_ += 1;
+    }
+  }
+
   template <typename obj_t> uint32_t push(obj_t obj, const uint32_t old_addr) {
     if (old_addr == DiskInode::INVALID_ADDR ||
         old_addr == DiskInode::TEMPORARY_ADDR)
@@ -325,16 +603,226 @@ public:
     return new_addr;
   }
 
+  // data blocks are deduplicated if enabled, the address returned is a
+  // handle then
+  uint32_t push(const std::tuple<char *, uint32_t, uint32_t> block) {
+    auto [buf, inode_idx, code] = block;
+    if (!dedup_.load(std::memory_order_relaxed) ||
+        inode_idx == Imap::kPageOwner || inode_idx == dedup_inode_idx_ ||
+        !DiskInode::is_data(code))
+      return push_stored(block);
+    auto fp = DedupTable::fingerprint(buf);
+    auto lock = lock_dedup_.lock();
+    auto slot = dedup_table_.find(fp);
+    if (slot.has_value()) {
+      // the fingerprint is no digest, share only what really is the same
+      char stored[kBlockSize];
+      read_block(stored, dedup_table_.addr_of(slot.value()), 0, kBlockSize);
+      if (std::memcmp(stored, buf, kBlockSize) != 0) {
+        Metrics::add(Metrics::Counter::kDedupMismatches);
+        return push_stored(block);
+      }
+      dedup_table_.ref(slot.value());
+      Metrics::add(Metrics::Counter::kDedupHits);
+      return DedupTable::handle_of(slot.value());
+    }
+    auto new_slot = dedup_table_.insert(fp);
+    dedup_table_.set_addr(new_slot, push_stored(std::make_tuple(
+                                        buf, DedupTable::kOwner, new_slot)));
+#ifndef NDEBUG
+    {
+      auto lock_builder = lock_builder_.lock();
+      discarded.erase(DedupTable::handle_of(new_slot));
+    }
+#endif
+    return DedupTable::handle_of(new_slot);
+  }
+
+  // compressed first if enabled, imap pages are read before there is a
+  // SegmentsManager so they always stay raw
+  uint32_t push_stored(const std::tuple<char *, uint32_t, uint32_t> block) {
+    if (!compress_.load(std::memory_order_relaxed) ||
+        std::get<1>(block) == Imap::kPageOwner)
+      return push<decltype(block)>(block);
+    thread_local auto compressed = std::make_unique<CompressedBlock>();
+    bool packed;
+    {
+      NFS_SPAN("compress");
+      packed = compressed->pack(std::get<0>(block));
+    }
+    if (!packed)
+      return push<decltype(block)>(block);
+    Metrics::add(Metrics::Counter::kBlocksCompressed);
+    Metrics::add(Metrics::Counter::kCompressBytesSaved,
+                 kBlockSize - get_size(compressed.get()));
+    return push(std::make_tuple(
+        static_cast<const CompressedBlock *>(compressed.get()),
+        std::get<1>(block), std::get<2>(block)));
+  }
+
   template <typename obj_t> uint32_t push(obj_t obj) {
+    NFS_SPAN("segment push");
+    auto lock = lock_builder_.lock();
     auto pushed = builder_->push(obj);
     if (pushed == std::nullopt) {
-      flush();
-      return push(obj);
+      flush_locked();
+      pushed = builder_->push(obj);
+      assert(pushed != std::nullopt);
     }
+    Metrics::add(Metrics::Counter::kLogBytesAppended,
+                 get_size(std::get<0>(obj)));
     return pushed.value();
   }
 
+  void set_compress(const bool compress) { compress_ = compress; }
+
+  void set_dedup(const bool dedup) { dedup_ = dedup; }
+
+  void set_dedup_inode(const uint32_t inode_idx) {
+    dedup_inode_idx_ = inode_idx;
+  }
+
+  // a handle for one more user of the block at addr, a plain block is
+  // adopted by the dedup table where it lies
+  uint32_t share(const uint32_t addr) {
+    auto lock = lock_dedup_.lock();
+    if (DedupTable::is_handle(addr)) {
+      dedup_table_.ref(DedupTable::slot_of(addr));
+      return addr;
+    }
+    auto handle = DedupTable::handle_of(dedup_table_.adopt(addr, 2));
+#ifndef NDEBUG
+    {
+      auto lock_builder = lock_builder_.lock();
+      discarded.erase(handle);
+    }
+#endif
+    return handle;
+  }
+
+  // adopted blocks in the segments being cleaned are moved as the table's
+  void claim_shared(
+      std::map<uint32_t, std::vector<std::pair<uint32_t, uint32_t>>>
+          &ds_by_inode_idx) {
+    auto lock = lock_dedup_.lock();
+    std::vector<std::pair<uint32_t, uint32_t>> claimed;
+    for (auto &[inode_idx, ds] : ds_by_inode_idx) {
+      if (inode_idx == Imap::kPageOwner || inode_idx == DedupTable::kOwner)
+        continue;
+      auto last = std::remove_if(
+          ds.begin(), ds.end(), [&](const std::pair<uint32_t, uint32_t> &d) {
+            auto slot = dedup_table_.adopted(d.first);
+            if (slot.has_value())
+              claimed.push_back({d.first, slot.value()});
+            return slot.has_value();
+          });
+      ds.erase(last, ds.end());
+    }
+    if (claimed.empty())
+      return;
+    auto &owned = ds_by_inode_idx[DedupTable::kOwner];
+    owned.insert(owned.end(), claimed.begin(), claimed.end());
+  }
+
+  // the content of the file holding the table, read when mounting
+  void load_dedup(const char *from, const uint32_t size) {
+    auto lock = lock_dedup_.lock();
+    dedup_table_.load(from, size);
+  }
+
+  // hand the dirty pages of the table to f(buf, offset, size)
+  template <typename F> void flush_dedup(F f) {
+    auto lock = lock_dedup_.lock();
+    dedup_table_.flush(f);
+  }
+
+  // move a deduplicated block out of a segment being cleaned, false if the
+  // block at addr is dead
+  bool relocate_dedup(const uint32_t slot, const uint32_t addr) {
+    auto lock = lock_dedup_.lock();
+    if (!dedup_table_.holds(slot, addr))
+      return false;
+    auto buf = Disk::align_alloc(kBlockSize);
+    read_block(buf.get(), addr, 0, kBlockSize);
+    auto new_addr =
+        push_stored(std::make_tuple(buf.get(), DedupTable::kOwner, slot));
+    dedup_table_.set_addr(slot, new_addr);
+    discard(addr, kBlockSize);
+    return true;
+  }
+
+  uint32_t dedup_count() {
+    auto lock = lock_dedup_.lock();
+    return dedup_table_.count();
+  }
+
+  // read [offset, offset + size) of the block at addr
+  void read_block(char *buf, uint32_t addr, const uint32_t offset,
+                  const uint32_t size) {
+    if (DedupTable::is_handle(addr)) {
+      auto lock = lock_dedup_.lock();
+      addr = dedup_table_.addr_of(DedupTable::slot_of(addr));
+    }
+    if (!CompressedBlock::is_compressed(addr)) {
+      read(buf, addr + offset, size);
+      return;
+    }
+    auto units = CompressedBlock::units_of(addr);
+    char record[kBlockSize];
+    read(record, CompressedBlock::base_of(addr), units * kCompressUnit);
+    NFS_SPAN("decompress");
+    char block[kBlockSize];
+    auto whole = offset == 0 && size == kBlockSize;
+    if (!CompressedBlock::unpack(record, units, whole ? buf : block)) {
+      NFS_TRACE(kError, kSegment, "corrupt compressed block at {}", addr);
+      throw CorruptBlock();
+    }
+    if (!whole)
+      std::memcpy(buf, block + offset, size);
+  }
+
+  // read the inode at addr through the inode block cache
+  void read_inode(DiskInode *disk_inode, const uint32_t addr) {
+    auto buf = reinterpret_cast<char *>(disk_inode);
+    // before the builder is checked, the segment may be reused right after
+    auto reuses = reuses_.load();
+    {
+      auto lock = lock_builder_.lock();
+      if (builder_->read(buf, addr, sizeof(DiskInode))) {
+        Metrics::add(Metrics::Counter::kBuilderReadHits);
+        return;
+      }
+    }
+    auto seg_addr = kCRSize + addr2segidx(addr) * kSegmentSize;
+    auto block_addr = addr - (addr - seg_addr) % kBlockSize;
+    auto &block = inode_cache_[block_addr / kBlockSize % kInodeCacheBlocks];
+    {
+      auto lock = lock_inode_cache_.lock();
+      if (block.addr == block_addr) {
+        std::memcpy(buf, block.data + addr - block_addr, sizeof(DiskInode));
+        Metrics::add(Metrics::Counter::kInodeCacheHits);
+        return;
+      }
+    }
+    Metrics::add(Metrics::Counter::kInodeCacheMisses);
+    auto data = Disk::align_alloc(kBlockSize);
+    disk_->read(data.get(), block_addr, kBlockSize);
+    std::memcpy(buf, data.get() + addr - block_addr, sizeof(DiskInode));
+    auto lock = lock_inode_cache_.lock();
+    if (reuses_.load() != reuses)
+      return;
+    std::memcpy(block.data, data.get(), kBlockSize);
+    block.addr = block_addr;
+  }
+
   void read(char *buf, const uint32_t offset, const uint32_t size) {
-    builder_->read(buf, offset, size);
+    {
+      auto lock = lock_builder_.lock();
+      if (builder_->read(buf, offset, size)) {
+        Metrics::add(Metrics::Counter::kBuilderReadHits);
+        return;
+      }
+    }
+    disk_->read(buf, offset, size);
   }
 };
\ No newline at end of file
@@ -0,0 +1,236 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <random>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#include "nfs/disk.hpp"
+#include "nfs/metrics.hpp"
+#include "nfs/span.hpp"
+#include "nfs/trace.hpp"
+
+/*
+  Shapes the I/O of another disk like a real device would. The device has
+  queue_depth channels, an I/O takes the earliest free channel for
+
+    latency + jitter + size / bandwidth
+
+  where jitter is exponential and now and then a spike, and the caller sleeps
+  until it completes. sync waits for every channel to drain, then pays
+  sync_us. The wrapped disk is touched right away, only the caller is held.
+
+  With torn_rate set, a write may land only partially; the device then drops
+  every later write and sync, as if the power had been cut right there. Keep
+  a reference to the wrapped disk and mount it again to check recovery.
+*/
+
+struct SimProfile {
+  uint32_t queue_depth;
+  double read_us;
+  double write_us;
+  double jitter_us;
+  double spike_rate;
+  double spike_us;
+  double read_mbps;
+  double write_mbps;
+  double sync_us;
+  double torn_rate = 0;
+
+  // queue depth, read/write latency, jitter, spikes, bandwidth, sync, a
+  // bandwidth of 0 is unlimited
+  static SimProfile none() { return {1, 0, 0, 0, 0, 0, 0, 0, 0}; }
+
+  static SimProfile ssd() {
+    return {32, 80, 20, 10, 1e-4, 5000, 2000, 1000, 500};
+  }
+
+  static SimProfile hdd() {
+    return {1, 4000, 4000, 2000, 1e-3, 50000, 150, 150, 8000};
+  }
+
+  static std::optional<SimProfile> of(const std::string_view name) {
+    if (name == "none")
+      return none();
+    if (name == "ssd")
+      return ssd();
+    if (name == "hdd")
+      return hdd();
+    return std::nullopt;
+  }
+};
+
+class SimDisk : public Disk {
+  std::shared_ptr<Disk> disk_;
+  const SimProfile profile_;
+  std::mutex lock_;
+  std::mt19937_64 rng_;
+  // when each channel becomes free
+  std::vector<uint64_t> channels_;
+  bool power_cut_ = false;
+  uint64_t ios_ = 0;
+  uint64_t bytes_read_ = 0;
+  uint64_t bytes_written_ = 0;
+  uint64_t bytes_dropped_ = 0;
+  uint64_t syncs_ = 0;
+  uint64_t spikes_ = 0;
+  uint64_t torn_writes_ = 0;
+  uint64_t busy_ns_ = 0;
+
+  static uint64_t now_ns() { return Metrics::now_ns(); }
+
+  static void sleep_until(const uint64_t ns) {
+    auto now = now_ns();
+    if (ns > now)
+      std::this_thread::sleep_for(std::chrono::nanoseconds(ns - now));
+  }
+
+  uint64_t jitter_ns_locked() {
+    if (profile_.jitter_us == 0 && profile_.spike_rate == 0)
+      return 0;
+    auto jitter = std::exponential_distribution<double>(
+        1 / std::max(profile_.jitter_us, 1e-3))(rng_);
+    if (std::uniform_real_distribution<double>(0, 1)(rng_) <
+        profile_.spike_rate) {
+      spikes_ += 1;
+      jitter += profile_.spike_us;
+    }
+    return jitter * 1000;
+  }
+
+  // reserve a channel for an I/O, return when it completes
+  uint64_t schedule(const double latency_us, const double mbps,
+                    const uint32_t size) {
+    auto lock = std::unique_lock(lock_);
+    auto service_ns = static_cast<uint64_t>(latency_us * 1000) +
+                      jitter_ns_locked();
+    if (mbps > 0)
+      service_ns += static_cast<uint64_t>(size / mbps * 1000);
+    auto channel = std::min_element(channels_.begin(), channels_.end());
+    auto done = std::max(*channel, now_ns()) + service_ns;
+    *channel = done;
+    ios_ += 1;
+    busy_ns_ += service_ns;
+    return done;
+  }
+
+public:
+  SimDisk(std::shared_ptr<Disk> disk, const SimProfile profile,
+          const uint64_t seed = 42)
+      : disk_(std::move(disk)), profile_(profile), rng_(seed),
+        channels_(std::max(profile.queue_depth, 1u), 0) {}
+
+  void read(char *buf, const uint32_t offset, const uint32_t size) override {
+    NFS_SPAN("sim read");
+    auto done = schedule(profile_.read_us, profile_.read_mbps, size);
+    disk_->read(buf, offset, size);
+    {
+      auto lock = std::unique_lock(lock_);
+      bytes_read_ += size;
+    }
+    sleep_until(done);
+  }
+
+  void nread(char *buf, const uint32_t offset, const uint32_t size) override {
+    NFS_SPAN("sim read");
+    auto done = schedule(profile_.read_us, profile_.read_mbps, size);
+    disk_->nread(buf, offset, size);
+    {
+      auto lock = std::unique_lock(lock_);
+      bytes_read_ += size;
+    }
+    sleep_until(done);
+  }
+
+  void write(const char *buf, const uint32_t offset,
+             const uint32_t size) override {
+    NFS_SPAN("sim write");
+    auto done = schedule(profile_.write_us, profile_.write_mbps, size);
+    uint32_t landed = size;
+    {
+      auto lock = std::unique_lock(lock_);
+      if (power_cut_) {
+        landed = 0;
+      } else if (std::uniform_real_distribution<double>(0, 1)(rng_) <
+                 profile_.torn_rate) {
+        // whole sectors only, like a device
+        landed = rng_() % (size / 512 + 1) * 512;
+        power_cut_ = true;
+        torn_writes_ += 1;
+        NFS_TRACE(kError, kDisk, "power cut, write at {} torn at {} of {}",
+                  offset, landed, size);
+      }
+      bytes_written_ += landed;
+      bytes_dropped_ += size - landed;
+    }
+    if (landed != 0)
+      disk_->write(buf, offset, landed);
+    sleep_until(done);
+  }
+
+  void sync() override {
+    NFS_SPAN("sim sync");
+    uint64_t done;
+    {
+      auto lock = std::unique_lock(lock_);
+      syncs_ += 1;
+      if (power_cut_)
+        return;
+      done = std::max(*std::max_element(channels_.begin(), channels_.end()),
+                      now_ns()) +
+             static_cast<uint64_t>(profile_.sync_us * 1000) +
+             jitter_ns_locked();
+      std::fill(channels_.begin(), channels_.end(), done);
+    }
+    disk_->sync();
+    sleep_until(done);
+  }
+
+  // free on the device, nothing reaches it after a power cut
+  void discard(const uint32_t offset, const uint32_t size) override {
+    {
+      auto lock = std::unique_lock(lock_);
+      if (power_cut_)
+        return;
+    }
+    disk_->discard(offset, size);
+  }
+
+  bool power_cut() {
+    auto lock = std::unique_lock(lock_);
+    return power_cut_;
+  }
+
+  // the wrapped disk, as it would be found after a restart
+  std::shared_ptr<Disk> inner() { return disk_; }
+
+  /*
+    sim ios <n> bytes_read <n> bytes_written <n> bytes_dropped <n> ...
+  */
+
+  std::string report() override {
+    auto lock = std::unique_lock(lock_);
+    char line[512];
+    snprintf(line, sizeof(line),
+             "sim ios %llu bytes_read %llu bytes_written %llu "
+             "bytes_dropped %llu syncs %llu spikes %llu torn_writes %llu "
+             "busy_ms %.1f power_cut %d\n",
+             static_cast<unsigned long long>(ios_),
+             static_cast<unsigned long long>(bytes_read_),
+             static_cast<unsigned long long>(bytes_written_),
+             static_cast<unsigned long long>(bytes_dropped_),
+             static_cast<unsigned long long>(syncs_),
+             static_cast<unsigned long long>(spikes_),
+             static_cast<unsigned long long>(torn_writes_), busy_ns_ / 1e6,
+             power_cut_);
+    return line;
+  }
+};
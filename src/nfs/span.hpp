@@ -0,0 +1,116 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+
+#include "nfs/config.hpp"
+#include "nfs/metrics.hpp"
+#include "nfs/per_thread.hpp"
+
+/*
+  Timeline of individual requests, off unless NAIVEFS_SPANS is set in the
+  environment. A span is recorded into a per-thread ring when its scope ends;
+  the outermost span of a thread starts a new request id so the spans of one
+  request can be picked out. export_json() writes the Chrome trace event
+  format, which chrome://tracing and Perfetto load directly.
+
+  Span names must stay valid while mounted, string literals usually.
+*/
+
+#define NFS_SPAN_CONCAT_(a, b) a##b
+#define NFS_SPAN_CONCAT(a, b) NFS_SPAN_CONCAT_(a, b)
+#define NFS_SPAN(name)                                                         \
+  Spans::Scope NFS_SPAN_CONCAT(nfs_span_, __LINE__)(name)
+
+class Spans {
+  struct Record {
+    uint32_t req;
+    const char *name;
+    uint64_t begin_ns;
+    uint64_t end_ns;
+  };
+
+  // taken over by a new thread once its owner exits
+  using Ring = SeqRing<Record, kSpanRingEntries>;
+  using Rings = PerThread<Ring>;
+
+  // nesting of the spans open on this thread
+  struct Local {
+    uint32_t depth = 0;
+    uint32_t req = 0;
+  };
+
+  static Local &local() {
+    thread_local Local local;
+    return local;
+  }
+
+  static uint32_t next_req() {
+    static std::atomic<uint32_t> req{0};
+    return ++req;
+  }
+
+public:
+  static bool enabled() {
+    static const bool enabled = getenv("NAIVEFS_SPANS") != nullptr;
+    return enabled;
+  }
+
+  class Scope {
+    const char *name_ = nullptr;
+    uint64_t begin_ns_ = 0;
+
+  public:
+    explicit Scope(const char *name) {
+      if (!enabled())
+        return;
+      auto &loc = local();
+      if (loc.depth++ == 0)
+        loc.req = next_req();
+      name_ = name;
+      begin_ns_ = Metrics::now_ns();
+    }
+
+    ~Scope() {
+      if (name_ == nullptr)
+        return;
+      auto &loc = local();
+      auto end_ns = Metrics::now_ns();
+      Rings::local().push([&](Record &rec) {
+        rec = Record{loc.req, name_, begin_ns_, end_ns};
+      });
+      loc.depth -= 1;
+    }
+
+    Scope(const Scope &) = delete;
+    Scope &operator=(const Scope &) = delete;
+  };
+
+  // run f as a span, used to time how long it takes to acquire a lock
+  template <typename F> static auto timed(const char *name, F &&f) {
+    Scope scope(name);
+    return f();
+  }
+
+  static std::string export_json() {
+    std::string ret = "{\"traceEvents\":[";
+    bool first = true;
+    char event[256];
+    Rings::for_each([&](const Ring &ring, const uint32_t tid) {
+      ring.for_each([&](const Record &rec) {
+        snprintf(event, sizeof(event),
+                 "%s{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%u,"
+                 "\"ts\":%.3f,\"dur\":%.3f,\"args\":{\"req\":%u}}",
+                 first ? "" : ",", rec.name, tid, rec.begin_ns / 1000.0,
+                 (rec.end_ns - rec.begin_ns) / 1000.0, rec.req);
+        ret += event;
+        first = false;
+      });
+    });
+    ret += "]}\n";
+    return ret;
+  }
+};
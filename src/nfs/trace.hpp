@@ -0,0 +1,175 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <string_view>
+#include <type_traits>
+
+#include "nfs/config.hpp"
+#include "nfs/metrics.hpp"
+#include "nfs/per_thread.hpp"
+
+/*
+  NFS_TRACE(level, category, fmt, args...)
+
+  Levels above NFS_TRACE_LEVEL are discarded at compile time, the arguments are
+  not even evaluated. Enabled traces copy the format string pointer and the raw
+  arguments into a per-thread ring buffer; formatting only happens when the
+  ring is dumped by reading /.naivefs/trace, or right away when echoing to
+  stderr (every trace in debug builds, errors only otherwise).
+
+  fmt must be a string literal with one {} per argument. Arguments are
+  integers, enums or at most one string, which is truncated to kTraceStrSize.
+*/
+
+enum class TraceLevel : uint8_t { kError, kInfo, kDebug, kVerbose };
+
+enum class TraceCat : uint8_t {
+  kFS,
+  kInode,
+  kImap,
+  kSegment,
+  kGC,
+  kCheckpoint,
+  kDisk,
+};
+
+#ifndef NFS_TRACE_LEVEL
+#ifdef NDEBUG
+#define NFS_TRACE_LEVEL 2 /* kDebug */
+#else
+#define NFS_TRACE_LEVEL 3 /* kVerbose */
+#endif
+#endif
+
+constexpr auto kTraceLevel = static_cast<TraceLevel>(NFS_TRACE_LEVEL);
+
+#define NFS_TRACE(level, cat, ...)                                             \
+  do {                                                                         \
+    if constexpr (TraceLevel::level <= kTraceLevel)                            \
+      Trace::record(TraceLevel::level, TraceCat::cat, __VA_ARGS__);            \
+  } while (0)
+
+class Trace {
+  static constexpr uint32_t kMaxArgs = 6;
+
+  enum class ArgKind : uint8_t { kUnsigned, kSigned, kString };
+
+  struct Entry {
+    TraceLevel level;
+    TraceCat cat;
+    uint8_t num_args;
+    ArgKind kinds[kMaxArgs];
+    uint64_t time_ns;
+    const char *fmt;
+    uint64_t args[kMaxArgs];
+    char str[kTraceStrSize];
+  };
+
+  // a thread which exits leaves its last traces for the dump, until a new
+  // thread takes the ring over
+  using Ring = SeqRing<Entry, kTraceRingEntries>;
+  using Rings = PerThread<Ring>;
+
+  template <typename T> static void put(Entry &entry, const T &arg) {
+    auto i = entry.num_args++;
+    if constexpr (std::is_convertible_v<const T &, std::string_view>) {
+      std::string_view view(arg);
+      auto len = std::min<size_t>(view.length(), kTraceStrSize - 1);
+      std::memcpy(entry.str, view.data(), len);
+      entry.str[len] = '\0';
+      entry.kinds[i] = ArgKind::kString;
+    } else if constexpr (std::is_enum_v<T>) {
+      entry.args[i] = static_cast<uint64_t>(arg);
+      entry.kinds[i] = ArgKind::kUnsigned;
+    } else {
+      static_assert(std::is_integral_v<T>, "trace arguments are integers");
+      entry.args[i] = static_cast<uint64_t>(arg);
+      entry.kinds[i] =
+          std::is_signed_v<T> ? ArgKind::kSigned : ArgKind::kUnsigned;
+    }
+  }
+
+  static std::string format(const Entry &entry) {
+    std::string ret;
+    uint32_t i = 0;
+    for (auto p = entry.fmt; *p != '\0'; p++) {
+      if (p[0] == '{' && p[1] == '}' && i < entry.num_args) {
+        switch (entry.kinds[i]) {
+        case ArgKind::kUnsigned:
+          ret += std::to_string(entry.args[i]);
+          break;
+        case ArgKind::kSigned:
+          ret += std::to_string(static_cast<int64_t>(entry.args[i]));
+          break;
+        case ArgKind::kString:
+          ret += entry.str;
+          break;
+        }
+        i += 1;
+        p += 1;
+      } else {
+        ret += *p;
+      }
+    }
+    return ret;
+  }
+
+  static void echo(const Entry &entry) {
+    fprintf(stderr, "\033[1m%-5s %-10s >>>> %s\033[0m\n",
+            level_name(entry.level), cat_name(entry.cat),
+            format(entry).c_str());
+  }
+
+public:
+  static const char *level_name(const TraceLevel level) {
+    static const char *names[] = {"ERROR", "INFO", "DEBUG", "VERB"};
+    return names[static_cast<uint32_t>(level)];
+  }
+
+  static const char *cat_name(const TraceCat cat) {
+    static const char *names[] = {"fs",  "inode",      "imap", "segment",
+                                  "gc",  "checkpoint", "disk"};
+    return names[static_cast<uint32_t>(cat)];
+  }
+
+  template <typename... Args>
+  static void record(const TraceLevel level, const TraceCat cat,
+                     const char *fmt, const Args &...args) {
+    static_assert(sizeof...(Args) <= kMaxArgs);
+    Rings::local().push([&](Entry &entry) {
+      entry.level = level;
+      entry.cat = cat;
+      entry.num_args = 0;
+      entry.time_ns = Metrics::now_ns();
+      entry.fmt = fmt;
+      (put(entry, args), ...);
+#ifdef NDEBUG
+      if (level == TraceLevel::kError)
+#endif
+        echo(entry);
+    });
+  }
+
+  // format the retained entries of every thread, oldest first per thread.
+  // The content of /.naivefs/trace
+  static std::string dump() {
+    std::string out;
+    char line[64];
+    Rings::for_each([&](const Ring &ring, const uint32_t tid) {
+      ring.for_each([&](Entry &entry) {
+        entry.str[kTraceStrSize - 1] = '\0';
+        snprintf(line, sizeof(line), "%llu [%u] %s %s: ",
+                 static_cast<unsigned long long>(entry.time_ns), tid,
+                 level_name(entry.level), cat_name(entry.cat));
+        out += line;
+        out += format(entry);
+        out += '\n';
+      });
+    });
+    return out;
+  }
+};
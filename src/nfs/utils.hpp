@@ -1,12 +1,13 @@
 #pragma once
 
+#include <algorithm>
 #include <cassert>
 #include <cstring>
 #include <exception>
 #include <string>
+#include <string_view>
 #include <tuple>
 #include <utility>
-#include <vector>
 
 class NoEntry : public std::exception {
 public:
@@ -28,30 +29,77 @@ public:
   const char *what() { return "Disk sync failed"; }
 };
 
+class DiskOpenFailed : public std::exception {
+public:
+  const char *what() { return "Disk open failed"; }
+};
+
 class DuplicateEntry : public std::exception {
 public:
   const char *what() { return "Duplicated entry"; }
 };
 
-inline std::pair<char *, uint32_t>
-make_one_dir_entry(const std::string &name, const uint32_t inode_idx) {
+class NotEmpty : public std::exception {
+public:
+  const char *what() { return "Directory not empty"; }
+};
+
+class NoData : public std::exception {
+public:
+  const char *what() { return "No data past offset"; }
+};
+
+class NotSupported : public std::exception {
+public:
+  const char *what() { return "Operation not supported"; }
+};
+
+class InvalidArgument : public std::exception {
+public:
+  const char *what() { return "Invalid argument"; }
+};
+
+class FileTooBig : public std::exception {
+public:
+  const char *what() { return "File too big"; }
+};
+
+class ReadOnly : public std::exception {
+public:
+  const char *what() { return "Read-only file system"; }
+};
+
+class CorruptBlock : public std::exception {
+public:
+  const char *what() { return "Corrupt block"; }
+};
+
+/*
+  [len: uint32_t, name: char[len], inode_idx: uint32_t, deleted: bool]
+*/
+
+constexpr uint32_t kMaxDirEntrySize = 4 + 255 + 4 + 1;
+
+inline uint32_t make_one_dir_entry(char *buf, const std::string_view name,
+                                   const uint32_t inode_idx) {
   uint32_t len = name.length();
-  auto buf = new char[4 + len + 4];
+  assert(len < 256);
   std::memcpy(buf, &len, 4);
-  std::memcpy(buf + 4, name.c_str(), len);
+  std::memcpy(buf + 4, name.data(), len);
   std::memcpy(buf + 4 + len, &inode_idx, 4);
   *reinterpret_cast<bool *>(buf + 4 + len + 4) = false;
-  return {buf, 4 + len + 4 + 1};
+  return 4 + len + 4 + 1;
 }
 
-inline std::tuple<std::string, uint32_t, bool>
+// the name points into buf
+inline std::tuple<std::string_view, uint32_t, bool>
 parse_one_dir_entry(const char *buf, uint32_t &offset) {
   uint32_t len = 0, inode_idx = 0;
   std::memcpy(&len, buf + offset, 4);
   assert(len < 256);
   assert(len > 0);
   offset += 4;
-  std::string name(buf + offset, len);
+  std::string_view name(buf + offset, len);
   offset += len;
   std::memcpy(&inode_idx, buf + offset, 4);
   offset += 4;
@@ -61,34 +109,36 @@ parse_one_dir_entry(const char *buf, uint32_t &offset) {
   return {name, inode_idx, deleted};
 }
 
-inline std::string
-join_path_components(const std::vector<std::string> &path_components) {
-  std::string res = "/";
-  for (auto &name : path_components)
-    res += name + "/";
-  return res;
-}
+// iterate the components of a path without copying them
+class PathIter {
+  std::string_view rest_;
 
-inline std::vector<std::string> parse_path_components(const char *path) {
-  auto len = std::strlen(path);
-  std::vector<std::string> components;
-  uint32_t last = 0;
-  assert(path[0] == '/');
-  for (uint32_t i = 1; i < len; i++) {
-    if (path[i] == '/') {
-      std::string component = std::string(path + last + 1, path + i);
-      components.push_back(component);
-      last = i;
-    }
-  }
-  if (path[len - 1] != '/') {
-    components.push_back(std::string(path + last + 1, path + len));
+public:
+  explicit PathIter(const std::string_view path) : rest_(path) {}
+
+  // return false if there is no component left
+  bool next(std::string_view &component) {
+    auto begin = rest_.find_first_not_of('/');
+    if (begin == std::string_view::npos)
+      return false;
+    rest_.remove_prefix(begin);
+    auto end = std::min(rest_.find('/'), rest_.length());
+    component = rest_.substr(0, end);
+    rest_.remove_prefix(end);
+    return true;
   }
-  return components;
-}
+};
 
-inline void debug(const std::string &msg) {
-#ifndef NDEBUG
-  fprintf(stderr, "\033[1mDEBUG >>>> %s\033[0m\n", msg.c_str());
-#endif
+/*
+  "/a/b/c" -> ["/a/b", "c"], "/a" -> ["", "a"]
+*/
+
+inline std::pair<std::string_view, std::string_view>
+split_parent(std::string_view path) {
+  while (path.length() > 1 && path.back() == '/')
+    path.remove_suffix(1);
+  auto pos = path.rfind('/');
+  assert(pos != std::string_view::npos);
+  return {path.substr(0, pos), path.substr(pos + 1)};
 }
+
@@ -2,88 +2,299 @@
 
 #pragma once
 
+#include <algorithm>
 #include <asm-generic/errno-base.h>
+#include <condition_variable>
 #include <cstdio>
-#include <exception>
+#include <cstdlib>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
 
 #include "fuse3/fuse.h"
-#include "nfs/disk.hpp"
-#include "nfs/utils.hpp"
+#include "naivefs.hpp"
 #include "unistd.h"
 
 #include "nfs/config.hpp"
-#include "nfs/disk_inode.hpp"
-#include "nfs/nfs.hpp"
+#include "nfs/ctl.hpp"
+#include "nfs/span.hpp"
+#include "nfs/trace.hpp"
+#include "nfs/utils.hpp"
 
 namespace vfs {
 
-static NaiveFS nfs;
+// set from the mount options before fuse_main
+struct Options {
+  const char *backend = "file";
+  const char *disk = kDiskPath;
+  // wrap the backend in a SimDisk with this profile
+  const char *sim = nullptr;
+  double sim_torn = 0;
+  // record the calls to this file
+  const char *optrace = nullptr;
+  int compress = 0;
+  int dedup = 0;
+  // mount this snapshot read-only
+  const char *snapshot = nullptr;
+  // seconds the kernel may cache entries, attributes and pages, off unless
+  // asked for
+  double cache_timeout = 0;
+};
+
+static Options options;
+static std::unique_ptr<naivefs::Volume> volume;
+// the kernel agreed to cache writes
+static bool writeback_cache = false;
+
+// drops what the kernel caches for a path after a change it cannot see
+// through its own page cache. A notification sent from inside a handler may
+// wait on locks the kernel holds for that very request, so a thread sends
+// them instead.
+class Invalidator {
+  std::mutex lock_;
+  std::condition_variable cv_;
+  std::deque<std::string> paths_;
+  bool stopping_ = false;
+  fuse *fuse_ = nullptr;
+  std::thread thread_;
+
+  void run() {
+    std::unique_lock<std::mutex> lk(lock_);
+    while (true) {
+      cv_.wait(lk, [this] { return stopping_ || !paths_.empty(); });
+      if (stopping_)
+        return;
+      auto path = std::move(paths_.front());
+      paths_.pop_front();
+      lk.unlock();
+      // -ENOENT if the kernel holds nothing for it
+      fuse_invalidate_path(fuse_, path.c_str());
+      lk.lock();
+    }
+  }
+
+public:
+  void start(fuse *f) {
+    fuse_ = f;
+    thread_ = std::thread([this] { run(); });
+  }
+
+  void stop() {
+    if (!thread_.joinable())
+      return;
+    {
+      std::lock_guard<std::mutex> lk(lock_);
+      stopping_ = true;
+    }
+    cv_.notify_one();
+    thread_.join();
+  }
 
-inline uint32_t get_inode_idx(const char *path, fuse_file_info *fi) {
-  if (fi != nullptr && fi->fh != 0) {
-    return nfs.get_inode_idx(fi->fh);
+  void push(const char *path) {
+    if (path == nullptr || !thread_.joinable())
+      return;
+    {
+      std::lock_guard<std::mutex> lk(lock_);
+      paths_.emplace_back(path);
+    }
+    cv_.notify_one();
   }
-  return nfs.get_inode_idx(path);
+};
+
+static Invalidator invalidator;
+
+// push path if the call succeeded
+inline int invalidate(const char *path, const int ret) {
+  if (ret >= 0)
+    invalidator.push(path);
+  return ret;
 }
 
-inline int fsync(const char *, int, struct fuse_file_info *) {
-  nfs.fsync();
-  return 0;
+inline CtlFiles &ctl() {
+  static CtlFiles ctl;
+  static const bool registered = [] {
+    ctl.add("stats", [] { return volume->stats(); });
+    ctl.add("trace", [] { return Trace::dump(); });
+    ctl.add("trace.json", [] { return Spans::export_json(); });
+    return true;
+  }();
+  (void)registered;
+  return ctl;
+}
+
+// background threads would not survive the daemonizing fork, so the
+// volume is opened here rather than before fuse_main
+inline void *init(fuse_conn_info *conn, fuse_config *cfg) {
+  naivefs::VolumeOptions volume_options;
+  volume_options.backend = options.backend;
+  volume_options.sim = options.sim == nullptr ? "" : options.sim;
+  volume_options.sim_torn = options.sim_torn;
+  volume_options.optrace = options.optrace == nullptr ? "" : options.optrace;
+  volume_options.compress = options.compress != 0;
+  volume_options.dedup = options.dedup != 0;
+  volume_options.snapshot = options.snapshot == nullptr ? "" : options.snapshot;
+  volume = naivefs::Volume::open(options.disk, volume_options);
+  if (volume == nullptr) {
+    fprintf(stderr, "cannot open %s\n", options.disk);
+    exit(1);
+  }
+  // every change goes through this mount, so the kernel may keep what it
+  // read and batch small writes, the handlers below invalidate the rest
+  if (options.cache_timeout > 0) {
+    cfg->entry_timeout = options.cache_timeout;
+    cfg->negative_timeout = options.cache_timeout;
+    cfg->attr_timeout = options.cache_timeout;
+    cfg->kernel_cache = 1;
+    if (conn->capable & FUSE_CAP_WRITEBACK_CACHE) {
+      conn->want |= FUSE_CAP_WRITEBACK_CACHE;
+      writeback_cache = true;
+    }
+    invalidator.start(fuse_get_context()->fuse);
+  }
+  return nullptr;
+}
+
+inline void destroy(void *) {
+  invalidator.stop();
+  volume.reset();
+}
+
+inline bool has_snapshot(const std::string_view name) {
+  std::vector<std::string> names;
+  if (volume->list_snapshots(names) != 0)
+    return false;
+  return std::find(names.begin(), names.end(), name) != names.end();
+}
+
+inline bool has_fh(const fuse_file_info *fi) {
+  return fi != nullptr && fi->fh != 0;
+}
+
+inline int fsync(const char *, int, struct fuse_file_info *fi) {
+  if (fi != nullptr && CtlFiles::is_ctl(fi->fh))
+    return 0;
+  return has_fh(fi) ? volume->fsync(fi->fh) : volume->sync();
+}
+
+inline int flush(const char *, struct fuse_file_info *fi) {
+  if (CtlFiles::is_ctl(fi->fh))
+    return 0;
+  return volume->flush(fi->fh);
+}
+
+inline int release(const char *, struct fuse_file_info *fi) {
+  if (CtlFiles::is_ctl(fi->fh)) {
+    ctl().release(fi->fh);
+    return 0;
+  }
+  return volume->release(fi->fh);
 }
 
 inline int rename(const char *old_path, const char *new_path,
                   unsigned int flags) {
-  try {
-    nfs.rename(old_path, new_path, flags);
-  } catch (const NoEntry &e) {
-    return -ENOENT;
-  } catch (const DuplicateEntry &e) {
-    return -EEXIST;
-  }
-  return 0;
+  if (CtlFiles::is_ctl(old_path) || CtlFiles::is_ctl(new_path))
+    return -EACCES;
+  auto ret = volume->rename(old_path, new_path, flags);
+  invalidate(new_path, ret);
+  return invalidate(old_path, ret);
 }
 
 inline int truncate(const char *path, off_t size, struct fuse_file_info *fi) {
-  const auto inode_idx = get_inode_idx(path, fi);
-  nfs.truncate(inode_idx, size);
-  return 0;
+  if (CtlFiles::is_ctl(path))
+    return -EACCES;
+  if (size < 0)
+    return -EINVAL;
+  return invalidate(path, has_fh(fi) ? volume->ftruncate(fi->fh, size)
+                                     : volume->truncate(path, size));
 }
 
 inline int open(const char *path, struct fuse_file_info *fi) {
-  auto fd = nfs.open(path, fi->flags);
-  fi->fh = fd;
-  return 0;
+  if (CtlFiles::is_ctl(path)) {
+    if ((fi->flags & O_ACCMODE) != O_RDONLY)
+      return -EACCES;
+    try {
+      fi->fh = ctl().open(path);
+    } catch (const NoEntry &e) {
+      return -ENOENT;
+    }
+    // the size reported by getattr is 0, read the whole content anyway
+    fi->direct_io = 1;
+    return 0;
+  }
+  // with writeback caching the kernel reads around partial pages and
+  // supplies the offsets of appends itself
+  auto flags = fi->flags;
+  if (writeback_cache) {
+    if ((flags & O_ACCMODE) == O_WRONLY)
+      flags = (flags & ~O_ACCMODE) | O_RDWR;
+    flags &= ~O_APPEND;
+  }
+  uint64_t fh;
+  auto ret = volume->open(path, flags, fh);
+  if (ret == 0)
+    fi->fh = fh;
+  return ret;
 }
 
 inline int create(const char *path, mode_t, struct fuse_file_info *fi) {
+  if (CtlFiles::is_ctl(path))
+    return -EACCES;
   return open(path, fi);
 }
 
 inline int utimens(const char *path, const struct timespec tv[2],
-                   struct fuse_file_info *fi) {
-  try {
-    auto inode_idx = get_inode_idx(path, fi);
-    debug(std::string("utimens -> inode_idx = ") + std::to_string(inode_idx));
-    auto disk_inode = nfs.get_diskinode(inode_idx);
-    auto access_time = tv[0].tv_sec + tv[0].tv_nsec / 1000000000.0;
-    auto modify_time = tv[1].tv_sec + tv[1].tv_nsec / 1000000000.0;
-    disk_inode->access_time = access_time;
-    disk_inode->modify_time = modify_time;
-    nfs.modify(std::move(disk_inode), inode_idx);
-  } catch (std::exception &e) {
-    printf("%s\n", e.what());
-    // handle exceptions
-    // todo: move to upper level
-  }
+                   struct fuse_file_info *) {
+  if (CtlFiles::is_ctl(path))
+    return 0;
+  auto access_time = tv[0].tv_sec + tv[0].tv_nsec / 1000000000.0;
+  auto modify_time = tv[1].tv_sec + tv[1].tv_nsec / 1000000000.0;
+  volume->utimens(path, access_time, modify_time);
   return 0;
 }
 
+// no invalidation, the data came from the page cache of the kernel. Neither
+// does the cleaner need any, it moves blocks without changing what they hold
 inline int write(const char *, const char *buf, size_t size, off_t offset,
                  struct fuse_file_info *fi) {
-  debug("FILE write: " + std::to_string(offset));
-  char *tmp_buf = (char *)buf;
-  nfs.write(fi->fh, tmp_buf, offset, size);
-  return size;
+  if (offset < 0)
+    return -EINVAL;
+  // 64 bits down to the engine, which fails past 4 GiB with -EFBIG
+  return volume->write(fi->fh, buf, size, static_cast<uint64_t>(offset));
+}
+
+inline int fallocate(const char *path, int mode, off_t offset, off_t size,
+                     struct fuse_file_info *fi) {
+  if (CtlFiles::is_ctl(fi->fh))
+    return -EACCES;
+  if (offset < 0 || size <= 0)
+    return -EINVAL;
+  auto ret = volume->fallocate(fi->fh, mode, offset, size);
+  // a punched or zeroed range reads differently from what the kernel holds
+  return mode == 0 ? ret : invalidate(path, ret);
+}
+
+inline off_t lseek(const char *, off_t offset, int whence,
+                   struct fuse_file_info *fi) {
+  if (CtlFiles::is_ctl(fi->fh) || offset < 0)
+    return -ENXIO;
+  return volume->lseek(fi->fh, offset, whence);
+}
+
+inline ssize_t copy_file_range(const char *, struct fuse_file_info *fi_in,
+                               off_t offset_in, const char *path_out,
+                               struct fuse_file_info *fi_out, off_t offset_out,
+                               size_t size, int flags) {
+  if (CtlFiles::is_ctl(fi_in->fh) || CtlFiles::is_ctl(fi_out->fh))
+    return -EACCES;
+  if (flags != 0 || offset_in < 0 || offset_out < 0)
+    return -EINVAL;
+  return invalidate(path_out, volume->copy_file_range(fi_in->fh, offset_in,
+                                                     fi_out->fh, offset_out,
+                                                     size));
 }
 
 inline int access(const char *, int) {
@@ -92,44 +303,86 @@ inline int access(const char *, int) {
 }
 
 inline int rmdir(const char *path) {
-  try {
-    nfs.unlink(path);
-  } catch (const NoEntry &e) {
-    return -ENOENT;
+  auto snapshot = CtlFiles::snapshot_of(path);
+  if (!snapshot.empty()) {
+    auto ret = volume->delete_snapshot(std::string(snapshot).c_str());
+    invalidate(std::string(CtlFiles::kSnapshots).c_str(), ret);
+    return invalidate(path, ret);
   }
-  return 0;
+  if (CtlFiles::is_ctl(path))
+    return -EACCES;
+  return invalidate(path, volume->rmdir(path));
 }
 
 inline int mkdir(const char *path, const mode_t mode) {
-  try {
-    nfs.mkdir(path, mode);
-  } catch (const NoEntry &e) {
-    return -ENOENT;
-  } catch (const DuplicateEntry &e) {
-    return -EEXIST;
+  auto snapshot = CtlFiles::snapshot_of(path);
+  if (!snapshot.empty()) {
+    auto ret = volume->snapshot(std::string(snapshot).c_str());
+    invalidate(std::string(CtlFiles::kSnapshots).c_str(), ret);
+    return invalidate(path, ret);
   }
-  return 0;
+  if (CtlFiles::is_ctl(path))
+    return -EACCES;
+  return volume->mkdir(path, mode);
 }
 
 inline int read(const char *, char *buf, size_t size, off_t offset,
                 struct fuse_file_info *fi) {
-  debug("FILE read: " + std::to_string(offset));
-  char *tmp_buf = (char *)buf;
-  return nfs.read(fi->fh, tmp_buf, offset, size);
+  if (CtlFiles::is_ctl(fi->fh))
+    return ctl().read(fi->fh, buf, offset, size);
+  return volume->read(fi->fh, buf, size, offset);
 }
 
 inline int unlink(const char *path) {
-  try {
-    nfs.unlink(path);
-  } catch (const NoEntry &e) {
-    return -ENOENT;
-  }
-  return 0;
+  if (CtlFiles::is_ctl(path))
+    return -EACCES;
+  return invalidate(path, volume->unlink(path));
+}
+
+inline void fill_stat(const naivefs::Stat &st, struct stat *stbuf) {
+  stbuf->st_ino = st.ino;
+  stbuf->st_mode = st.mode;
+  stbuf->st_atime = st.atime;
+  stbuf->st_mtime = st.mtime;
+  stbuf->st_ctime = st.ctime;
+  stbuf->st_size = st.size;
+  stbuf->st_nlink = st.nlink;
+  stbuf->st_uid = st.uid;
+  stbuf->st_gid = st.gid;
+  stbuf->st_blocks = st.blocks;
+  stbuf->st_blksize = kBlockSize;
 }
 
-inline int readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t,
-                   fuse_file_info *, fuse_readdir_flags) {
-  auto names = nfs.readdir(path);
+// a page at a time, the byte offset of the next entry in the directory is
+// the cookie. With readdirplus the attributes go along, so no getattr
+// follows for each entry
+inline int readdir(const char *path, void *buf, fuse_fill_dir_t filler,
+                   off_t offset, fuse_file_info *, fuse_readdir_flags flags) {
+  if (!CtlFiles::is_ctl(path)) {
+    auto plus = (flags & FUSE_READDIR_PLUS) != 0;
+    auto fill_flags = plus ? FUSE_FILL_DIR_PLUS : (fuse_fill_dir_flags)0;
+    return volume->readdir(
+        path, offset,
+        [&](const char *name, const naivefs::Stat *st,
+            const uint64_t next_offset) {
+          struct stat stbuf = {};
+          if (st != nullptr)
+            fill_stat(*st, &stbuf);
+          return filler(buf, name, st != nullptr ? &stbuf : nullptr,
+                        next_offset, fill_flags) == 0;
+        },
+        plus);
+  }
+  std::vector<std::string> names;
+  if (path == CtlFiles::kSnapshots) {
+    auto ret = volume->list_snapshots(names);
+    if (ret != 0)
+      return ret;
+  } else if (!CtlFiles::snapshot_of(path).empty()) {
+    // browsed by mounting it with -o snapshot=<name>
+  } else {
+    names = ctl().list();
+  }
   for (auto &name : names) {
     filler(buf, name.c_str(), nullptr, 0, (fuse_fill_dir_flags)0);
   }
@@ -137,24 +390,24 @@ inline int readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t,
 }
 
 inline int getattr(const char *path, struct stat *stbuf, fuse_file_info *fi) {
-  try {
-    auto inode_idx = get_inode_idx(path, fi);
-    auto disk_inode = nfs.get_diskinode(inode_idx);
-    stbuf->st_mode = disk_inode->mode;
-    stbuf->st_atime = disk_inode->access_time;
-    stbuf->st_mtime = disk_inode->modify_time;
-    stbuf->st_ctime = disk_inode->change_time;
-    stbuf->st_size = disk_inode->size;
-    stbuf->st_mode = disk_inode->mode;
-    stbuf->st_nlink = disk_inode->link_cnt;
-    stbuf->st_uid = disk_inode->uid;
-    stbuf->st_gid = disk_inode->gid;
-    stbuf->st_blocks = disk_inode->st_blocks();
+  if (CtlFiles::is_ctl(path)) {
+    auto snapshot = CtlFiles::snapshot_of(path);
+    auto is_dir = CtlFiles::is_dir(path) || !snapshot.empty();
+    if (snapshot.empty() ? !ctl().exists(path) : !has_snapshot(snapshot))
+      return -ENOENT;
+    stbuf->st_mode = is_dir ? S_IFDIR | 0555 : S_IFREG | 0444;
+    stbuf->st_nlink = is_dir ? 2 : 1;
+    stbuf->st_uid = getuid();
+    stbuf->st_gid = getgid();
     stbuf->st_blksize = kBlockSize;
-  } catch (NoEntry &e) {
-    return -ENOENT;
+    return 0;
   }
+  naivefs::Stat st;
+  auto ret = has_fh(fi) ? volume->fstat(fi->fh, st) : volume->stat(path, st);
+  if (ret != 0)
+    return ret;
+  fill_stat(st, stbuf);
   return 0;
 }
 
-} // namespace vfs
\ No newline at end of file
+} // namespace vfs
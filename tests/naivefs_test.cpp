@@ -0,0 +1,1097 @@
+// in-process tests over libnaivefs, one ctest case per feature
+//
+//   naivefs_test <case>
+//
+// volumes have no background threads
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <sys/stat.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+#include "naivefs.hpp"
+#include "nfs/config.hpp"
+#include "nfs/lock.hpp"
+#include "nfs/optrace.hpp"
+#include "nfs/pool.hpp"
+#include "nfs/span.hpp"
+#include "nfs/trace.hpp"
+#include "nfs/utils.hpp"
+
+#define CHECK(cond)                                                            \
+  do {                                                                         \
+    if (!(cond)) {                                                             \
+      fprintf(stderr, "%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__,         \
+              #cond);                                                          \
+      exit(1);                                                                 \
+    }                                                                          \
+  } while (0)
+
+namespace {
+
+using naivefs::Stat;
+using naivefs::Volume;
+using naivefs::VolumeOptions;
+
+constexpr uint32_t kBlock = 4096;
+
+// a disk image named after the case in the working directory, removed
+// once the case is done
+class TempDisk {
+  std::string path_;
+
+public:
+  explicit TempDisk(const std::string &name)
+      : path_("naivefs_test_" + name + ".disk") {
+    unlink(path_.c_str());
+  }
+  ~TempDisk() { unlink(path_.c_str()); }
+
+  const std::string &path() const { return path_; }
+};
+
+std::unique_ptr<Volume> mount(const std::string &path,
+                              VolumeOptions options = {}) {
+  options.background = false;
+  auto volume = Volume::open(path, options);
+  CHECK(volume != nullptr);
+  return volume;
+}
+
+// a volume on a MemDisk, nothing survives it
+std::unique_ptr<Volume> scratch(VolumeOptions options = {}) {
+  options.backend = "mem";
+  return mount("scratch", options);
+}
+
+// the value of a line "<kind> <name> <value>" of the stats
+uint64_t stat_of(Volume &volume, const std::string &name) {
+  auto stats = volume.stats();
+  auto pos = stats.find(" " + name + " ");
+  CHECK(pos != std::string::npos);
+  return std::strtoull(stats.c_str() + pos + name.length() + 2, nullptr, 10);
+}
+
+std::string pattern(const uint32_t size, const char seed) {
+  std::string data(size, '\0');
+  for (uint32_t i = 0; i < size; i++)
+    data[i] = static_cast<char>(seed + i % 251);
+  return data;
+}
+
+void put(Volume &volume, const char *path, const std::string &data,
+         const uint64_t offset = 0) {
+  uint64_t fh;
+  CHECK(volume.open(path, O_CREAT | O_RDWR, fh) == 0);
+  CHECK(volume.write(fh, data.data(), data.size(), offset) ==
+        static_cast<int64_t>(data.size()));
+  CHECK(volume.release(fh) == 0);
+}
+
+std::string get(Volume &volume, const char *path) {
+  Stat st;
+  CHECK(volume.stat(path, st) == 0);
+  std::string data(st.size, '\0');
+  uint64_t fh;
+  CHECK(volume.open(path, O_RDONLY, fh) == 0);
+  uint64_t done = 0;
+  while (done < st.size) {
+    auto size = std::min<uint64_t>(st.size - done, 128 * 1024);
+    auto ret = volume.read(fh, data.data() + done, size, done);
+    CHECK(ret > 0);
+    done += ret;
+  }
+  CHECK(volume.release(fh) == 0);
+  return data;
+}
+
+// the in-process api and its errors
+void test_volume() {
+  auto volume = scratch();
+  CHECK(volume->mkdir("/d", 0755) == 0);
+  CHECK(volume->mkdir("/d", 0755) == -EEXIST);
+  auto data = pattern(3 * kBlock + 100, 'a');
+  put(*volume, "/d/f", data);
+  CHECK(get(*volume, "/d/f") == data);
+  Stat st;
+  CHECK(volume->stat("/d/f", st) == 0 && st.size == data.size());
+  CHECK(volume->stat("/nope", st) == -ENOENT);
+  CHECK(volume->rmdir("/d") == -ENOTEMPTY);
+  CHECK(volume->rename("/d/f", "/g", 0) == 0);
+  CHECK(volume->stat("/d/f", st) == -ENOENT);
+  CHECK(get(*volume, "/g") == data);
+  std::vector<std::string> names;
+  CHECK(volume->readdir("/", names) == 0 && names.size() == 2);
+  CHECK(volume->truncate("/g", 10) == 0);
+  CHECK(volume->stat("/g", st) == 0 && st.size == 10);
+  CHECK(volume->unlink("/g") == 0 && volume->rmdir("/d") == 0);
+  CHECK(volume->sync() == 0);
+  char buf[16];
+  CHECK(volume->read(12345, buf, sizeof(buf), 0) == -EBADF);
+  CHECK(volume->write(12345, buf, sizeof(buf), 0) == -EBADF);
+}
+
+// files end at 4 GiB, nothing past it is cut down to 32 bits
+void test_limits() {
+  auto volume = scratch();
+  auto data = pattern(kBlock, 'a');
+  put(*volume, "/f", data);
+  uint64_t fh;
+  CHECK(volume->open("/f", O_RDWR, fh) == 0);
+  auto other = pattern(2 * kBlock, 'x');
+  CHECK(volume->write(fh, other.data(), kBlock, 1ull << 32) == -EFBIG);
+  CHECK(volume->write(fh, other.data(), 2 * kBlock, 0xfffff000ull) ==
+        -EFBIG);
+  CHECK(volume->ftruncate(fh, (4ull << 30) + 10) == -EFBIG);
+  CHECK(volume->truncate("/f", 1ull << 40) == -EFBIG);
+  CHECK(volume->release(fh) == 0);
+  CHECK(get(*volume, "/f") == data);
+}
+
+// the imap grows page by page and comes back from the checkpoint
+void test_imap() {
+  TempDisk disk("imap");
+  constexpr uint32_t kFiles = 3000;
+  std::vector<uint32_t> inos(kFiles);
+  {
+    auto volume = mount(disk.path());
+    for (uint32_t i = 0; i < kFiles; i++) {
+      auto path = "/f" + std::to_string(i);
+      uint64_t fh;
+      Stat st;
+      CHECK(volume->open(path.c_str(), O_CREAT | O_RDWR, fh) == 0);
+      CHECK(volume->fstat(fh, st) == 0 && volume->release(fh) == 0);
+      inos[i] = st.ino;
+    }
+    CHECK(stat_of(*volume, "inodes") == kFiles + 1);
+  }
+  auto volume = mount(disk.path());
+  CHECK(stat_of(*volume, "inodes") == kFiles + 1);
+  for (uint32_t i = 0; i < kFiles; i++) {
+    Stat st;
+    CHECK(volume->stat(("/f" + std::to_string(i)).c_str(), st) == 0);
+    CHECK(st.ino == inos[i]);
+  }
+}
+
+// numbers freed by unlink are handed out again after a remount
+void test_inode_reuse() {
+  TempDisk disk("inode_reuse");
+  constexpr uint32_t kFiles = 100;
+  std::vector<uint32_t> freed;
+  uint32_t max_ino = 0;
+  {
+    auto volume = mount(disk.path());
+    for (uint32_t i = 0; i < kFiles; i++)
+      put(*volume, ("/f" + std::to_string(i)).c_str(), "x");
+    for (uint32_t i = 1; i < kFiles; i += 2) {
+      auto path = "/f" + std::to_string(i);
+      Stat st;
+      CHECK(volume->stat(path.c_str(), st) == 0);
+      max_ino = std::max(max_ino, st.ino);
+      freed.push_back(st.ino);
+      CHECK(volume->unlink(path.c_str()) == 0);
+    }
+  }
+  auto volume = mount(disk.path());
+  std::sort(freed.begin(), freed.end());
+  for (uint32_t i = 0; i < freed.size(); i++) {
+    auto path = "/g" + std::to_string(i);
+    put(*volume, path.c_str(), "y");
+    Stat st;
+    CHECK(volume->stat(path.c_str(), st) == 0);
+    CHECK(st.ino <= max_ino);
+    CHECK(std::binary_search(freed.begin(), freed.end(), st.ino));
+  }
+}
+
+// handles carry their own state and a generation
+void test_handles() {
+  auto volume = scratch();
+  put(*volume, "/f", "abc");
+  uint64_t plain, append;
+  CHECK(volume->open("/f", O_RDWR, plain) == 0);
+  CHECK(volume->open("/f", O_RDWR | O_APPEND, append) == 0);
+  CHECK(plain != append);
+  CHECK(volume->write(append, "de", 2, 0) == 2);
+  CHECK(volume->write(plain, "X", 1, 0) == 1);
+  CHECK(get(*volume, "/f") == "Xbcde");
+  CHECK(volume->release(plain) == 0);
+  CHECK(volume->release(plain) == -EBADF);
+  // the slot is reused under a new generation
+  uint64_t again;
+  CHECK(volume->open("/f", O_RDONLY, again) == 0);
+  CHECK(again != plain);
+  char buf[8];
+  CHECK(volume->read(plain, buf, sizeof(buf), 0) == -EBADF);
+  CHECK(volume->read(again, buf, sizeof(buf), 0) == 5);
+  // still readable through a handle once unlinked
+  CHECK(volume->unlink("/f") == 0);
+  CHECK(volume->read(again, buf, sizeof(buf), 0) == 5);
+  CHECK(volume->release(again) == 0 && volume->release(append) == 0);
+  CHECK(stat_of(*volume, "inodes") == 1);
+}
+
+// a copy of the image as a crash would leave it, holes stay holes
+void copy_disk(const std::string &from, const std::string &to) {
+  auto in = open(from.c_str(), O_RDONLY);
+  auto out = open(to.c_str(), O_CREAT | O_TRUNC | O_WRONLY, 0644);
+  CHECK(in != -1 && out != -1);
+  auto size = lseek(in, 0, SEEK_END);
+  CHECK(ftruncate(out, size) == 0);
+  std::vector<char> buf(1 << 20);
+  off_t pos = 0;
+  while ((pos = lseek(in, pos, SEEK_DATA)) != -1) {
+    auto end = lseek(in, pos, SEEK_HOLE);
+    while (pos < end) {
+      auto ret = pread(in, buf.data(), std::min<off_t>(buf.size(), end - pos),
+                       pos);
+      CHECK(ret > 0 && pwrite(out, buf.data(), ret, pos) == ret);
+      pos += ret;
+    }
+  }
+  close(in);
+  close(out);
+}
+
+// the offset of the first kCompressUnit of an image which holds data, -1 if
+// none does
+off_t find_unit(const std::string &path, const std::string &data) {
+  auto fd = open(path.c_str(), O_RDONLY);
+  CHECK(fd != -1);
+  char unit[kCompressUnit];
+  off_t pos = 0, found = -1;
+  while (found == -1 && (pos = lseek(fd, pos, SEEK_DATA)) != -1) {
+    auto end = lseek(fd, pos, SEEK_HOLE);
+    for (; found == -1 && pos < end; pos += sizeof(unit)) {
+      CHECK(pread(fd, unit, sizeof(unit), pos) == sizeof(unit));
+      if (memmem(unit, sizeof(unit), data.data(), data.size()) != nullptr)
+        found = pos;
+    }
+  }
+  close(fd);
+  return found;
+}
+
+// an inode unlinked while open is freed at unmount, and after a crash by the
+// next mount
+void test_orphans() {
+  TempDisk disk("orphans");
+  TempDisk crashed("orphans_crashed");
+  uint32_t ino;
+  {
+    auto volume = mount(disk.path());
+    uint64_t fh;
+    Stat st;
+    CHECK(volume->open("/f", O_CREAT | O_RDWR, fh) == 0);
+    auto data = pattern(256 * kBlock, 'a');
+    CHECK(volume->write(fh, data.data(), data.size(), 0) ==
+          static_cast<int64_t>(data.size()));
+    CHECK(volume->fstat(fh, st) == 0);
+    ino = st.ino;
+    CHECK(volume->unlink("/f") == 0 && volume->sync() == 0);
+    CHECK(stat_of(*volume, "inodes") == 3);
+    copy_disk(disk.path(), crashed.path());
+  }
+  for (const auto &path : {disk.path(), crashed.path()}) {
+    auto volume = mount(path);
+    // the root and the empty orphan list
+    CHECK(stat_of(*volume, "inodes") == 2);
+    uint64_t fh;
+    Stat st;
+    CHECK(volume->open("/g", O_CREAT | O_RDWR, fh) == 0);
+    CHECK(volume->fstat(fh, st) == 0 && volume->release(fh) == 0);
+    CHECK(st.ino == ino);
+  }
+}
+
+// fsync through a handle opened after the write still checkpoints it
+void test_fsync_reopen() {
+  TempDisk disk("fsync_reopen");
+  TempDisk crashed("fsync_reopen_crashed");
+  {
+    auto volume = mount(disk.path());
+    put(*volume, "/f", "aaaa");
+    CHECK(volume->sync() == 0);
+    put(*volume, "/f", "bbbb");
+    uint64_t fh;
+    CHECK(volume->open("/f", O_RDONLY, fh) == 0);
+    CHECK(volume->fsync(fh) == 0);
+    copy_disk(disk.path(), crashed.path());
+    CHECK(volume->release(fh) == 0);
+  }
+  auto volume = mount(crashed.path());
+  CHECK(get(*volume, "/f") == "bbbb");
+}
+
+// pooled buffers are aligned and recycled per size class, partial blocks are
+// zero filled
+void test_pool() {
+  auto first = BufferPool::allocate(100);
+  CHECK(reinterpret_cast<uintptr_t>(first.get()) % 512 == 0);
+  auto ptr = first.get();
+  first.reset();
+  auto again = BufferPool::allocate(kBlock);
+  CHECK(again.get() == ptr);
+  auto huge = BufferPool::allocate(2 * kSegmentSize);
+  CHECK(reinterpret_cast<uintptr_t>(huge.get()) % 512 == 0);
+  std::memset(huge.get(), 1, 2 * kSegmentSize);
+
+  auto volume = scratch();
+  put(*volume, "/f", "tail", 100);
+  CHECK(get(*volume, "/f") == std::string(100, '\0') + "tail");
+}
+
+// components are viewed in place, repeated and trailing slashes are skipped
+void test_paths() {
+  std::vector<std::string_view> components;
+  PathIter iter("//a/bc///d/");
+  std::string_view component;
+  while (iter.next(component))
+    components.push_back(component);
+  CHECK((components == std::vector<std::string_view>{"a", "bc", "d"}));
+  CHECK(split_parent("/a/b/c") ==
+        std::make_pair(std::string_view("/a/b"), std::string_view("c")));
+  CHECK(split_parent("/a") ==
+        std::make_pair(std::string_view(""), std::string_view("a")));
+  CHECK(split_parent("/a/b/") ==
+        std::make_pair(std::string_view("/a"), std::string_view("b")));
+
+  auto volume = scratch();
+  CHECK(volume->mkdir("/dir", 0755) == 0);
+  CHECK(volume->mkdir("/dir//sub/", 0755) == 0);
+  put(*volume, "/dir/sub//f", "data");
+  CHECK(get(*volume, "//dir/sub/f") == "data");
+  std::string name(255, 'n');
+  put(*volume, ("/dir/" + name).c_str(), "long");
+  CHECK(get(*volume, ("/dir/" + name).c_str()) == "long");
+}
+
+// traces go to per-thread rings, read back through Trace::dump, levels above
+// NFS_TRACE_LEVEL do not even evaluate their arguments
+void test_trace() {
+  uint32_t evaluated = 0;
+  auto count = [&evaluated] { return ++evaluated; };
+  NFS_TRACE(kVerbose, kFS, "counted {}", count());
+  CHECK(evaluated == (kTraceLevel >= TraceLevel::kVerbose ? 1u : 0u));
+  if (kTraceLevel < TraceLevel::kInfo)
+    return;
+
+  std::thread([] {
+    for (uint32_t i = 0; i < kTraceRingEntries + 10; i++)
+      NFS_TRACE(kInfo, kFS, "wrap {} {}", i, "str");
+  }).join();
+  auto dump = Trace::dump();
+  CHECK(dump.find("INFO fs: wrap 0 str\n") == std::string::npos);
+  CHECK(dump.find("INFO fs: wrap 10 str\n") != std::string::npos);
+  CHECK(dump.find("INFO fs: wrap " + std::to_string(kTraceRingEntries + 9) +
+                  " str\n") != std::string::npos);
+  // threads one after another take over the same ring
+  for (uint32_t t = 0; t < 64; t++)
+    std::thread([t] { NFS_TRACE(kInfo, kFS, "reuse {}", t); }).join();
+  dump = Trace::dump();
+  std::string tid;
+  for (uint32_t t = 0; t < 64; t++) {
+    auto end = dump.find(" INFO fs: reuse " + std::to_string(t) + "\n");
+    CHECK(end != std::string::npos);
+    auto begin = dump.rfind('[', end);
+    CHECK(tid.empty() || dump.compare(begin, end - begin, tid) == 0);
+    tid = dump.substr(begin, end - begin);
+  }
+
+  auto volume = scratch();
+  CHECK(volume->sync() == 0);
+  CHECK(Trace::dump().find("checkpoint: flushing checkpoint region") !=
+        std::string::npos);
+}
+
+// counters from every thread add up, each op has a histogram
+void test_metrics() {
+  auto volume = scratch();
+  auto written = stat_of(*volume, "user_bytes_written");
+  auto data = pattern(kBlock, 'a');
+  std::vector<std::thread> threads;
+  for (uint32_t t = 0; t < 4; t++)
+    threads.emplace_back([&, t] {
+      auto path = "/f" + std::to_string(t);
+      for (uint32_t i = 0; i < 8; i++)
+        put(*volume, path.c_str(), data, i * kBlock);
+    });
+  for (auto &thread : threads)
+    thread.join();
+  CHECK(stat_of(*volume, "user_bytes_written") - written == 32 * kBlock);
+  CHECK(stat_of(*volume, "write count") == 32);
+  CHECK(stat_of(*volume, "open count") == 32);
+  // short lived threads take over the shards of exited ones, keeping what
+  // those recorded
+  for (uint32_t t = 0; t < 64; t++)
+    std::thread([&] { put(*volume, "/g", data); }).join();
+  CHECK(stat_of(*volume, "write count") == 96);
+  CHECK(stat_of(*volume, "user_bytes_written") - written == 96 * kBlock);
+  CHECK(volume->sync() == 0);
+  CHECK(stat_of(*volume, "checkpoint count") == 1);
+  CHECK(stat_of(*volume, "checkpoints") == 1);
+  CHECK(volume->stats().find("timer write count 96 avg_us ") !=
+        std::string::npos);
+}
+
+// spans of each request export as Chrome trace events
+void test_spans() {
+  // read once, before the first span
+  CHECK(setenv("NAIVEFS_SPANS", "1", 1) == 0);
+  CHECK(Spans::enabled());
+  auto volume = scratch();
+  put(*volume, "/f", pattern(kBlock, 'a'));
+  CHECK(volume->sync() == 0);
+  auto json = Spans::export_json();
+  CHECK(json.rfind("{\"traceEvents\":[{", 0) == 0);
+  CHECK(json.size() > 3 && json.compare(json.size() - 3, 3, "]}\n") == 0);
+  CHECK(json.find("{\"name\":\"write\",\"ph\":\"X\"") != std::string::npos);
+  CHECK(json.find("{\"name\":\"checkpoint\",\"ph\":\"X\"") !=
+        std::string::npos);
+  // the root span of the sync and the checkpoint inside it share a request
+  auto fsync = json.find("{\"name\":\"fsync\"");
+  auto checkpoint = json.find("{\"name\":\"checkpoint\"");
+  CHECK(fsync != std::string::npos);
+  auto req_of = [&json](const size_t pos) {
+    auto req = json.find("\"req\":", pos);
+    return std::strtoul(json.c_str() + req + 6, nullptr, 10);
+  };
+  CHECK(req_of(fsync) == req_of(checkpoint));
+  // threads one after another take over the same ring
+  for (uint32_t t = 0; t < 64; t++)
+    std::thread([] { NFS_SPAN("reuse"); }).join();
+  json = Spans::export_json();
+  std::string tid;
+  uint32_t count = 0;
+  for (auto pos = json.find("{\"name\":\"reuse\"");
+       pos != std::string::npos;
+       pos = json.find("{\"name\":\"reuse\"", pos + 1)) {
+    auto begin = json.find("\"tid\":", pos);
+    auto end = json.find(',', begin);
+    CHECK(tid.empty() || json.compare(begin, end - begin, tid) == 0);
+    tid = json.substr(begin, end - begin);
+    count += 1;
+  }
+  CHECK(count == 64);
+}
+
+// guards lock and unlock, contention is profiled when built in
+void test_locks() {
+  ProfiledSharedMutex mutex("test_lock");
+  {
+    auto shared = mutex.lock_shared();
+    auto other = mutex.lock_shared();
+    CHECK(shared.owns_lock() && other.owns_lock());
+  }
+  auto guard = mutex.lock();
+  std::thread waiter([&mutex] { auto wait = mutex.lock(); });
+  std::this_thread::sleep_for(std::chrono::milliseconds(20));
+  auto moved = std::move(guard);
+  CHECK(!guard.owns_lock() && moved.owns_lock());
+  moved.unlock();
+  CHECK(!moved.owns_lock());
+  waiter.join();
+  auto report = LockStats::report();
+#ifdef NFS_LOCK_PROFILE
+  CHECK(report.find("lock test_lock exclusive 2 shared 2 contended 1 ") !=
+        std::string::npos);
+  CHECK(report.find("lock_site test_lock naivefs_test.cpp:") !=
+        std::string::npos);
+#else
+  CHECK(report.empty());
+#endif
+}
+
+// every backend reads back, file and mmap share the image format
+void test_backends() {
+  TempDisk disk("backends");
+  auto data = pattern(5 * kBlock + 7, 'b');
+  VolumeOptions options;
+  options.backend = "bogus";
+  CHECK(Volume::open(disk.path(), options) == nullptr);
+  options.backend = "mmap";
+  {
+    auto volume = mount(disk.path(), options);
+    put(*volume, "/f", data);
+  }
+  options.backend = "file";
+  {
+    auto volume = mount(disk.path(), options);
+    CHECK(get(*volume, "/f") == data);
+    put(*volume, "/g", data, kBlock);
+  }
+  options.backend = "mmap";
+  {
+    auto volume = mount(disk.path(), options);
+    CHECK(get(*volume, "/f") == data);
+    CHECK(get(*volume, "/g").substr(kBlock) == data);
+  }
+  {
+    auto volume = scratch();
+    put(*volume, "/f", data);
+    CHECK(get(*volume, "/f") == data);
+  }
+  Stat st;
+  CHECK(scratch()->stat("/f", st) == -ENOENT);
+}
+
+// a shaped disk behaves like the one it wraps, a torn write loses nothing
+// checkpointed before it
+void test_sim_disk() {
+  TempDisk disk("sim_disk");
+  auto data = pattern(3 * kBlock, 's');
+  VolumeOptions options;
+  options.sim = "bogus";
+  CHECK(Volume::open(disk.path(), options) == nullptr);
+  options.sim = "ssd";
+  {
+    auto volume = mount(disk.path(), options);
+    put(*volume, "/f", data);
+    CHECK(get(*volume, "/f") == data);
+  }
+  options.sim = "none";
+  options.sim_torn = 1;
+  {
+    auto volume = mount(disk.path(), options);
+    CHECK(get(*volume, "/f") == data);
+    put(*volume, "/f", pattern(3 * kBlock, 't'));
+    put(*volume, "/g", data);
+    volume->sync();
+  }
+  auto volume = mount(disk.path());
+  CHECK(get(*volume, "/f") == data);
+  Stat st;
+  CHECK(volume->stat("/g", st) == -ENOENT);
+}
+
+// every call is recorded in the order it returned, the trace is left behind for
+// the replay case
+void test_optrace() {
+  using Op = OpTrace::Op;
+  const char *trace = "naivefs_test_optrace.trace";
+  VolumeOptions options;
+  options.optrace = trace;
+  {
+    auto volume = scratch(options);
+    CHECK(Volume::open("other", options) == nullptr);
+    CHECK(volume->mkdir("/d", 0750) == 0);
+    put(*volume, "/d/f", pattern(2 * kBlock, 'o'), 100);
+    CHECK(volume->rename("/d/f", "/g", 0) == 0);
+    CHECK(volume->truncate("/g", kBlock) == 0);
+    CHECK(get(*volume, "/g").size() == kBlock);
+    put(*volume, "/h", "");
+    uint64_t in, out;
+    CHECK(volume->open("/g", O_RDONLY, in) == 0);
+    CHECK(volume->open("/h", O_RDWR, out) == 0);
+    CHECK(volume->copy_file_range(in, 100, out, 10, 1000) == 1000);
+    CHECK(volume->release(in) == 0 && volume->release(out) == 0);
+  }
+  auto file = fopen(trace, "rb");
+  CHECK(file != nullptr);
+  OpTrace::Reader reader(file);
+  CHECK(reader.valid());
+  std::vector<OpTrace::Entry> entries;
+  for (OpTrace::Entry entry; reader.next(entry);)
+    entries.push_back(entry);
+  CHECK(entries.size() == 18);
+  const Op ops[] = {Op::kMkdir,         Op::kOpen,    Op::kWrite,
+                    Op::kRelease,       Op::kRename,  Op::kTruncate,
+                    Op::kGetattr,       Op::kOpen,    Op::kRead,
+                    Op::kRelease,       Op::kOpen,    Op::kWrite,
+                    Op::kRelease,       Op::kOpen,    Op::kOpen,
+                    Op::kCopyFileRange, Op::kRelease, Op::kRelease};
+  for (uint32_t i = 0; i < entries.size(); i++)
+    CHECK(entries[i].op() == ops[i]);
+  CHECK(entries[0].path == "/d" && entries[0].rec.flags == 0750);
+  CHECK(entries[1].path == "/d/f" &&
+        entries[1].rec.flags == (O_CREAT | O_RDWR));
+  CHECK(entries[2].rec.fh == entries[1].rec.fh &&
+        entries[2].rec.offset == 100 && entries[2].rec.size == 2 * kBlock);
+  CHECK(entries[3].rec.fh == entries[1].rec.fh);
+  CHECK(entries[4].path == "/d/f" && entries[4].path2 == "/g");
+  const auto &copy = entries[15];
+  CHECK(copy.path.empty() && copy.path2.empty());
+  CHECK(copy.rec.fh2 == entries[13].rec.fh && copy.rec.offset2 == 100);
+  CHECK(copy.rec.fh == entries[14].rec.fh && copy.rec.offset == 10 &&
+        copy.rec.size == 1000);
+  for (uint32_t i = 1; i < entries.size(); i++)
+    CHECK(entries[i].rec.ns >= entries[i - 1].rec.ns);
+}
+
+// compressible blocks take less log, any block reads back with compression on
+// or off
+void test_compress() {
+  TempDisk disk("compress");
+  std::string text;
+  while (text.size() < 64 * kBlock)
+    text += "compressible text, compressible text. ";
+  text.resize(64 * kBlock);
+  std::string noise(16 * kBlock, '\0');
+  uint64_t state = 88172645463325252ull;
+  for (auto &c : noise) {
+    state ^= state << 13, state ^= state >> 7, state ^= state << 17;
+    c = static_cast<char>(state);
+  }
+  VolumeOptions options;
+  options.compress = true;
+  {
+    auto volume = mount(disk.path(), options);
+    put(*volume, "/text", text);
+    put(*volume, "/noise", noise);
+    CHECK(volume->sync() == 0);
+    CHECK(stat_of(*volume, "blocks_compressed") >= 64);
+    CHECK(stat_of(*volume, "blocks_compressed") < 80);
+    CHECK(stat_of(*volume, "compress_bytes_saved") > 32 * kBlock);
+    CHECK(get(*volume, "/text") == text && get(*volume, "/noise") == noise);
+    // a partial overwrite of a compressed block
+    put(*volume, "/text", "plain", 10);
+    text.replace(10, 5, "plain");
+  }
+  {
+    auto volume = mount(disk.path());
+    CHECK(get(*volume, "/text") == text && get(*volume, "/noise") == noise);
+  }
+
+  // a record which does not decode fails the read, it never passes for data
+  TempDisk corrupt("compress_corrupt");
+  {
+    auto volume = mount(corrupt.path(), options);
+    put(*volume, "/f", text.substr(0, kBlock));
+  }
+  // the first literal lies in the first unit of the record, which starts
+  // with the length of the compressed data
+  auto record = find_unit(corrupt.path(), text.substr(0, 19));
+  CHECK(record != -1);
+  auto fd = open(corrupt.path().c_str(), O_WRONLY);
+  CHECK(fd != -1 && pwrite(fd, "\xff\xff", 2, record) == 2);
+  close(fd);
+  auto volume = mount(corrupt.path());
+  uint64_t fh;
+  char buf[kBlock];
+  CHECK(volume->open("/f", O_RDONLY, fh) == 0);
+  CHECK(volume->read(fh, buf, kBlock, 0) == -EIO);
+  CHECK(volume->read(fh, buf, 100, 10) == -EIO);
+  CHECK(volume->release(fh) == 0);
+}
+
+// small files and directories live in the inode, they spill to blocks when they
+// grow and come back when they shrink
+void test_inline() {
+  TempDisk disk("inline");
+  auto data = pattern(300, 'i');
+  Stat st;
+  {
+    auto volume = mount(disk.path());
+    put(*volume, "/f", data.substr(0, 10));
+    CHECK(volume->stat("/f", st) == 0 && st.size == 10 && st.blocks == 0);
+    CHECK(get(*volume, "/f") == data.substr(0, 10));
+    put(*volume, "/f", data.substr(10, 94), 10);
+    CHECK(volume->stat("/f", st) == 0 && st.size == 104 && st.blocks == 0);
+    put(*volume, "/f", data.substr(104), 104);
+    CHECK(volume->stat("/f", st) == 0 && st.size == 300 && st.blocks == 8);
+    CHECK(get(*volume, "/f") == data);
+    CHECK(volume->truncate("/f", 50) == 0);
+    CHECK(volume->stat("/f", st) == 0 && st.size == 50 && st.blocks == 0);
+    CHECK(get(*volume, "/f") == data.substr(0, 50));
+    // growing again reads zeros past the old end, not stale block content
+    CHECK(volume->truncate("/f", 200) == 0);
+    CHECK(get(*volume, "/f") == data.substr(0, 50) + std::string(150, '\0'));
+
+    CHECK(volume->mkdir("/d", 0755) == 0);
+    put(*volume, "/d/a", "a");
+    CHECK(volume->stat("/d", st) == 0 && st.blocks == 0);
+    for (int i = 0; i < 20; i++)
+      put(*volume, ("/d/file" + std::to_string(i)).c_str(), "x");
+    CHECK(volume->stat("/d", st) == 0 && st.blocks > 0);
+    for (int i = 0; i < 20; i++)
+      CHECK(volume->unlink(("/d/file" + std::to_string(i)).c_str()) == 0);
+  }
+  auto volume = mount(disk.path());
+  CHECK(get(*volume, "/f") == data.substr(0, 50) + std::string(150, '\0'));
+  CHECK(get(*volume, "/d/a") == "a");
+  std::vector<std::string> names;
+  CHECK(volume->readdir("/d", names) == 0);
+  CHECK(std::count(names.begin(), names.end(), "a") == 1);
+}
+
+// inodes written together share a block, one read serves them all
+void test_inode_blocks() {
+  TempDisk disk("inode_blocks");
+  constexpr uint32_t kDirs = 4, kFiles = 64;
+  auto path_of = [](const uint32_t dir, const uint32_t file) {
+    return "/d" + std::to_string(dir) + "/f" + std::to_string(file);
+  };
+  {
+    auto volume = mount(disk.path());
+    for (uint32_t d = 0; d < kDirs; d++) {
+      CHECK(volume->mkdir(("/d" + std::to_string(d)).c_str(), 0755) == 0);
+      for (uint32_t f = 0; f < kFiles; f++)
+        put(*volume, path_of(d, f).c_str(), std::string(f, 'x'));
+    }
+  }
+  auto volume = mount(disk.path());
+  auto misses = stat_of(*volume, "inode_cache_misses");
+  for (uint32_t d = 0; d < kDirs; d++)
+    for (uint32_t f = 0; f < kFiles; f++) {
+      Stat st;
+      CHECK(volume->stat(path_of(d, f).c_str(), st) == 0 && st.size == f);
+    }
+  misses = stat_of(*volume, "inode_cache_misses") - misses;
+  CHECK(misses > 0 && misses * 8 < kDirs * kFiles);
+  CHECK(stat_of(*volume, "inode_cache_hits") > kDirs * kFiles / 2);
+  // a rewritten inode is never served from a stale cached block
+  for (uint32_t f = 0; f < kFiles; f++)
+    put(*volume, path_of(0, f).c_str(), "y", f);
+  for (uint32_t f = 0; f < kFiles; f++) {
+    Stat st;
+    CHECK(volume->stat(path_of(0, f).c_str(), st) == 0);
+    CHECK(st.size == f + 1);
+  }
+  CHECK(get(*volume, path_of(0, 3).c_str()) == "xxxy");
+}
+
+// holes read as zeros and are found by lseek, fallocate punches and zeroes
+// ranges, a sparse file reaches the 4 GiB limit
+void test_sparse() {
+  TempDisk disk("sparse");
+  auto data = pattern(kBlock, 'p');
+  const uint64_t tail = UINT32_MAX - kBlock + 1;
+  {
+    auto volume = mount(disk.path());
+    uint64_t fh;
+    CHECK(volume->open("/f", O_CREAT | O_RDWR, fh) == 0);
+    CHECK(volume->write(fh, data.data(), kBlock, 0) == kBlock);
+    CHECK(volume->write(fh, data.data(), kBlock, 10 * kBlock) == kBlock);
+    CHECK(volume->lseek(fh, 0, SEEK_HOLE) == kBlock);
+    CHECK(volume->lseek(fh, kBlock, SEEK_DATA) == 10 * kBlock);
+    CHECK(volume->lseek(fh, 10 * kBlock, SEEK_HOLE) == 11 * kBlock);
+    CHECK(volume->lseek(fh, 11 * kBlock, SEEK_DATA) == -ENXIO);
+    CHECK(volume->lseek(fh, 0, SEEK_SET) == -EINVAL);
+    CHECK(get(*volume, "/f") ==
+          data + std::string(9 * kBlock, '\0') + data);
+
+    CHECK(volume->fallocate(fh, FALLOC_FL_PUNCH_HOLE, 0, kBlock) == -EINVAL);
+    CHECK(volume->fallocate(fh, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, 0,
+                            kBlock) == 0);
+    CHECK(volume->lseek(fh, 0, SEEK_DATA) == 10 * kBlock);
+    CHECK(volume->fallocate(fh, FALLOC_FL_ZERO_RANGE, 10 * kBlock + 100,
+                            100) == 0);
+    CHECK(volume->fallocate(fh, FALLOC_FL_KEEP_SIZE, 11 * kBlock, kBlock) ==
+          0);
+    Stat st;
+    CHECK(volume->fstat(fh, st) == 0 && st.size == 11 * kBlock);
+    CHECK(volume->fallocate(fh, 0, 11 * kBlock, kBlock) == 0);
+    CHECK(volume->fstat(fh, st) == 0 && st.size == 12 * kBlock);
+    CHECK(volume->fallocate(fh, 0, tail, 2 * kBlock) == -EFBIG);
+
+    CHECK(volume->ftruncate(fh, UINT32_MAX) == 0);
+    CHECK(volume->write(fh, data.data(), kBlock - 1, tail) == kBlock - 1);
+    CHECK(volume->write(fh, data.data(), kBlock, tail) == -EFBIG);
+    CHECK(volume->lseek(fh, 12 * kBlock, SEEK_DATA) ==
+          static_cast<int64_t>(tail));
+    CHECK(volume->release(fh) == 0);
+  }
+  auto volume = mount(disk.path());
+  Stat st;
+  CHECK(volume->stat("/f", st) == 0 && st.size == UINT32_MAX);
+  uint64_t fh;
+  CHECK(volume->open("/f", O_RDONLY, fh) == 0);
+  std::string buf(kBlock, 'z');
+  CHECK(volume->read(fh, buf.data(), kBlock, tail) == kBlock - 1);
+  CHECK(buf.compare(0, kBlock - 1, data, 0, kBlock - 1) == 0);
+  CHECK(volume->read(fh, buf.data(), kBlock, 0) == kBlock);
+  CHECK(buf == std::string(kBlock, '\0'));
+  auto expected = data;
+  std::fill_n(expected.begin() + 100, 100, '\0');
+  CHECK(volume->read(fh, buf.data(), kBlock, 10 * kBlock) == kBlock);
+  CHECK(buf == expected);
+  CHECK(volume->release(fh) == 0);
+}
+
+// segments left empty are punched out of the image once a checkpoint no longer
+// needs them
+void test_discard() {
+  TempDisk disk("discard");
+  auto allocated = [&disk] {
+    struct stat st;
+    CHECK(::stat(disk.path().c_str(), &st) == 0);
+    return static_cast<uint64_t>(st.st_blocks) * 512;
+  };
+  auto data = pattern(4 << 20, 'a');
+  {
+    auto volume = mount(disk.path());
+    put(*volume, "/f", data);
+    CHECK(volume->sync() == 0);
+    put(*volume, "/f", data);
+    CHECK(volume->sync() == 0);
+    // 8 MiB went to the log, the first copy is gone
+    CHECK(stat_of(*volume, "segments_discarded") >= 8);
+    CHECK(allocated() < (6 << 20));
+    CHECK(volume->unlink("/f") == 0);
+    CHECK(volume->sync() == 0 && volume->sync() == 0);
+    CHECK(stat_of(*volume, "log_bytes_discarded") >= (8 << 20));
+    CHECK(allocated() < (1 << 20));
+  }
+  auto volume = mount(disk.path());
+  Stat st;
+  CHECK(volume->stat("/f", st) == -ENOENT);
+  put(*volume, "/f", data);
+  CHECK(get(*volume, "/f") == data);
+}
+
+// identical blocks are stored once, overwriting one copy leaves the others
+// intact
+void test_dedup() {
+  TempDisk disk("dedup");
+  auto block = pattern(kBlock, 'd'), other = pattern(kBlock, 'e');
+  VolumeOptions options;
+  options.dedup = true;
+  {
+    auto volume = mount(disk.path(), options);
+    put(*volume, "/a", block);
+    auto appended = stat_of(*volume, "log_bytes_appended");
+    put(*volume, "/b", block);
+    CHECK(stat_of(*volume, "dedup_hits") == 1);
+    CHECK(stat_of(*volume, "dedup_mismatches") == 0);
+    CHECK(stat_of(*volume, "log_bytes_appended") - appended < kBlock);
+    // twice in one file too
+    put(*volume, "/c", block + block);
+    CHECK(stat_of(*volume, "dedup_hits") == 3);
+    put(*volume, "/a", other);
+    CHECK(get(*volume, "/a") == other && get(*volume, "/b") == block);
+    CHECK(get(*volume, "/c") == block + block);
+    CHECK(volume->truncate("/c", kBlock) == 0 && volume->unlink("/b") == 0);
+    CHECK(volume->sync() == 0);
+  }
+  // the counters are per process
+  auto volume = mount(disk.path(), options);
+  CHECK(get(*volume, "/a") == other && get(*volume, "/c") == block);
+  put(*volume, "/d", block);
+  CHECK(stat_of(*volume, "dedup_hits") == 4);
+  CHECK(get(*volume, "/d") == block);
+}
+
+// a snapshot keeps the volume as it was, mounts read-only and goes away when
+// deleted
+void test_snapshots() {
+  TempDisk disk("snapshots");
+  auto before = pattern(64 * kBlock, 'b'), after = pattern(64 * kBlock, 'a');
+  {
+    auto volume = mount(disk.path());
+    put(*volume, "/f", before);
+    put(*volume, "/gone", "x");
+    CHECK(volume->snapshot("s1") == 0);
+    CHECK(volume->snapshot("s1") == -EEXIST);
+    put(*volume, "/f", after);
+    CHECK(volume->unlink("/gone") == 0);
+    CHECK(volume->snapshot("s2") == 0);
+    std::vector<std::string> names;
+    CHECK(volume->list_snapshots(names) == 0);
+    std::sort(names.begin(), names.end());
+    CHECK(names == std::vector<std::string>({"s1", "s2"}));
+  }
+  VolumeOptions options;
+  options.snapshot = "nope";
+  CHECK(Volume::open(disk.path(), options) == nullptr);
+  options.snapshot = "s1";
+  {
+    auto volume = mount(disk.path(), options);
+    CHECK(get(*volume, "/f") == before && get(*volume, "/gone") == "x");
+    uint64_t fh;
+    CHECK(volume->open("/f", O_RDWR, fh) == -EROFS);
+    CHECK(volume->open("/f", O_RDONLY, fh) == 0);
+    CHECK(volume->write(fh, "y", 1, 0) == -EROFS);
+    CHECK(volume->release(fh) == 0);
+    CHECK(volume->mkdir("/d", 0755) == -EROFS);
+    CHECK(volume->unlink("/f") == -EROFS);
+    CHECK(volume->snapshot("s3") == -EROFS);
+  }
+  {
+    auto volume = mount(disk.path());
+    CHECK(get(*volume, "/f") == after);
+    CHECK(volume->delete_snapshot("s1") == 0);
+    CHECK(volume->delete_snapshot("s1") == -ENOENT);
+    std::vector<std::string> names;
+    CHECK(volume->list_snapshots(names) == 0);
+    CHECK(names == std::vector<std::string>({"s2"}));
+  }
+  options.snapshot = "s2";
+  auto volume = mount(disk.path(), options);
+  Stat st;
+  CHECK(get(*volume, "/f") == after && volume->stat("/gone", st) == -ENOENT);
+}
+
+// aligned ranges are shared with the copy, the copies diverge on the next write
+// to either of them
+void test_clone() {
+  TempDisk disk("clone");
+  auto data = pattern(8 * kBlock + 100, 'c');
+  {
+    auto volume = mount(disk.path());
+    put(*volume, "/src", data);
+    put(*volume, "/dst", "");
+    uint64_t in, out;
+    CHECK(volume->open("/src", O_RDWR, in) == 0);
+    CHECK(volume->open("/dst", O_RDWR, out) == 0);
+    auto appended = stat_of(*volume, "log_bytes_appended");
+    CHECK(volume->copy_file_range(in, 0, out, 0, 1 << 20) ==
+          static_cast<int64_t>(data.size()));
+    CHECK(stat_of(*volume, "blocks_cloned") == 8);
+    CHECK(stat_of(*volume, "log_bytes_appended") - appended < 2 * kBlock);
+    CHECK(get(*volume, "/dst") == data);
+    // unaligned, copied
+    CHECK(volume->copy_file_range(in, 10, out, data.size(), kBlock) == kBlock);
+    CHECK(stat_of(*volume, "blocks_cloned") == 8);
+    CHECK(volume->copy_file_range(in, data.size(), out, 0, kBlock) == 0);
+    CHECK(volume->write(in, "src", 3, 0) == 3);
+    CHECK(volume->write(out, "dst", 3, kBlock) == 3);
+    CHECK(volume->release(in) == 0 && volume->release(out) == 0);
+  }
+  auto volume = mount(disk.path());
+  auto src = data, dst = data + data.substr(10, kBlock);
+  src.replace(0, 3, "src");
+  dst.replace(kBlock, 3, "dst");
+  CHECK(get(*volume, "/src") == src && get(*volume, "/dst") == dst);
+  CHECK(volume->unlink("/src") == 0);
+  CHECK(get(*volume, "/dst") == dst);
+  // within one file the ranges must not overlap, through any handle
+  auto big = pattern(1 << 20, 'o');
+  put(*volume, "/big", big);
+  uint64_t in, out;
+  CHECK(volume->open("/big", O_RDONLY, in) == 0);
+  CHECK(volume->open("/big", O_RDWR, out) == 0);
+  CHECK(volume->copy_file_range(in, 0, out, 1000, 1 << 20) == -EINVAL);
+  CHECK(volume->copy_file_range(out, 1000, out, 0, 1 << 20) == -EINVAL);
+  CHECK(get(*volume, "/big") == big);
+  CHECK(volume->copy_file_range(in, 0, out, 1 << 20, 1 << 20) == 1 << 20);
+  CHECK(volume->copy_file_range(in, 1000, out, 0, 1000) == 1000);
+  CHECK(volume->release(in) == 0 && volume->release(out) == 0);
+  auto expected = big + big;
+  expected.replace(0, 1000, big, 1000, 1000);
+  CHECK(get(*volume, "/big") == expected);
+}
+
+// a large directory is read a page at a time from stable offsets, plus fills
+// the attributes on the way
+void test_readdir_pages() {
+  TempDisk disk("readdir_pages");
+  constexpr uint32_t kFiles = 3000, kPage = 128;
+  auto volume = mount(disk.path());
+  CHECK(volume->mkdir("/d", 0755) == 0);
+  for (uint32_t i = 0; i < kFiles; i++) {
+    auto path = "/d/a_somewhat_long_file_name_" + std::to_string(i);
+    put(*volume, path.c_str(), std::string(i % 7, 'r'));
+  }
+  // up to kPage names from offset, and the offset of the next page
+  auto page = [&volume](const uint64_t offset, const bool plus,
+                        std::vector<std::string> &names) {
+    uint64_t next = offset;
+    uint32_t count = 0;
+    auto fill = [&](const char *name, const Stat *st, uint64_t next_offset) {
+      if (count == kPage)
+        return false;
+      CHECK((st != nullptr) == plus);
+      if (plus) {
+        Stat expected;
+        CHECK(volume->stat(("/d/" + std::string(name)).c_str(), expected) ==
+              0);
+        CHECK(st->ino == expected.ino && st->size == expected.size);
+      }
+      names.push_back(name);
+      next = next_offset;
+      count += 1;
+      return true;
+    };
+    CHECK(volume->readdir("/d", offset, fill, plus) == 0);
+    return next;
+  };
+  std::vector<std::string> names;
+  std::vector<uint64_t> offsets = {0};
+  while (true) {
+    auto size = names.size();
+    auto next = page(offsets.back(), offsets.size() % 2 == 0, names);
+    if (names.size() == size)
+      break;
+    offsets.push_back(next);
+  }
+  CHECK(names.size() == kFiles && offsets.size() == kFiles / kPage + 2);
+  auto sorted = names;
+  std::sort(sorted.begin(), sorted.end());
+  CHECK(std::unique(sorted.begin(), sorted.end()) == sorted.end());
+  // a page starts where it did after entries before it are gone
+  for (uint32_t i = 0; i < 2 * kPage; i++)
+    CHECK(volume->unlink(("/d/" + names[i]).c_str()) == 0);
+  std::vector<std::string> again;
+  page(offsets[5], true, again);
+  CHECK(std::equal(again.begin(), again.end(), names.begin() + 5 * kPage));
+  again.clear();
+  CHECK(page(0, false, again) == offsets[3] && again.size() == kPage);
+  CHECK(again.front() == names[2 * kPage]);
+  // past the end
+  again.clear();
+  CHECK(page(offsets.back() + (1ull << 40), false, again) ==
+            offsets.back() + (1ull << 40) &&
+        again.empty());
+}
+
+struct Case {
+  const char *name;
+  void (*run)();
+};
+
+const Case kCases[] = {
+    {"volume", test_volume},
+    {"limits", test_limits},
+    {"imap", test_imap},
+    {"inode_reuse", test_inode_reuse},
+    {"handles", test_handles},
+    {"orphans", test_orphans},
+    {"fsync_reopen", test_fsync_reopen},
+    {"pool", test_pool},
+    {"paths", test_paths},
+    {"trace", test_trace},
+    {"metrics", test_metrics},
+    {"spans", test_spans},
+    {"locks", test_locks},
+    {"backends", test_backends},
+    {"sim_disk", test_sim_disk},
+    {"optrace", test_optrace},
+    {"compress", test_compress},
+    {"inline", test_inline},
+    {"inode_blocks", test_inode_blocks},
+    {"sparse", test_sparse},
+    {"discard", test_discard},
+    {"dedup", test_dedup},
+    {"snapshots", test_snapshots},
+    {"clone", test_clone},
+    {"readdir_pages", test_readdir_pages},
+};
+
+} // namespace
+
+int main(int argc, char **argv) {
+  if (argc != 2) {
+    fprintf(stderr, "usage: %s <case>\n", argv[0]);
+    return 2;
+  }
+  for (const auto &c : kCases) {
+    if (strcmp(c.name, argv[1]) != 0)
+      continue;
+    c.run();
+    return 0;
+  }
+  fprintf(stderr, "unknown case %s\n", argv[1]);
+  return 2;
+}